@@ -26,16 +26,22 @@ import time
 import os
 import string
 import select
+try:
+    import m3.m3rt_client as m3c
+except ImportError:
+    m3c=None
 
 
 class M3RtProxy:
-    def __init__(self,host=None,rpc_port=8000,verbose=True):
+    def __init__(self,host=None,rpc_port=8000,verbose=True,native_client=False):
         """M3RtProxy is the client interface to the M3RtServer.
     It manages the state of the server using XML_RPC methods. 
     It can query the server state,
     start/stop the run-time system, create a DataService connection,
     and publish/subscribe desired components to the DataService.
-    The DataService uses a faster TCP/IP socket on port 10000"""
+    The DataService uses a faster TCP/IP socket on port 10000
+    With native_client=True the DataService traffic goes through the C++ M3RtClient
+    (m3rt_client module) instead of the python socket code"""
         self.stopped = False
         self.host=host
         self.verbose=verbose
@@ -52,9 +58,15 @@ class M3RtProxy:
         self.published_command={}
         self.available_components=[]
         self.available_component_types=[]
+        self.component_types={}
+        self.control_seq=0
         self.log_comps={}
         self.log_names=[]
+        self.log_opts={}
         self.logname=None
+        self.log_tail=[]
+        self.log_tail_next=0
+        self.log_tail_end=False
         self.status_raw=mbs.M3StatusAll()
         self.command_raw=mbs.M3CommandAll()
         self.ns=0
@@ -63,6 +75,12 @@ class M3RtProxy:
         self.ros_svc =None
         self.use_timeout=True
         self.is_server_started=False
+        self.streaming=False
+        self.client=None
+        self.native_client=native_client
+        if native_client and m3c is None:
+            print 'M3 WARNING: m3rt_client module not found, using the python DataService client'
+            self.native_client=False
         try:
             self.proxy = xmlrpclib.ServerProxy('http://'+self.host+':'+str(self.rpc_port))
             if self.verbose: print 'Starting M3 RPC Client at ',self.host, 'on Port ',self.rpc_port,'...'
@@ -80,9 +98,43 @@ class M3RtProxy:
     def step(self):    
         """Update the server with commands and parameters. Fetch new status data.
     This should be called periodically within the main loop"""        
+        if self.client is not None:
+            self.__step_native()
+            return
+        if self.streaming:
+            # Status is pushed by the server, only send commands if we have some
+            if len(self.command_raw.name_cmd) or len(self.command_raw.name_param) or len(self.command_raw.control):
+                self.__send_command()
+            self.__recv_status_latest()
+            return
         self.__send_command()
         self.__recv_status()        
 
+    def start_streaming(self,rate_divisor=1):
+        """Ask the DataService to push the subscribed status right after every rate_divisor
+    cycles of the M3RtSystem. step() then only sends commands (if any) and returns the
+    freshest status received, without a round trip per sample."""
+        if self.data_socket is None and self.client is None:
+            raise m3t.M3Exception('M3RtProxy data socket not created')
+        if not self.proxy.ClientStartStreaming(self.data_port,int(rate_divisor)):
+            raise m3t.M3Exception('Unable to start streaming on port '+str(self.data_port))
+        self.streaming=True
+        if self.client is not None:
+            self.client.SetStreaming(True)
+
+    def stop_streaming(self):
+        """Go back to lockstep mode (one status per step)"""
+        if not self.streaming:
+            return
+        self.proxy.ClientStopStreaming(self.data_port)
+        self.streaming=False
+        if self.client is not None:
+            self.client.SetStreaming(False)
+            return
+        # Drop whatever was pushed in the meantime, but the log entries
+        while select.select([self.data_socket], [], [], 0.05)[0]:
+            self.__parse_log_tail(self.__recv_packet())
+
     def start(self,start_data_svc=True,start_ros_svc=False):
         """Startup the RtSystem on the server. This will load all available components
     and begin execution in state SAFEOP. It can also start a DataService"""
@@ -121,6 +173,7 @@ class M3RtProxy:
                     self.step()
                     self.make_safe_operational(comp_name)
             if self.data_svc is not None:
+                self.stop_streaming()
                 self.__stop_data_service()
             if self.ros_svc is not None:
                 self.__stop_ros_service()
@@ -133,6 +186,7 @@ class M3RtProxy:
             self.published_command={}
             self.available_components=[]
             self.available_component_types=[]
+            self.component_types={}
             self.status_raw=mbs.M3StatusAll()
             self.command_raw=mbs.M3CommandAll()
         except socket.error:
@@ -155,31 +209,23 @@ class M3RtProxy:
 
     def make_operational_all(self):
         """Place all components in state OP"""
-        names=self.get_available_components()
-        for n in names:
-            if string.count(n,'shm') == 0: # ignore shared memory components
-                self.proxy.SetComponentStateOp(n)    
+        names=[n for n in self.get_available_components() if string.count(n,'shm') == 0] # ignore shared memory components
+        self.proxy.SetComponentStates(names,mbs.M3COMP_STATE_OP)
                 
     def make_safe_operational_all(self):
         """Place all components in state SAFEOP"""
-        names=self.get_available_components()
-        for n in names:            
-            if string.count(n,'shm') == 0: # ignore shared memory components
-                self.proxy.SetComponentStateSafeOp(n)
+        names=[n for n in self.get_available_components() if string.count(n,'shm') == 0] # ignore shared memory components
+        self.proxy.SetComponentStates(names,mbs.M3COMP_STATE_SAFEOP)
                 
     def make_operational_all_shm(self):
         """Place all components in state OP"""
-        names=self.get_available_components()
-        for n in names:
-            if string.count(n,'shm') > 0: # only shared memory components
-                self.proxy.SetComponentStateOp(n)
+        names=[n for n in self.get_available_components() if string.count(n,'shm') > 0] # only shared memory components
+        self.proxy.SetComponentStates(names,mbs.M3COMP_STATE_OP)
                 
     def make_safe_operational_all_shm(self):
         """Place all components in state SAFEOP"""
-        names=self.get_available_components()
-        for n in names:            
-            if string.count(n,'shm') > 0: # only shared memory components
-                self.proxy.SetComponentStateSafeOp(n)
+        names=[n for n in self.get_available_components() if string.count(n,'shm') > 0] # only shared memory components
+        self.proxy.SetComponentStates(names,mbs.M3COMP_STATE_SAFEOP)
             
     # TODO: Fix this on m3rt side
     '''def add_ros_component(self, name):
@@ -192,9 +238,24 @@ class M3RtProxy:
         self.__check_component(component)
         if self.verbose: print 'Subscribing to status for: ',component.name
         self.subscribed[component.name]={'status':component.status,'component':component}
+        if self.client is not None:
+            self.subscribed[component.name]['idx']=self.client.SubscribeStatus(component.name)
         self.status_raw.name.append(component.name)
         self.status_raw.datum.append('')
-        self.proxy.ClientSubscribeStatus(component.name,self.data_port)
+        if self.client is not None:
+            return # Subscription goes out with the next step
+        if self.data_socket is None:
+            self.proxy.ClientSubscribeStatus(component.name,self.data_port)
+            return
+        # Send it on the data port with the next command packet, no XML-RPC round trip
+        if len(self.command_raw.control) and self.command_raw.control[-1].op==mbs.M3CONTROL_SUBSCRIBE:
+            req=self.command_raw.control[-1]
+        else:
+            req=self.command_raw.control.add()
+            req.seq=self.control_seq
+            req.op=mbs.M3CONTROL_SUBSCRIBE
+            self.control_seq=self.control_seq+1
+        req.name.append(component.name)
 
     def publish_command(self,component):
         """Publish this components' command message to the server"""
@@ -203,6 +264,8 @@ class M3RtProxy:
             return
         if self.verbose: print 'Publishing command for: ',component.name
         self.published_command[component.name]={'component':component,'command':component.command}
+        if self.client is not None:
+            self.published_command[component.name]['idx']=self.client.PublishCommand(component.name)
         self.command_raw.name_cmd.append(component.name)
         self.command_raw.datum_cmd.append(component.command.SerializeToString())
 
@@ -213,6 +276,8 @@ class M3RtProxy:
             return
         if self.verbose: print 'Publishing param for: ',component.name
         self.published_param[component.name]={'component':component,'param':component.param}
+        if self.client is not None:
+            self.published_param[component.name]['idx']=self.client.PublishParam(component.name)
         self.command_raw.name_param.append(component.name)
         self.command_raw.datum_param.append(component.param.SerializeToString())
 
@@ -286,11 +351,11 @@ class M3RtProxy:
     def get_num_operational_components(self):
         names=self.get_available_components()
         count = 0
-        for n in names:
-            if self.proxy.GetComponentState(n)==3:
+        for n,s in zip(names,self.proxy.GetComponentStates(names)):
+            if s==3:
                 count = count +1
             else:
-                print n, ' is ', self.proxy.GetComponentState(n)
+                print n, ' is ', s
         return count
     
     def is_component_available(self,name):
@@ -310,13 +375,25 @@ class M3RtProxy:
         if self.proxy is not None:
             self.proxy.PrettyPrintRtSystem()
 
+    def print_perf_counters(self):
+        """Display per component hardware counters on server (perf_counters in m3_config.yml)"""
+        if self.proxy is not None:
+            return self.proxy.PrintPerfCounters()
+        return False
+
+    def print_thread_placement(self):
+        """Display CPU set, policy and priority of the server threads on server"""
+        if self.proxy is not None:
+            return self.proxy.PrintThreadPlacement()
+        return False
+
     def pretty_print_component_states(self):
         """Display all component states locally"""
         names=self.get_available_components()
         states=['STATE_INIT','STATE_ERROR','STATE_SAFEOP','STATE_OP']
         print '------------ Component States ------------'
-        for n in names:
-            print 'State: ',n,' : ',states[self.proxy.GetComponentState(n)]
+        for n,s in zip(names,self.proxy.GetComponentStates(names)):
+            print 'State: ',n,' : ',states[s]
 
     # ################################### Logging Service #################################################
     # The STATUS message of particular components can be logged to disk by the server. 
@@ -329,13 +406,28 @@ class M3RtProxy:
     # N samples (messages for one cycle period) are stored in a single file on disk.
     # NOTE: Be careful, it is possible to hang the system with too much disk activity. The default settings generally work.
 
-    def register_log_component(self,comp):
-        """Register the component for logging"""
+    def register_log_component(self,comp,freq_hz=None,fields=None):
+        """Register the component for logging.
+        freq_hz: own sample rate (default: rate of the session)
+        fields: status fields to log, dotted for nested messages (default: all). base is always kept.
+        A log entry then only holds the components sampled in that cycle."""
         self.log_comps[comp.name]=comp
-        self.log_names.append(comp.name)
-
-    def start_log_service(self,logname, sample_freq_hz=100,samples_per_file=100,logpath=None,verbose=True):
-        """Start logging registered components to directory logname"""
+        if comp.name not in self.log_names:
+            self.log_names.append(comp.name)
+        opts={}
+        if freq_hz is not None:
+            opts['freq']=float(freq_hz)
+        if fields is not None:
+            opts['fields']=[str(x) for x in fields]
+        if len(opts):
+            self.log_opts[comp.name]=opts
+        elif comp.name in self.log_opts:
+            self.log_opts.pop(comp.name)
+
+    def start_log_service(self,logname, sample_freq_hz=100,samples_per_file=100,logpath=None,verbose=True,tail_entries=0,to_disk=True):
+        """Start logging registered components to directory logname.
+        tail_entries: last entries kept on the server for start_log_tail() subscribers
+        to_disk: False to only feed the tail, nothing is written on the server"""
         if logpath is None:
             logpath=os.environ['M3_ROBOT']
             logpath = logpath.split(':')
@@ -343,11 +435,101 @@ class M3RtProxy:
             logpath = logpath[-1]+'/robot_log'
         if not self.proxy.IsRtSystemRunning():
             raise m3t.M3Exception('Cannot start log. M3RtSystem is not yet running on the server')
-        return self.proxy.start_log_service(logname,float(sample_freq_hz),self.log_names,int(samples_per_file),logpath,verbose)
-
-    def stop_log_service(self):
-        """Stop the active logging session"""
-        return self.proxy.stop_log_service()
+        return self.proxy.start_log_service(logname,float(sample_freq_hz),self.__log_components(),int(samples_per_file),logpath,verbose,
+                                            int(tail_entries),bool(to_disk))
+
+    def start_log_capture(self,logname,pre_s,post_s,sample_freq_hz=100,samples_per_file=100,logpath=None,verbose=True,
+                          on_state=True,on_overrun=True,thresholds=[]):
+        """Record registered components in memory only, write pre_s seconds before and post_s seconds
+        after each trigger to directory logname (listed in logname.captures).
+        Triggers: a component going to ERR or SAFEOP (on_state), an rt cycle overrun (on_overrun),
+        trigger_log_capture(), thresholds: [(component_name, field, '>' or '<', value),...]
+        where field is a dotted path into the status, name[i] for an element of a repeated field."""
+        if logpath is None:
+            logpath=os.environ['M3_ROBOT']
+            logpath = logpath.split(':')
+            logpath = logpath[-1]+'/robot_log'
+        if not self.proxy.IsRtSystemRunning():
+            raise m3t.M3Exception('Cannot start log. M3RtSystem is not yet running on the server')
+        thresholds=[[str(t[0]),str(t[1]),str(t[2]),float(t[3])] for t in thresholds]
+        return self.proxy.start_log_capture(logname,float(sample_freq_hz),self.__log_components(),int(samples_per_file),logpath,verbose,
+                                            float(pre_s),float(post_s),bool(on_state),bool(on_overrun),thresholds)
+
+    def trigger_log_capture(self,logname=None):
+        """Trigger the running log capture logname (default: all of them)"""
+        if logname is None:
+            logname=''
+        return self.proxy.trigger_log_capture(logname)
+
+    def clear_log_components(self):
+        """Forget the components registered for logging, to start a session with another set.
+        Sessions already running are not affected."""
+        self.log_names=[]
+        self.log_opts={}
+
+    def get_log_sessions(self):
+        """Names of the log sessions running on the server"""
+        return self.proxy.get_log_sessions()
+
+    def stop_log_service(self,logname=None):
+        """Stop the logging session logname (default: all of them)"""
+        if logname is None:
+            logname=''
+        return self.proxy.stop_log_service(logname)
+
+    def start_log_tail(self,logname,from_seq=None):
+        """Receive the entries of the running log session logname (started with tail_entries) with the
+        status packets of the DataService. from_seq: first entry, to resume after a reconnection
+        (default: from now on). Entries are taken with get_log_tail(), which also lets the server
+        send more: a recorder that does not keep up slows the tail down, then loses the oldest entries."""
+        if self.client is not None:
+            raise m3t.M3Exception('Log tail not available with the native client')
+        if self.data_socket is None:
+            raise m3t.M3Exception('M3RtProxy data socket not created')
+        req=self.command_raw.control.add()
+        req.seq=self.control_seq
+        req.op=mbs.M3CONTROL_LOG_TAIL
+        req.name.append(logname)
+        if from_seq is not None:
+            req.log_seq=int(from_seq)
+            self.log_tail_next=int(from_seq)
+        self.control_seq=self.control_seq+1
+        self.log_tail=[]
+        self.log_tail_end=False
+
+    def stop_log_tail(self):
+        """Stop receiving log entries"""
+        if self.data_socket is None:
+            return
+        req=self.command_raw.control.add()
+        req.seq=self.control_seq
+        req.op=mbs.M3CONTROL_LOG_TAIL
+        self.control_seq=self.control_seq+1
+
+    def get_log_tail(self):
+        """Log entries received since the last call, as a list of (sequence number, M3StatusAll),
+        in order. A gap in the sequence numbers means entries were lost. Call step() to receive more."""
+        entries=[]
+        for seq,data in self.log_tail:
+            e=mbs.M3StatusAll()
+            e.ParseFromString(data)
+            entries.append((seq,e))
+        self.log_tail=[]
+        if len(entries) and not self.log_tail_end:
+            req=self.command_raw.control.add()
+            req.seq=self.control_seq
+            req.op=mbs.M3CONTROL_LOG_ACK
+            req.log_seq=self.log_tail_next
+            self.control_seq=self.control_seq+1
+        return entries
+
+    def is_log_tail_done(self):
+        """True once the tailed session stopped and all its entries were received"""
+        return self.log_tail_end and len(self.log_tail)==0
+
+    def get_log_tail_next(self):
+        """Sequence number of the next entry expected, for start_log_tail(from_seq) after a reconnection"""
+        return self.log_tail_next
 
     def get_log_component_names(self,logname):
         """Get the available components contained in a completed log session"""
@@ -355,11 +537,15 @@ class M3RtProxy:
             if not self._load_log(logname):
                 return []
             filename=self.log_info[0]['filename']
-            self.log_page=mbs.M3StatusLogPage()
             s=self.proxy.get_log_file(filename).data
-            self.log_page.ParseFromString(s)
-        status_all=self.log_page.entry[0]
-        return [str(x) for x in status_all.name]
+            self.log_page=m3t.read_log_page(s)
+        #Components logged at their own rate are not in every entry
+        names=[]
+        for status_all in self.log_page.entry:
+            for x in status_all.name:
+                if str(x) not in names:
+                    names.append(str(x))
+        return names
 
     def get_log_num_samples(self,logname):
         """Get the number of samples in a completed log session"""
@@ -368,6 +554,16 @@ class M3RtProxy:
             return 0
         return log_info[-1]['end_idx']
 
+    def get_log_summary(self,logname,comp_name,field,t_start=None,t_end=None,width=1000):
+        """Min/max/mean of a status field of a completed log session over [t_start,t_end] (s),
+        about width points from the log summary: plots a long run without loading its pages.
+        Returns a dict of lists (t, timestamp, min, max, mean) and period_s, {} without summary"""
+        if t_start is None:
+            t_start=-1
+        if t_end is None:
+            t_end=-1
+        return self.proxy.get_log_summary(logname,comp_name,field,t_start,t_end,width)
+
     def load_log_sample(self,logname,idx):
         """Load sample idx into the subscribed components"""
         if self.logname!=logname:
@@ -386,17 +582,27 @@ class M3RtProxy:
                 if search_idx==self.log_file_idx:
                     raise m3t.M3Exception('M3RtProxy invalid log sample idx: '+str(idx))
             filename=self.log_info[self.log_file_idx]['filename']
-            self.log_page=mbs.M3StatusLogPage()
             s=self.proxy.get_log_file(filename).data
-            self.log_page.ParseFromString(s)
+            self.log_page=m3t.read_log_page(s)
         entry_idx=idx-self.log_info[self.log_file_idx]['start_idx']
         status_all=self.log_page.entry[entry_idx]
         for i in range(len(status_all.name)):
-            for name  in self.log_names:
-                if name==status_all.name[i]:
-                    self.log_comps[name].status.ParseFromString(status_all.datum[i])
+            name=status_all.name[i]
+            if name in self.log_comps:
+                self.log_comps[name].status.ParseFromString(status_all.datum[i])
 
 # #################################### Private methods ################################################################   
+    def __log_components(self):
+        components=[]
+        for name in self.log_names:
+            if name in self.log_opts:
+                c=dict(self.log_opts[name])
+                c['name']=name
+                components.append(c)
+            else:
+                components.append(name)
+        return components
+
 
     def __send_command(self):
         if self.data_socket is None:
@@ -422,7 +628,23 @@ class M3RtProxy:
         nc=array.array('f',[self.command_raw.ByteSize()]).tostring()
         sc=self.command_raw.SerializeToString()
         self.data_socket.sendall(nh+nc+sc)
+        del self.command_raw.control[:]
         
+    def __step_native(self):
+        # Same as __send_command/__recv_status, slots were mapped once at publish/subscribe time
+        for v in self.published_command.itervalues():
+            v['component'].load_command()
+            self.client.SetCommand(v['idx'],v['command'].SerializeToString())
+        for v in self.published_param.itervalues():
+            v['component'].load_param()
+            self.client.SetParam(v['idx'],v['param'].SerializeToString())
+        if not self.client.Step():
+            raise m3t.M3Exception('Proxy socket connection broken')
+        for v in self.subscribed.itervalues():
+            if self.client.IsStatusUpdated(v['idx']):
+                v['status'].ParseFromString(self.client.GetStatus(v['idx']))
+                v['component'].update_status()
+
     def __do_receive(self,nr,timeout_total=4.0,timeout_chunk = 2.0):
         msg = ''
         chunk=''
@@ -444,7 +666,7 @@ class M3RtProxy:
                     msg = msg + chunk
         return msg
 
-    def __recv_status(self):
+    def __recv_packet(self):
         if self.data_socket is None:
             m3t.M3Exception('M3RtProxy data socket not created')
         nr=array.array('I')
@@ -453,8 +675,46 @@ class M3RtProxy:
             raise m3t.M3Exception('Incorrect packet recv size from proxy')
         nr.fromstring(rcv)
         nr=nr[0]
-        data=self.__do_receive(nr)
+        return self.__do_receive(nr)
+
+    def __recv_status_latest(self):
+        # Block for one packet, then skip to the most recent one already pushed
+        data=self.__recv_packet()
+        while select.select([self.data_socket], [], [], 0)[0]:
+            self.__parse_log_tail(data)
+            data=self.__recv_packet()
+        self.__parse_status(data)
+
+    def __recv_status(self):
+        self.__parse_status(self.__recv_packet())
+
+    def __parse_log_tail(self,data):
+        # Skipped status packet, still carries log entries
+        s=mbs.M3StatusAll()
+        s.ParseFromString(data)
+        self.__take_log_tail(s)
+
+    def __take_log_tail(self,status):
+        if not status.HasField('log_tail'):
+            return
+        t=status.log_tail
+        if t.dropped:
+            print 'M3 WARNING: log tail',t.session,'lost',t.dropped,'entries'
+        seq=t.first_seq
+        for data in t.entry:
+            self.log_tail.append((seq,data))
+            seq=seq+1
+        if len(t.entry) or t.dropped:
+            self.log_tail_next=seq
+        if t.end:
+            self.log_tail_end=True
+
+    def __parse_status(self,data):
         self.status_raw.ParseFromString(data)
+        self.__take_log_tail(self.status_raw)
+        for r in self.status_raw.control:
+            if not r.ok:
+                print 'M3 WARNING: control request',r.seq,'failed on the DataService'
         for name,v in self.subscribed.items():
             for j in range(len(self.status_raw.name)):
                 if name==self.status_raw.name[j]:
@@ -466,10 +726,11 @@ class M3RtProxy:
         """Verify that the component type matches the server type"""
         if self.proxy is None:
             raise m3t.M3Exception('M3RtProxy not started')
-        idx=self.proxy.GetComponentIdx(component.name)
-        if idx==-1:
+        if not self.component_types.has_key(component.name):
+            self.__get_component_directory() # May have been loaded since start()
+        if not self.component_types.has_key(component.name):
             raise m3t.M3Exception('Component '+component.name+' not available')
-        type=self.proxy.GetComponentType(idx)
+        type=self.component_types[component.name]
         if type!=component.type:
             raise m3t.M3Exception('Component type mismatch '+type+' , '+component.type)
 
@@ -486,20 +747,17 @@ class M3RtProxy:
                     raise m3t.M3Exception('Unable to start M3RtSystem. Try restarting server')
             except xmlrpclib.ProtocolError,v:
                 raise m3t.M3Exception(v)
-            #Query available components
-            self.available_components=[]
-            n=self.proxy.GetNumComponents()
-            for i in range(n):
-                name=self.proxy.GetComponentName(i)
-                self.available_components.append(name)
-            #Query component types
-            self.available_component_types=[]
-            for i in range(n):
-                ttype=self.proxy.GetComponentType(i)
-                self.available_component_types.append(ttype)
+            #Query available components and their types
+            self.__get_component_directory()
         except socket.error, msg:
             raise m3t.M3Exception('Check that server is started. Socket Error: '+str(msg))
 
+    def __get_component_directory(self):
+        d=self.proxy.GetComponentDirectory()
+        self.available_components=[c[0] for c in d]
+        self.available_component_types=[c[1] for c in d]
+        self.component_types=dict(zip(self.available_components,self.available_component_types))
+
     def __stop_data_service(self):
         try:
             if self.proxy is not None:
@@ -507,6 +765,9 @@ class M3RtProxy:
             if self.data_socket is not None:
                 self.data_socket.close()
             self.data_socket=None
+            if self.client is not None:
+                self.client.Disconnect()
+            self.client=None
         except socket.error, msg:
             pass #Ok because shutting down
 
@@ -526,6 +787,17 @@ class M3RtProxy:
         #print port
         #print '----------------'
         self.data_port = port
+        if self.native_client:
+            self.client=m3c.M3RtClient()
+            if not self.client.Connect(self.host,self.data_port):
+                self.__stop_data_service()
+                raise m3t.M3Exception('Unable to connect to M3RtDataService on port '+str(self.data_port))
+            # Components published before the data service was started
+            for name,v in self.published_command.items():
+                v['idx']=self.client.PublishCommand(name)
+            for name,v in self.published_param.items():
+                v['idx']=self.client.PublishParam(name)
+            return
         #Create data stream socket
         try:
             self.data_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
@@ -554,9 +826,8 @@ class M3RtProxy:
         self.log_end_idx=self.log_info[0]['end_idx']
         self.log_file_idx=0
         filename=self.log_info[0]['filename']
-        self.log_page=mbs.M3StatusLogPage()
         s=self.proxy.get_log_file(filename).data
-        self.log_page.ParseFromString(s)
+        self.log_page=m3t.read_log_page(s)
         return True
 
     def __start_ros_service(self):
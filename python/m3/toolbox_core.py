@@ -925,7 +925,7 @@ def in_range_rad(solution_wrapped, max, min):
 def get_time_sorted_valid_logdirs():
         path=get_m3_log_path()
         logdirs=[ name for name in os.listdir(path) if os.path.isdir(os.path.join(path, name)) ]
-        valid_logdirs=[path+xdir for xdir in logdirs if len(glob.glob(path+'/'+xdir+'/*.pb.log'))>0]
+        valid_logdirs=[path+xdir for xdir in logdirs if len(glob.glob(path+'/'+xdir+'/*.pb.log*'))>0]
         valid_logdirs.sort(key=lambda x: os.path.getmtime(x))
         valid_logdirs.reverse()
         valid_logdirs=[x[x.rfind('/')+1:] for x in valid_logdirs]
@@ -959,11 +959,10 @@ def dump_log_dir_to_loglist(logname,comp_name,status):
         info = get_log_info(logname)
         ret=[]
         for ip in info: #loop over all logfile pages
-                log_page=mbs.M3StatusLogPage()
                 f = open(ip['filename'], "rb")
                 s=f.read()
                 f.close()
-                log_page.ParseFromString(s) #load page into protobuf class
+                log_page=read_log_page(s) #load page into protobuf class
                 for status_all in log_page.entry: #loop over all entries in a page
                         for i in range(len(status_all.name)): #loop over all components in an entry
                                 if status_all.name[i]==comp_name:
@@ -998,11 +997,36 @@ def get_log_dir(logname,logpath=None):
                 print 'You must set your M3_ROBOT Environment variable to do logging.'
                 return None
 
+LZ4_FRAME_MAGIC='\x04\x22\x4d\x18'
+ZSTD_FRAME_MAGIC='\x28\xb5\x2f\xfd'
+
+def decompress_log_data(s):
+        """Content of a log file, decompressed if the server wrote it with log_compression (lz4 or zstd frame)."""
+        if s[:4]==LZ4_FRAME_MAGIC:
+                try:
+                        import lz4.frame
+                except ImportError:
+                        raise M3Exception('Log file is lz4 compressed, install the python lz4 module to read it')
+                return lz4.frame.decompress(s)
+        if s[:4]==ZSTD_FRAME_MAGIC:
+                try:
+                        import zstandard
+                except ImportError:
+                        raise M3Exception('Log file is zstd compressed, install the python zstandard module to read it')
+                return zstandard.ZstdDecompressor().decompress(s)
+        return s
+
+def read_log_page(s):
+        """Parse the content of a .pb.log[.lz4|.zst] file into a M3StatusLogPage."""
+        log_page=mbs.M3StatusLogPage()
+        log_page.ParseFromString(decompress_log_data(s))
+        return log_page
+
 def get_log_info(logname,logpath=None,logdir=None):
-        #logname format: /dir/dir2/.../logname/logname_xxxxxx_yyyyyy.pb.log
+        #logname format: /dir/dir2/.../logname/logname_xxxxxx_yyyyyy.pb.log[.lz4|.zst]
         if logdir is None:
                 logdir=get_log_dir(logname,logpath)
-        log_files=glob.glob(logdir+'/*.pb.log')
+        log_files=glob.glob(logdir+'/*.pb.log*')
         log_files.sort()
         info=[]
         for lf in log_files:
@@ -1020,6 +1044,69 @@ def get_log_info(logname,logpath=None,logdir=None):
                 info.append({'filename':lf,'start_idx':istart,'end_idx':iend})
         return info
 
+def get_log_summary_info(logname,logpath=None,logdir=None):
+        #logname format: /dir/dir2/.../logname/logname_<period>ms_xxxxxx_yyyyyy.pb.sum[.lz4|.zst]
+        #Returns {period_ms: [{'filename','start_bin','end_bin'}, ...]}
+        if logdir is None:
+                logdir=get_log_dir(logname,logpath)
+        info={}
+        for lf in glob.glob(logdir+'/*.pb.sum*'):
+                f=lf[:lf.find('.pb.sum')].split('_')
+                if len(f)<3 or not f[-3].endswith('ms') or not f[-3][:-2].isdigit() or not f[-2].isdigit() or not f[-1].isdigit():
+                        continue
+                ms=int(f[-3][:-2])
+                info.setdefault(ms,[]).append({'filename':lf,'start_bin':int(f[-2]),'end_bin':int(f[-1])})
+        for ms in info.keys():
+                info[ms].sort(key=lambda x: x['start_bin'])
+        return info
+
+def load_log_summary(logname,comp_name,field,t_start=None,t_end=None,width=1000,logpath=None,logdir=None):
+        """Min/max/mean of a status field (as listed by get_msg_fields, name[i] for an element of a
+        repeated field) over [t_start,t_end], seconds from the log start. Reads the coarsest summary
+        level that still gives width bins over that span, and only its files overlapping it.
+        Returns a dict of lists: t, timestamp, min, max, mean, plus period_s; None without summary."""
+        info=get_log_summary_info(logname,logpath,logdir)
+        if len(info)==0:
+                return None
+        levels=sorted(info.keys())
+        t0=0.0 if t_start is None else t_start
+        if t_end is None:
+                t1=(info[levels[0]][-1]['end_bin']+1)*levels[0]/1000.0
+        else:
+                t1=t_end
+        ms=levels[0]
+        for l in levels:
+                if (t1-t0)*1000.0/l>=width:
+                        ms=l
+        ret={'period_s':ms/1000.0,'t':[],'timestamp':[],'min':[],'max':[],'mean':[]}
+        for lf in info[ms]:
+                if lf['start_bin']*ms/1000.0>t1 or (lf['end_bin']+1)*ms/1000.0<t0:
+                        continue
+                f = open(lf['filename'], "rb")
+                s=f.read()
+                f.close()
+                page=mbs.M3LogSummaryPage()
+                page.ParseFromString(decompress_log_data(s))
+                for summary in page.summary:
+                        if summary.component!=comp_name:
+                                continue
+                        try:
+                                i=list(summary.field).index(field)
+                        except ValueError:
+                                raise M3Exception('Field '+field+' not summarized for '+comp_name)
+                        nf=len(summary.field)
+                        for b in summary.bin:
+                                t=b.bin*page.period_cycles/page.rt_frequency
+                                if t<t0 or t>t1:
+                                        continue
+                                ret['t'].append(t)
+                                ret['timestamp'].append(b.timestamp)
+                                if len(b.mean)==nf:
+                                        ret['min'].append(b.min[i])
+                                        ret['max'].append(b.max[i])
+                                        ret['mean'].append(b.mean[i])
+        return ret
+
 def make_log_dir(logdir):
         if os.path.isdir(logdir):
                 if len(glob.glob(logdir+'/*'))>0:
@@ -0,0 +1,289 @@
+#! /usr/bin/python
+
+#M3 -- Meka Robotics Robot Components
+#Copyright (c) 2010 Meka Robotics
+#Author: edsinger@mekabot.com (Aaron Edsinger)
+
+#M3 is free software: you can redistribute it and/or modify
+#it under the terms of the GNU Lesser General Public License as published by
+#the Free Software Foundation, either version 3 of the License, or
+#(at your option) any later version.
+
+#M3 is distributed in the hope that it will be useful,
+#but WITHOUT ANY WARRANTY; without even the implied warranty of
+#MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#GNU Lesser General Public License for more details.
+
+#You should have received a copy of the GNU Lesser General Public License
+#along with m3.  If not, see <http://www.gnu.org/licenses/>.
+
+# Convert a log directory (logname_xxxxxx_yyyyyy.pb.log[.lz4|.zst]) into one table per component:
+#   csv:   out/<component>.csv
+#   npy:   out/<component>/<field>.npy, one float64 array per field
+#   arrow: out/<component>.arrow (Arrow IPC file, needs pyarrow)
+# Columns are the numeric status fields, flattened: joint.torque, theta[3], base.timestamp...,
+# plus 'entry', the index of the log entry. Repeated fields get as many columns as the first
+# sample of the component has elements, missing values are NaN.
+# Pages are decoded on all cores, at most 2 per worker in flight, the main process writes them
+# out in order: the log is never held in memory as a whole.
+# Components are resolved from their first sample: those of the first page before the workers
+# start, the others (streams logged at a lower rate, capture pages) as the workers report them.
+#
+# The status type of each component comes from its config (m3_config.yml, python factory libs),
+# or -t component=module.Message.
+
+import os
+import sys
+import struct
+import argparse
+import importlib
+import multiprocessing
+from collections import deque
+import numpy as nu
+import m3.toolbox_core as m3t
+from google.protobuf.descriptor import FieldDescriptor
+
+NUMERIC_TYPES=[FieldDescriptor.CPPTYPE_DOUBLE,FieldDescriptor.CPPTYPE_FLOAT,FieldDescriptor.CPPTYPE_INT32,
+               FieldDescriptor.CPPTYPE_INT64,FieldDescriptor.CPPTYPE_UINT32,FieldDescriptor.CPPTYPE_UINT64,
+               FieldDescriptor.CPPTYPE_BOOL,FieldDescriptor.CPPTYPE_ENUM]
+
+status_types={} #Component name -> status message class (None: skipped), set before the workers fork
+schemas={} #Component name -> [(column, path)]
+components=[] #-c, empty: all
+
+def list_columns(msg,prefix='',path=()):
+    """Numeric leaves of msg as (column, path), path being (field name, index or None) pairs"""
+    cols=[]
+    for f in msg.DESCRIPTOR.fields:
+        if f.label==FieldDescriptor.LABEL_REPEATED:
+            v=getattr(msg,f.name)
+            for i in range(len(v)):
+                name=prefix+f.name+'['+str(i)+']'
+                if f.cpp_type==FieldDescriptor.CPPTYPE_MESSAGE:
+                    cols.extend(list_columns(v[i],name+'.',path+((f.name,i),)))
+                elif f.cpp_type in NUMERIC_TYPES:
+                    cols.append((name,path+((f.name,i),)))
+        elif f.cpp_type==FieldDescriptor.CPPTYPE_MESSAGE:
+            cols.extend(list_columns(getattr(msg,f.name),prefix+f.name+'.',path+((f.name,None),)))
+        elif f.cpp_type in NUMERIC_TYPES:
+            cols.append((prefix+f.name,path+((f.name,None),)))
+    return cols
+
+def get_value(msg,path):
+    v=msg
+    for name,idx in path:
+        v=getattr(v,name)
+        if idx is not None:
+            if idx>=len(v):
+                return nu.nan
+            v=v[idx]
+    return float(v)
+
+def is_wanted(name):
+    return len(components)==0 or name in components
+
+def decode_rows(name,samples):
+    """(entry indices, [column arrays]) of a component from its (entry index, datum) samples"""
+    m=status_types[name]()
+    rows=[]
+    for idx,datum in samples:
+        m.ParseFromString(datum)
+        rows.append([idx]+[get_value(m,p) for c,p in schemas[name]])
+    a=nu.array(rows,dtype=nu.float64)
+    return (a[:,0].astype(nu.int64),a[:,1:])
+
+def convert_page(filename,start_idx):
+    """Worker: decode a page into ({component: (entry indices, [column arrays])}, {component: [(entry index, datum)]}),
+    the second one for the components that were not resolved when the worker forked"""
+    f=open(filename,'rb')
+    page=m3t.read_log_page(f.read())
+    f.close()
+    samples={}
+    unknown={}
+    for j in range(len(page.entry)):
+        e=page.entry[j]
+        for i in range(len(e.name)):
+            name=e.name[i]
+            if schemas.has_key(name):
+                samples.setdefault(name,[]).append((start_idx+j,e.datum[i]))
+            elif not status_types.has_key(name) and is_wanted(name):
+                unknown.setdefault(name,[]).append((start_idx+j,e.datum[i]))
+    out={}
+    for name,s in samples.items():
+        out[name]=decode_rows(name,s)
+    return out,unknown
+
+class NpyColumn:
+    """float64 .npy written as it grows, the shape in the header is set on close"""
+    HEADER_LEN=128
+    def __init__(self,filename):
+        self.f=open(filename,'wb')
+        self.n=0
+        self.write_header()
+    def write_header(self):
+        d="{'descr': '<f8', 'fortran_order': False, 'shape': (%d,), }"%self.n
+        h=d+' '*(self.HEADER_LEN-10-len(d)-1)+'\n'
+        self.f.seek(0)
+        self.f.write('\x93NUMPY\x01\x00'+struct.pack('<H',len(h))+h)
+        self.f.seek(0,2)
+    def append(self,v):
+        self.f.write(nu.asarray(v,dtype='<f8').tostring())
+        self.n+=len(v)
+    def close(self):
+        self.write_header()
+        self.f.close()
+
+class TableWriter:
+    def __init__(self,fmt,outdir,name,columns):
+        self.fmt=fmt
+        self.columns=['entry']+columns
+        fname=name.replace('/','_')
+        if fmt=='csv':
+            self.f=open(os.path.join(outdir,fname+'.csv'),'w')
+            self.f.write(','.join(self.columns)+'\n')
+        elif fmt=='npy':
+            d=os.path.join(outdir,fname)
+            if not os.path.isdir(d):
+                os.makedirs(d)
+            self.npy=[NpyColumn(os.path.join(d,c+'.npy')) for c in self.columns]
+        else:
+            import pyarrow as pa
+            self.pa=pa
+            self.schema=pa.schema([pa.field('entry',pa.int64())]+[pa.field(c,pa.float64()) for c in columns])
+            self.sink=pa.OSFile(os.path.join(outdir,fname+'.arrow'),'wb')
+            self.writer=pa.RecordBatchFileWriter(self.sink,self.schema)
+    def append(self,idx,data):
+        if self.fmt=='csv':
+            for k in range(len(idx)):
+                self.f.write(str(idx[k])+','+','.join([repr(x) for x in data[k]])+'\n')
+        elif self.fmt=='npy':
+            self.npy[0].append(idx)
+            for c in range(data.shape[1]):
+                self.npy[c+1].append(data[:,c])
+        else:
+            arrays=[self.pa.array(idx)]+[self.pa.array(data[:,c]) for c in range(data.shape[1])]
+            self.writer.write_batch(self.pa.RecordBatch.from_arrays(arrays,self.columns))
+    def close(self):
+        if self.fmt=='csv':
+            self.f.close()
+        elif self.fmt=='npy':
+            for c in self.npy:
+                c.close()
+        else:
+            self.writer.close()
+            self.sink.close()
+
+def add_component(name,datum,overrides,fmt,outdir,writers):
+    """Resolve the status type and columns of a component from its first sample (main process)"""
+    t=get_status_type(name,overrides)
+    status_types[name]=t
+    if t is None:
+        print 'Skipping',name,': unknown status type (use -t',name+'=module.Message)'
+        return
+    m=t()
+    m.ParseFromString(datum)
+    schemas[name]=list_columns(m)
+    writers[name]=TableWriter(fmt,outdir,name,[c for c,p in schemas[name]])
+
+def get_status_type(name,overrides):
+    if overrides.has_key(name):
+        mod,cls=overrides[name].rsplit('.',1)
+        return getattr(importlib.import_module(mod),cls)
+    import m3.component_factory as mcf
+    c=mcf.create_component(name)
+    if c is None:
+        return None
+    return c.status.__class__
+
+def main():
+    parser=argparse.ArgumentParser(description='Convert a M3 log to CSV, .npy or Arrow, one table per component')
+    parser.add_argument('logname',help='log name, or log directory with -d')
+    parser.add_argument('-d','--dir',action='store_true',help='logname is the log directory')
+    parser.add_argument('-p','--logpath',default=None,help='log path (default: robot_log of M3_ROBOT)')
+    parser.add_argument('-f','--format',choices=['csv','npy','arrow'],default='csv')
+    parser.add_argument('-o','--out',default=None,help='output directory (default: <log directory>_<format>)')
+    parser.add_argument('-c','--component',action='append',default=[],help='component to convert (default: all)')
+    parser.add_argument('-t','--type',action='append',default=[],help='component=module.Message status type')
+    parser.add_argument('-j','--jobs',type=int,default=multiprocessing.cpu_count())
+    args=parser.parse_args()
+
+    if args.dir:
+        info=m3t.get_log_info(None,logdir=args.logname.rstrip('/'))
+        logdir=args.logname.rstrip('/')
+    else:
+        logdir=m3t.get_log_dir(args.logname,args.logpath)
+        info=m3t.get_log_info(args.logname,logdir=logdir)
+    if len(info)==0:
+        print 'No log pages found in',logdir
+        return 1
+    if args.format=='arrow':
+        try:
+            import pyarrow
+        except ImportError:
+            print 'Arrow output needs the pyarrow module'
+            return 1
+    outdir=args.out if args.out is not None else logdir+'_'+args.format
+    if not os.path.isdir(outdir):
+        os.makedirs(outdir)
+    overrides=dict([t.split('=',1) for t in args.type])
+    components.extend(args.component)
+    ctx=(overrides,args.format,outdir)
+
+    #Components of the first page, the workers fork with their status_types and schemas
+    writers={}
+    f=open(info[0]['filename'],'rb')
+    page=m3t.read_log_page(f.read())
+    f.close()
+    for e in page.entry:
+        for i in range(len(e.name)):
+            name=e.name[i]
+            if not status_types.has_key(name) and is_wanted(name):
+                add_component(name,e.datum[i],overrides,args.format,outdir,writers)
+    del page
+
+    jobs=max(1,args.jobs)
+    pools=[multiprocessing.Pool(jobs)]
+    pending=deque()
+    n=0
+    for ip in info:
+        pending.append(pools[-1].apply_async(convert_page,(ip['filename'],ip['start_idx'])))
+        while len(pending)>=2*jobs:
+            n,added=write_page(pending.popleft().get(),writers,n,len(info),ctx)
+            if added:
+                #Pages in flight still report them, the next ones go to workers that know them
+                pools[-1].close()
+                pools.append(multiprocessing.Pool(jobs))
+    while len(pending):
+        n,added=write_page(pending.popleft().get(),writers,n,len(info),ctx)
+    for p in pools:
+        p.close()
+        p.join()
+    for w in writers.values():
+        w.close()
+    print
+    if len(writers)==0:
+        print 'Nothing to convert'
+        return 1
+    print 'Wrote',len(writers),'components to',outdir
+    return 0
+
+def write_page(result,writers,n,total,ctx):
+    """Write a page out, components the worker did not know are resolved and decoded here.
+    Returns the page count and whether components were added"""
+    out,unknown=result
+    added=False
+    for name,samples in unknown.items():
+        if not status_types.has_key(name):
+            add_component(name,samples[0][1],ctx[0],ctx[1],ctx[2],writers)
+            added=True
+        if schemas.has_key(name):
+            out[name]=decode_rows(name,samples)
+    for name,(idx,data) in out.items():
+        writers[name].append(idx,data)
+    n+=1
+    sys.stdout.write('\rPages: %d/%d'%(n,total))
+    sys.stdout.flush()
+    return n,added
+
+if __name__=='__main__':
+    sys.exit(main())
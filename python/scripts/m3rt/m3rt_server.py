@@ -50,11 +50,11 @@ class MyXMLRPCServer(MyTCPServer, SimpleXMLRPCServer.SimpleXMLRPCDispatcher):
         SimpleXMLRPCServer.SimpleXMLRPCDispatcher.__init__(self)
         MyTCPServer.__init__(self, addr, requestHandler)
 
-def start_log_service(logname, freq, components,page_size,logpath=None,verbose=True):
+def start_log_service(logname, freq, components,page_size,logpath=None,verbose=True,tail_entries=0,to_disk=True):
     logdir=m3t.get_log_dir(logname,logpath)
     if logdir is None:
         return False
-    if not m3t.make_log_dir(logdir):
+    if to_disk and not m3t.make_log_dir(logdir):
         return False
     if len(components)==1 and components[0]=='all':
         components=[]
@@ -65,12 +65,35 @@ def start_log_service(logname, freq, components,page_size,logpath=None,verbose=T
         print 'No componentes registered for logging'
         return False
     for c in components:
-        svc.AddLogComponent(c)
+        if isinstance(c,dict): #Own rate and/or fields
+            svc.AddLogComponentStream(str(c['name']),float(c.get('freq',0)),[str(x) for x in c.get('fields',[])])
+        else:
+            svc.AddLogComponent(c)
+    if not svc.SetLogTail(int(tail_entries),bool(to_disk)):
+        return False
     return svc.AttachLogService(logname,logdir, freq,page_size,int(verbose)) 
 
-def stop_log_service():
+def start_log_capture(logname, freq, components,page_size,logpath,verbose,pre_s,post_s,on_state,on_overrun,thresholds):
+    if not svc.SetLogCapture(pre_s,post_s,on_state,on_overrun):
+        return False
+    for t in thresholds:
+        svc.AddLogTrigger(t[0],t[1],t[2],float(t[3]))
+    if not start_log_service(logname, freq, components,page_size,logpath,verbose):
+        svc.SetLogCapture(0,0,True,True)
+        return False
+    return True
+
+def trigger_log_capture(logname=''):
+    return svc.TriggerLogCapture(logname)
+
+def stop_log_service(logname=''):
+    if logname:
+        return svc.RemoveLogSession(logname)
     return svc.RemoveLogService()
 
+def get_log_sessions():
+    return list(svc.GetLogSessionNames())
+
 def get_log_file(logfilename):
     try:
         with open(logfilename, "rb") as f:
@@ -82,6 +105,13 @@ def get_log_file(logfilename):
 def get_log_info(logname,logpath=None):
     return m3t.get_log_info(logname,logpath)
 
+def get_log_summary(logname,comp_name,field,t_start=-1,t_end=-1,width=1000,logpath=None):
+    #-1: from the start / to the end of the log
+    r=m3t.load_log_summary(logname,comp_name,field,None if t_start<0 else t_start,None if t_end<0 else t_end,width,logpath)
+    if r is None:
+        return {}
+    return r
+
 
 class client_thread(Thread):
     def __init__ (self, make_all_op = False, make_all_op_shm = False, make_all_op_no_shm = True,data_svc=False):
@@ -115,9 +145,13 @@ class M3Server(Thread):
         self.server.register_introspection_functions()
         self.server.register_instance(svc)
         self.server.register_function(start_log_service)
+        self.server.register_function(start_log_capture)
+        self.server.register_function(trigger_log_capture)
         self.server.register_function(stop_log_service)
+        self.server.register_function(get_log_sessions)
         self.server.register_function(get_log_file)
         self.server.register_function(get_log_info)
+        self.server.register_function(get_log_summary)
         #time.sleep(2.0) # wait for EC kmod to get slaves in OP
     def run(self):
         print 'Starting M3 RPC Server on Host:',host,'at Port:',port,'...'
@@ -0,0 +1,98 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Built as libm3allocguard.so, to be preloaded (see alloc_guard.h). Nothing here may allocate.
+
+#include "m3rt/base/alloc_guard.h"
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+using namespace m3rt;
+
+static M3AllocGuardState guard_state = {M3_ALLOC_GUARD_OFF, -1};
+
+static inline void guard_check()
+{
+    const int c = guard_state.comp;
+    if(c < 0 || guard_state.mode == M3_ALLOC_GUARD_OFF || !pthread_equal(pthread_self(), guard_state.thread))
+        return;
+    guard_state.count[c]++;
+    if(guard_state.mode == M3_ALLOC_GUARD_TRAP)
+        raise(SIGTRAP); //Stops in the debugger on the allocating call, core dump otherwise
+}
+
+extern "C" {
+
+M3AllocGuardState * m3_alloc_guard_state()
+{
+    return &guard_state;
+}
+
+void *malloc(size_t size)
+{
+    guard_check();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    guard_check();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    guard_check();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    guard_check();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    guard_check();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if(alignment < sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    guard_check();
+    void *p = __libc_memalign(alignment, size);
+    if(p == NULL)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+}
@@ -0,0 +1,58 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef M3RT_ALLOC_GUARD_H
+#define M3RT_ALLOC_GUARD_H
+
+#include "m3rt/base/m3rt_def.h"
+#include <pthread.h>
+
+/*
+ * Allocation guard: libm3allocguard.so interposes malloc and friends (operator new goes through
+ * malloc) and counts the allocations made by one thread while it steps a component.
+ * It is preloaded, the rt system finds it at runtime:
+ *     LD_PRELOAD=libm3allocguard.so m3rt_server_run
+ * and alloc_guard: count (or trap) in m3_config.yml.
+ */
+
+#define M3_ALLOC_GUARD_SYMBOL "m3_alloc_guard_state"
+
+namespace m3rt
+{
+enum M3AllocGuardMode {M3_ALLOC_GUARD_OFF=0, M3_ALLOC_GUARD_COUNT=1, M3_ALLOC_GUARD_TRAP=2};
+
+/**
+ * @brief Shared between the guard library and M3RtSystem. Only the guarded thread writes comp
+ * and count, no locking.
+ *
+ */
+struct M3AllocGuardState
+{
+    volatile int mode; /**< M3AllocGuardMode */
+    volatile int comp; /**< Index of the component being stepped by thread, -1 outside components */
+    pthread_t thread;
+    long long count[M3_ALLOC_GUARD_MAX_COMPONENTS]; /**< Allocations per component index */
+};
+
+typedef M3AllocGuardState * alloc_guard_state_t();
+
+}
+
+#endif
@@ -324,6 +324,30 @@ typedef void destroy_comp_t(M3Component *);
 
 extern std::map< std::string, create_comp_t *, std::less<std::string> > creator_factory; //global 
 extern std::map< std::string, destroy_comp_t *, std::less<std::string> > destroyer_factory; //global 
+
+/**
+ * @brief Register a component type from a static initializer. Unlike filling creator_factory
+ * directly, this does not depend on the static initialization order, so it also works when the
+ * component library is linked into the same binary as m3base (STATIC_COMPONENTS build).
+ * The types are added to the factory at M3ComponentFactory::Startup().
+ *
+ * @param type
+ * @param create
+ * @param destroy
+ * @return bool Always true, to initialize a static
+ */
+bool RegisterComponentType(const char * type, create_comp_t * create, destroy_comp_t * destroy);
+
+#define M3_REGISTER_CONCAT_(a,b) a##b
+#define M3_REGISTER_CONCAT(a,b) M3_REGISTER_CONCAT_(a,b)
+/**
+ * @brief In the component library: M3_REGISTER_COMPONENT("m3joint", m3::M3Joint)
+ */
+#define M3_REGISTER_COMPONENT(TYPE, CLASS) \
+    static m3rt::M3Component * M3_REGISTER_CONCAT(m3_create_,__LINE__)(){return new CLASS;} \
+    static void M3_REGISTER_CONCAT(m3_destroy_,__LINE__)(m3rt::M3Component * c){delete c;} \
+    static bool M3_REGISTER_CONCAT(m3_registered_,__LINE__) = \
+        m3rt::RegisterComponentType(TYPE, M3_REGISTER_CONCAT(m3_create_,__LINE__), M3_REGISTER_CONCAT(m3_destroy_,__LINE__));
 }
 
 #endif
@@ -17,14 +17,104 @@ You should have received a copy of the GNU Lesser General Public License
 along with M3.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+
 #include "m3rt/base/component_async.h"
+#include "m3rt/base/thread_placement.h"
+#ifndef __RTAI__
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
 
 namespace m3rt{
 	
 using namespace std;
 
+static long long async_now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1000000000LL * (long long)t.tv_sec + (long long)t.tv_nsec;
+}
+
+///////////////////////////////////////////////////////
 
+M3AsyncWakeup::M3AsyncWakeup()
 #ifdef __RTAI__
+    :sem(NULL)
+#else
+    :fd(-1)
+#endif
+{
+}
+
+bool M3AsyncWakeup::Open(int id)
+{
+    Close();
+#ifdef __RTAI__
+    char name[7];
+    snprintf(name, sizeof(name), "M3W%03d", id % 1000);
+    sem = rt_typed_sem_init(nam2num(name), 0, CNT_SEM);
+    return sem != NULL;
+#else
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return fd != -1;
+#endif
+}
+
+void M3AsyncWakeup::Close()
+{
+#ifdef __RTAI__
+    if(sem != NULL)
+        rt_sem_delete(sem);
+    sem = NULL;
+#else
+    if(fd != -1)
+        close(fd);
+    fd = -1;
+#endif
+}
+
+void M3AsyncWakeup::Signal()
+{
+#ifdef __RTAI__
+    if(sem != NULL)
+        rt_sem_signal(sem);
+#else
+    if(fd != -1) {
+        uint64_t one = 1;
+        ssize_t r = write(fd, &one, sizeof(one)); //Only fails if the counter is saturated: already signaled
+        (void)r;
+    }
+#endif
+}
+
+void M3AsyncWakeup::Wait(long long timeout_ns)
+{
+#ifdef __RTAI__
+    if(sem != NULL)
+        rt_sem_wait_timed(sem, nano2count(timeout_ns));
+#else
+    if(fd == -1)
+        return;
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    struct timespec ts;
+    ts.tv_sec = timeout_ns / 1000000000LL;
+    ts.tv_nsec = timeout_ns % 1000000000LL;
+    if(ppoll(&p, 1, &ts, NULL) > 0) {
+        uint64_t v;
+        ssize_t r = read(fd, &v, sizeof(v));
+        (void)r;
+    }
+#endif
+}
 
 ///////////////////////////////////////////////////////
 
@@ -32,119 +122,151 @@ void *async_io_thread(void * arg)
 {
   M3ComponentAsync * aio = (M3ComponentAsync *)arg;    
  
-  M3_INFO("Starting async thread %d.\n", num_asyncs);
-  
-  RT_TASK *task;
-  
-  char buffer [50];
-	int n;
-	n=sprintf (buffer, "%d",num_asyncs);
-	
-	// note this will only handle up to 1000 components
-	char c_name [7] = "M3CXXX";
-	char s_name [7] = "M3SXXX";
-	char t_name [7] = "M3TXXX";
-	
-	n = MIN(3,n);
-	for (int i = 0; i < n; i++)
-	{
-	  c_name[i+3] = buffer[i];
-	  s_name[i+3] = buffer[i];
-	  t_name[i+3] = buffer[i];
-	}
-	
+  M3_INFO("Starting async thread %d.\n", aio->async_id);
   
-  task = rt_task_init_schmod(nam2num(t_name), 3, 0, 0, SCHED_FIFO, 0xFF);
+#ifdef __RTAI__
+  // note this will only handle up to 1000 components
+  char t_name[7];
+  snprintf(t_name, sizeof(t_name), "M3T%03d", aio->async_id % 1000);
+  RT_TASK *task = rt_task_init_schmod(nam2num(t_name), 3, 0, 0, GetThreadPolicy(M3_THREAD_ASYNC, SCHED_FIFO), GetThreadCpuMask(M3_THREAD_ASYNC, 0xFF));
   if (task==NULL)
   {
-	  M3_ERR("Failed to create RT-TASK M3ASY\n",0);	  
+	  M3_ERR("Failed to create RT-TASK %s\n",t_name);	  
+	  aio->thread_ready.Post(M3ReadySignal::FAILED);
 	  return 0;
   }
+  ApplyThreadPlacement(M3_THREAD_ASYNC, t_name, true);
   
   rt_allow_nonroot_hrt();
 	
   mlockall(MCL_CURRENT | MCL_FUTURE);
   
   rt_make_soft_real_time();
-  
-  aio->cmd_mutex = rt_typed_sem_init(nam2num(c_name), 1, BIN_SEM);
-  aio->status_mutex = rt_typed_sem_init(nam2num(s_name), 1, BIN_SEM);
+#else
+  char t_name[16];
+  snprintf(t_name, sizeof(t_name), "async%d", aio->async_id);
+  ApplyThreadPlacement(M3_THREAD_ASYNC, t_name);
+#endif
   
   aio->initializing = false;
+  aio->thread_ready.Post(M3ReadySignal::READY);
+  long long next = async_now_ns();
     
    while (!aio->IsStopping())
    {     
-	rt_sem_wait( aio->cmd_mutex );		
-	aio->GetCommandAsync()->CopyFrom(*(aio->GetCommandShared()));
-	aio->GetParamAsync()->CopyFrom(*(aio->GetParamShared()));
-	rt_sem_signal( aio->cmd_mutex ); 
+	if (aio->IsEventDriven())
+	{
+	    if (!aio->AcquireCommand())
+	    {
+	        aio->WaitCommand(M3_ASYNC_EVENT_TIMEOUT_NS);
+	        continue;
+	    }
+	}
+	else
+	    aio->AcquireCommand();
           
         aio->StepAsync();         
       	
-	rt_sem_wait( aio->status_mutex );	
-	aio->GetStatusShared()->CopyFrom(*(aio->GetStatusAsync()));	
-	rt_sem_signal( aio->status_mutex );
+	aio->PublishStatus();
+
+	if (!aio->IsEventDriven())
+	{
+	    //Absolute deadlines, a late step does not shift the following ones
+	    next += aio->GetAsyncPeriodNs();
+	    long long now = async_now_ns();
+	    if (next < now)
+	        next = now;
+	    struct timespec ts;
+	    ts.tv_sec = next / 1000000000LL;
+	    ts.tv_nsec = next % 1000000000LL;
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
     }    
      
-   if (aio->cmd_mutex != NULL)
-  {
-	rt_sem_delete(aio->cmd_mutex);
-	aio->cmd_mutex = NULL;
-  }
-  
-  if (aio->status_mutex != NULL)
-  {
-	rt_sem_delete(aio->status_mutex);
-	aio->status_mutex = NULL;
-  }  
+#ifdef __RTAI__
+  rt_task_delete(task);
+#endif
     return static_cast<void *>(0);
 }
 
+M3ComponentAsync::~M3ComponentAsync()
+{
+	ReleaseSlots();
+}
+
+void M3ComponentAsync::ReleaseSlots()
+{
+	//Slot 0 are the shared messages of the subclass
+	for (int i = 1; i < 3; i++)
+	{
+		delete cmd_slot[i];
+		delete param_slot[i];
+		delete status_slot[i];
+		cmd_slot[i] = param_slot[i] = status_slot[i] = NULL;
+	}
+}
 
 void M3ComponentAsync::Startup()
 {
 	
 	stop_thread = false;
 	initializing = true;
+	async_id = num_asyncs++;
 
+	ReleaseSlots();
+	cmd_slot[0] = GetCommandShared();
+	param_slot[0] = GetParamShared();
+	status_slot[0] = GetStatusShared();
+	for (int i = 1; i < 3; i++)
+	{
+		cmd_slot[i] = cmd_slot[0]->New();
+		param_slot[i] = param_slot[0]->New();
+		status_slot[i] = status_slot[0]->New();
+	}
+	cmd_index.Reset();
+	status_index.Reset();
 	
-	rc = rt_thread_create((void*)async_io_thread, (void*)this, 1000000);
-	
-	//M3_DEBUG("rc: %d",(int)rc);
-	
-	while(IsInitializing())
-	  usleep(100000);
-	  //M3_DEBUG("waiting for init\n");
-	
-		  
-	if (!cmd_mutex)
+	if (!wakeup.Open(async_id))
 	{
-		M3_ERR("rt Unable to create the cmd_mutex semaphore.\n",0);
+		M3_ERR("Unable to create the wakeup of async component %s.\n",GetName().c_str());
 		stop_thread = true;
 		return;
 	}
+	thread_ready.Reset();
+	
+#ifdef __RTAI__
+	rc = rt_thread_create((void*)async_io_thread, (void*)this, 1000000);
+	thread_started = rc != 0;
+#else
+	pthread_t t;
+	thread_started = pthread_create(&t, NULL, async_io_thread, (void*)this) == 0;
+	rc = (long)t;
+#endif
 	
+	//M3_DEBUG("rc: %d",(int)rc);
 	
-	  
-	if (!status_mutex)
+	if (!thread_started || thread_ready.Wait(M3_THREAD_START_TIMEOUT_NS) != M3ReadySignal::READY)
 	{
-		M3_ERR("rt Unable to create the status_mutex semaphore.\n",0);
+		M3_ERR("Async thread of %s failed to start.\n",GetName().c_str());
 		stop_thread = true;
 		return;
 	}
-	
-	
-	num_asyncs++;
 }
 
 void M3ComponentAsync::Shutdown()
 {            
-      if (rc)
+      if (thread_started)
       {
-	stop_thread = true;	
+	SignalStop();
+#ifdef __RTAI__
 	rt_thread_join(rc);	
+#else
+	pthread_join((pthread_t)rc, NULL);
+#endif
+	thread_started = false;
 	rc = -1;
       }
+      wakeup.Close();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -158,7 +280,22 @@ bool M3ComponentAsync::ReadConfig(const char * filename)
 	if (!M3Component::ReadConfig(filename))
 		return false;
 	//GetYamlDoc(filename, doc);
-	
+	string mode = "periodic";
+	int period_us = RT_TIMER_TICKS_NS / 1000;
+#ifdef YAMLCPP_03
+	try { doc["async_mode"] >> mode; } catch(...) {}
+	try { doc["async_period_us"] >> period_us; } catch(...) {}
+#else
+	mode = doc["async_mode"].as<string>(mode);
+	period_us = doc["async_period_us"].as<int>(period_us);
+#endif
+	if (mode != "periodic" && mode != "event")
+	{
+		M3_WARN("Unknown async_mode %s for %s, using periodic\n",mode.c_str(),GetName().c_str());
+		mode = "periodic";
+	}
+	event_driven = mode == "event";
+	period_ns = 1000LL * (period_us > 0 ? period_us : RT_TIMER_TICKS_NS / 1000);
 	
 	return true;
 }
@@ -171,27 +308,43 @@ bool M3ComponentAsync::LinkDependentComponents()
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+bool M3ComponentAsync::AcquireCommand()
+{
+	if (!cmd_index.Acquire())
+		return false;
+	const int f = cmd_index.Front();
+	GetCommandAsync()->GetReflection()->Swap(GetCommandAsync(), cmd_slot[f]);
+	GetParamAsync()->GetReflection()->Swap(GetParamAsync(), param_slot[f]);
+	return true;
+}
+
+void M3ComponentAsync::PublishStatus()
+{
+	status_slot[status_index.Back()]->CopyFrom(*GetStatusAsync());
+	status_index.Publish();
+}
 
 void M3ComponentAsync::StepStatus()
 {	
-      
-	rt_sem_wait( status_mutex );	
-	GetStatusThread()->CopyFrom(*(GetStatusShared()));	
-	rt_sem_signal( status_mutex );
+	if (status_slot[1] == NULL)
+		return;
+	//Pointer swap, the async thread gets the old status slot back through the exchange
+	if (status_index.Acquire())
+		GetStatusThread()->GetReflection()->Swap(GetStatusThread(), status_slot[status_index.Front()]);
 			
 }
 
 void M3ComponentAsync::StepCommand()
 {			
-    
-	rt_sem_wait( cmd_mutex );		
-	GetCommandShared()->CopyFrom(*(GetCommand()));
-	GetParamShared()->CopyFrom(*(GetParam()));
-	rt_sem_signal( cmd_mutex ); 
-        
+	if (cmd_slot[1] == NULL)
+		return;
+	const int b = cmd_index.Back();
+	cmd_slot[b]->CopyFrom(*(GetCommand()));
+	param_slot[b]->CopyFrom(*(GetParam()));
+	cmd_index.Publish();
+	if (event_driven)
+		wakeup.Signal();
   
 }
 
-#endif
-
 }
@@ -17,6 +17,7 @@ You should have received a copy of the GNU Lesser General Public License
 along with M3.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+
 #ifndef M3_COMPONENT_ASYNC_H
 #define M3_COMPONENT_ASYNC_H
 
@@ -24,6 +25,7 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include <google/protobuf/message.h>
 #include "m3rt/base/m3rt_def.h"
 #include "m3rt/base/component_factory.h"
+#include "m3rt/base/toolbox.h"
 
 //#include "inttypes.h"
 
@@ -37,6 +39,11 @@ extern "C" {
 }  // extern "C"
 #endif 
 #endif
+#include <pthread.h>
+
+#ifdef __cplusplus11__
+#include <atomic>
+#endif
 
 
 // Class to inherit from for async communications within M3
@@ -47,18 +54,123 @@ namespace m3rt
     static int num_asyncs = 0; 
 	
 /**
- * @brief
+ * @brief Lock free triple buffer of slot indices: the writer fills its back slot and publishes it,
+ * the reader takes the latest published slot. Neither side ever waits, slots are swapped, not copied.
+ *
+ */
+class M3TripleIndex
+{
+public:
+    M3TripleIndex(){Reset();}
+    /**
+     * @brief
+     *
+     */
+    void Reset(){back=0;middle=1;front=2;}
+    /**
+     * @brief
+     *
+     * @return int Slot owned by the writer
+     */
+    int Back(){return back;}
+    /**
+     * @brief Hand the back slot over to the reader, get a free one back.
+     *
+     */
+    void Publish(){back = Exchange(back | FRESH) & SLOT_MASK;}
+    /**
+     * @brief Take the latest published slot, if any.
+     *
+     * @return bool False if nothing was published since the last call
+     */
+    bool Acquire(){
+        if(!(Load() & FRESH)) return false;
+        front = Exchange(front) & SLOT_MASK;
+        return true;
+    }
+    /**
+     * @brief
+     *
+     * @return int Slot owned by the reader
+     */
+    int Front(){return front;}
+private:
+    enum {SLOT_MASK=3, FRESH=4};
+#ifdef __cplusplus11__
+    int Exchange(int v){return middle.exchange(v, std::memory_order_acq_rel);}
+    int Load(){return middle.load(std::memory_order_acquire);}
+    std::atomic<int> middle;
+#else
+    int Exchange(int v){return __atomic_exchange_n(&middle, v, __ATOMIC_ACQ_REL);}
+    int Load(){return __atomic_load_n(&middle, __ATOMIC_ACQUIRE);}
+    int middle;
+#endif
+    int back;
+    int front;
+};
+
+/**
+ * @brief Wakes the async thread up. RTAI semaphore with RTAI (can be signaled from hard real-time),
+ * eventfd otherwise.
+ *
+ */
+class M3AsyncWakeup
+{
+public:
+    M3AsyncWakeup();
+    ~M3AsyncWakeup(){Close();}
+    /**
+     * @brief
+     *
+     * @param id Unique per async component (RTAI name)
+     * @return bool
+     */
+    bool Open(int id);
+    /**
+     * @brief
+     *
+     */
+    void Close();
+    /**
+     * @brief
+     *
+     */
+    void Signal();
+    /**
+     * @brief Until Signal() or timeout_ns.
+     *
+     * @param timeout_ns
+     */
+    void Wait(long long timeout_ns);
+private:
+#ifdef __RTAI__
+    SEM * sem;
+#else
+    int fd;
+#endif
+};
+	
+/**
+ * @brief Component whose work runs in its own thread (StepAsync()). The rt side and the async thread
+ * exchange command/param and status through triple buffers: nobody blocks and nothing is copied
+ * under a lock. The async thread runs periodically (async_mode: periodic, async_period_us, the default)
+ * or whenever a new command is published (async_mode: event).
+ *
+ * The shared messages of the subclass are the first slot of each buffer, the two others are
+ * created with New().
  *
  */
 class M3ComponentAsync : public M3Component
 {
 	public:
-		M3ComponentAsync(int p=EC_PRIORITY):M3Component(p),initializing(true),rc(-1),stop_thread(false)
+		M3ComponentAsync(int p=EC_PRIORITY):M3Component(p),initializing(true),async_id(0),rc(-1),stop_thread(false),
+			event_driven(false),period_ns(RT_TIMER_TICKS_NS),thread_started(false)
 		{
 			RegisterVersion("default",DEFAULT);	//RBL
 			RegisterVersion("iss",ISS);		//ISS. Updated safety thresholds to use motor model.
-			
+			for(int i=0;i<3;i++) cmd_slot[i]=param_slot[i]=status_slot[i]=NULL;
 		}
+		virtual ~M3ComponentAsync();
 		
         /**
          * @brief
@@ -75,18 +187,25 @@ class M3ComponentAsync : public M3Component
          * @brief
          *
          */
-        void SignalStop(){stop_thread = true;}
+        void SignalStop(){stop_thread = true; wakeup.Signal();}
         /**
          * @brief
          *
          * @return bool
          */
         bool IsInitializing(){return initializing;}
-		
-#ifdef __RTAI__			
-        SEM * cmd_mutex; 
-            SEM * status_mutex; 
-#endif
+        /**
+         * @brief
+         *
+         * @return bool True in event mode: StepAsync() runs on new commands only
+         */
+        bool IsEventDriven(){return event_driven;}
+        /**
+         * @brief
+         *
+         * @return long long
+         */
+        long long GetAsyncPeriodNs(){return period_ns;}
 
         /**
          * @brief
@@ -132,7 +251,30 @@ class M3ComponentAsync : public M3Component
          * @return google::protobuf::Message
          */
         virtual google::protobuf::Message * GetStatusThread()=0;
+        /**
+         * @brief Async thread: take the latest command and param, if any.
+         *
+         * @return bool
+         */
+        bool AcquireCommand();
+        /**
+         * @brief Async thread: publish GetStatusAsync() to the rt side.
+         *
+         */
+        void PublishStatus();
+        /**
+         * @brief Async thread: sleep until a command is published (event mode).
+         *
+         * @param timeout_ns
+         */
+        void WaitCommand(long long timeout_ns){wakeup.Wait(timeout_ns);}
+#ifdef __cplusplus11__
+        std::atomic<bool> initializing;
+#else
         bool initializing; 
+#endif
+        M3ReadySignal thread_ready;
+        int async_id;
 		
 	protected:
         enum {DEFAULT, ISS};		 
@@ -172,9 +314,23 @@ class M3ComponentAsync : public M3Component
          */
         virtual bool LinkDependentComponents();
 	private:	      
+          void ReleaseSlots();
           long rc; 
+#ifdef __cplusplus11__
+          std::atomic<bool> stop_thread;
+#else
           bool stop_thread; 
+#endif
           int tmp; 
+          bool event_driven;
+          long long period_ns;
+          bool thread_started;
+          M3TripleIndex cmd_index; /**< rt side -> async thread */
+          M3TripleIndex status_index; /**< async thread -> rt side */
+          google::protobuf::Message * cmd_slot[3];
+          google::protobuf::Message * param_slot[3];
+          google::protobuf::Message * status_slot[3];
+          M3AsyncWakeup wakeup;
 
 };
 
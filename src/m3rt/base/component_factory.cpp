@@ -19,6 +19,7 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "m3rt/base/component_factory.h"
 #include "m3rt/base/toolbox.h"
+#include "m3rt/base/config_snapshot.h"
 #include <dlfcn.h>
 #include <iostream>
 #include <map>
@@ -35,9 +36,34 @@ using namespace std;
 //global factory for making components
 map< string, create_comp_t *, less<string> >  creator_factory;	//global
 map< string, destroy_comp_t *, less<string> > destroyer_factory; //global
+
+struct M3ComponentType
+{
+    const char * type;
+    create_comp_t * create;
+    destroy_comp_t * destroy;
+};
+
+//Function static: constructed on first use, whatever the initialization order
+static vector<M3ComponentType>& registered_types()
+{
+    static vector<M3ComponentType> types;
+    return types;
+}
+
+bool RegisterComponentType(const char * type, create_comp_t * create, destroy_comp_t * destroy)
+{
+    M3ComponentType t = {type, create, destroy};
+    registered_types().push_back(t);
+    return true;
+}
 #ifdef YAMLCPP_03
 bool M3ComponentFactory::ReadConfig(const char *filename)
 {
+#ifdef M3_STATIC_COMPONENTS
+    M3_INFO("Static build: ignoring factory_rt_libs, using the linked components only\n");
+    return true;
+#endif
     YAML::Node doc;
     YAML::Emitter out;
     m3rt::GetYamlStream(filename, out);
@@ -58,18 +84,33 @@ bool M3ComponentFactory::ReadConfig(const char *filename)
 #else
 bool M3ComponentFactory::ReadConfig(const char *filename)
 {
-    YAML::Emitter out;
-    if(!m3rt::GetYamlStream(filename, out)){return false;};
-    if(!out.size()){M3_ERR("Failed to read %s, please make sure it exists!\n",filename);return false;}
-    std::vector<YAML::Node> all_docs = YAML::LoadAll(out.c_str());
-    for(std::vector<YAML::Node>::iterator doc_it=all_docs.begin() ; doc_it!= all_docs.end() ; ++doc_it){
+    //Loaded once per start, M3RtSystem takes the component list from it (IsValid())
+    M3ConfigSnapshot * snapshot = GetConfigSnapshot();
+    snapshot->Load();
+#ifdef M3_STATIC_COMPONENTS
+    M3_INFO("Static build: ignoring factory_rt_libs, using the linked components only\n");
+    return true;
+#endif
+    if(snapshot->IsValid() && !snapshot->libraries.empty()) {
+        M3_INFO("Using the config snapshot %s\n", M3ConfigSnapshot::GetPath().c_str());
+        for(size_t i = 0; i < snapshot->libraries.size(); i++)
+            AddComponentLibrary(snapshot->libraries[i]);
+        return true;
+    }
+    //Shared (cached) trees, no need to emit and re-parse them
+    std::vector<YAML::Node> all_docs;
+    if(!m3rt::GetAllYamlDocs(filename, all_docs)){M3_ERR("Failed to read %s, please make sure it exists!\n",filename);return false;}
+    for(std::vector<YAML::Node>::const_iterator doc_it=all_docs.begin() ; doc_it!= all_docs.end() ; ++doc_it){
         try {
-            YAML::Node factory_rt_libs=(*doc_it)["factory_rt_libs"];
+            const YAML::Node& doc = *doc_it;
+            if(doc.IsNull()) continue;
+            const YAML::Node factory_rt_libs=doc["factory_rt_libs"];
             for (YAML::const_iterator it=factory_rt_libs.begin();it!=factory_rt_libs.end();++it) {
                 AddComponentLibrary(it->as<std::string>());
             }
         } catch(YAML::Exception &e) {cout<<"M3ComponentFactory::ReadConfig: "<<e.what()<<endl;}
     }
+    snapshot->libraries = dl_list_str; //Saved by M3RtSystem once the components are read
     return true;
 }
 #endif
@@ -131,7 +172,11 @@ bool M3ComponentFactory::AddComponentLibrary(string lib)
     }
     dl_list_str.push_back(lib);
     void *dlib;
-    dlib = dlopen(lib.c_str(), RTLD_LAZY);//RTLD_NOW);
+#ifdef M3_DLOPEN_LAZY
+    dlib = dlopen(lib.c_str(), RTLD_LAZY);
+#else
+    dlib = dlopen(lib.c_str(), RTLD_NOW); //No lazy binding (and page faults) on the first call from the rt loop
+#endif
     if(dlib == NULL) {
         M3_WARN("Unable to open M3 Component library %s. \nError: %s\n", lib.c_str(), dlerror());
         return false;
@@ -146,7 +191,12 @@ bool M3ComponentFactory::Startup()
 {
     if(!ReadConfig(M3_COMP_LIB_FILENAME))
         return false;
-    if(dl_list.size() == 0) {
+    for(size_t i = 0; i < registered_types().size(); i++) {
+        const M3ComponentType & t = registered_types()[i];
+        creator_factory[t.type] = t.create;
+        destroyer_factory[t.type] = t.destroy;
+    }
+    if(dl_list.size() == 0 && registered_types().empty()) {
         M3_ERR("No M3 Component libraries available\n", 0);
         return false;
     }
@@ -20,6 +20,9 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 
 
 #include "m3rt/base/component_shm.h"
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
 
 namespace m3rt
 {
@@ -36,12 +39,60 @@ bool M3CompShm::ReadConfig(const char * filename)
             shm_id = "M3WAR";
             M3_WARN("shm_id key not found, please add it to %s\n",filename);
         }
+	std::string backend;
+	try{
+	    doc["shm_backend"] >> backend;
+	}catch(...){
+#ifdef __RTAI__
+	    backend = "rtai";
+#else
+	    backend = "posix";
+#endif
+	}
+#ifdef __RTAI__
+	use_posix = (backend == "posix");
+	if (!use_posix && backend != "rtai")
+	    M3_WARN("Unknown shm_backend %s for %s, using rtai\n",backend.c_str(),GetName().c_str());
+#else
+	use_posix = true;
+	if (backend != "posix")
+	    M3_WARN("shm_backend %s not available without RTAI for %s, using posix\n",backend.c_str(),GetName().c_str());
+#endif
+	try{
+	    doc["client_timeout_ms"] >> client_timeout_ms;
+	}catch(...){
+	    client_timeout_ms = 0;
+	}
+	try{
+	    std::string mode;
+	    doc["shm_mode"] >> mode;
+	    shm_mode = strtol(mode.c_str(),NULL,8) & 0666;
+	}catch(...){
+	    shm_mode = 0600; //Clients running as another user need e.g. shm_mode: 0660
+	}
 	return true;
 }
 
 
 void  M3CompShm::StepStatus()
 {
+	if (use_posix)
+	{
+		if (!sds)
+		{
+			SetStateSafeOp();
+			return;
+		}
+		SetSdsFromStatus(m3_sds_write_begin(sds,&sds_layout,M3_SDS_STATUS));
+#ifdef __RTAI__
+		m3_sds_write_end(sds,M3_SDS_STATUS,0); //No syscall from hard real-time, clients poll
+#else
+		m3_sds_write_end(sds,M3_SDS_STATUS,1);
+#endif
+		m3_sds_beat(sds,M3_SDS_STATUS);
+		return;
+	}
+#ifdef __RTAI__
 	if (!shm)
 	{
 		SetStateSafeOp();
@@ -49,37 +100,154 @@ void  M3CompShm::StepStatus()
 	}
 	//if (!IsStateError()) // 
 		SetSdsFromStatus(shm->status);
+#endif
 }
 
 void  M3CompShm::StepCommand()
 {
-      
+	if (use_posix)
+	{
+		StepCommandPosix();
+		return;
+	}
+#ifdef __RTAI__
 	if (!shm) return;
 	if (!IsStateOp())
 		ResetCommandSds(shm->cmd);
 	else	
 		SetCommandFromSds(shm->cmd);
+#endif
+}
 	
+void M3CompShm::StepCommandPosix()
+{
+	if (!sds) return;
+	if (client_timeout_ms>0)
+	{
+		uint64_t hb = m3_sds_heartbeat(sds,M3_SDS_COMMAND);
+		if (hb!=client_heartbeat)
+		{
+			client_heartbeat = hb;
+			client_stale_cycles = 0;
+			if (!client_alive)
+				M3_INFO("Shm client of %s is up\n",GetName().c_str());
+			client_alive = true;
+		}
+		else if (client_alive && ++client_stale_cycles > client_timeout_ms*RT_TASK_FREQUENCY/1000)
+		{
+			M3_WARN("Shm client of %s stalled for %d ms, commands reset\n",GetName().c_str(),client_timeout_ms);
+			client_alive = false;
+		}
+	}
+	else
+		client_alive = true;
+	//Commands published while not OP (or by a stalled client) are dropped, not applied later
+	if (!IsStateOp() || !client_alive)
+	{
+		cmd_seq = m3_sds_seq(sds,M3_SDS_COMMAND);
+		if (!cmd_reset)
+		{
+			ResetCommandSds(&cmd_local[0]);
+			cmd_reset = true;
+		}
+		return;
+	}
+	cmd_reset = false;
+	if (m3_sds_seq(sds,M3_SDS_COMMAND)!=cmd_seq)
+	{
+		//Copy what is used only. On a torn read the last complete command stays
+		uint32_t seq;
+		if (m3_sds_read(sds,&sds_layout,M3_SDS_COMMAND,&cmd_local[0],cmd_local.size(),&seq))
+			cmd_seq = seq;
+	}
+	SetCommandFromSds(&cmd_local[0]);
+}
+
+bool M3CompShm::StartupPosix()
+{
+	size_t status_size = GetStatusSdsSize();
+	size_t cmd_size = GetCommandSdsSize();
+	if (status_size==0 || cmd_size==0)
+	{
+		M3_ERR("Empty status or command sds for %s\n",GetName().c_str());
+		return false;
+	}
+	std::string name = std::string(M3_SHM_SDS_PREFIX)+shm_id;
+	//A segment left by a crashed server is replaced, clients still mapping it see its heartbeat stop
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(),O_RDWR|O_CREAT|O_EXCL,shm_mode);
+	if (fd<0)
+	{
+		M3_ERR("shm_open %s failed for %s: %s\n",name.c_str(),GetName().c_str(),strerror(errno));
+		return false;
+	}
+	fchmod(fd,shm_mode); //Not narrowed by the umask
+	m3_sds_layout(&sds_layout,status_size,cmd_size);
+	if (ftruncate(fd,sds_layout.total_size)!=0)
+	{
+		M3_ERR("ftruncate %s failed for %s: %s\n",name.c_str(),GetName().c_str(),strerror(errno));
+		close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+	void * p = mmap(NULL,sds_layout.total_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (p==MAP_FAILED)
+	{
+		M3_ERR("mmap %s failed for %s: %s\n",name.c_str(),GetName().c_str(),strerror(errno));
+		shm_unlink(name.c_str());
+		return false;
+	}
+	memset(p,0,sds_layout.total_size);
+	sds = (M3ShmSdsHeader*)p;
+	cmd_local.assign(cmd_size,0);
+	cmd_seq = 0;
+	cmd_reset = false;
+	client_heartbeat = 0;
+	client_stale_cycles = 0;
+	client_alive = false;
+	m3_sds_init(sds,&sds_layout);
+	return true;
 }
 
 void  M3CompShm::Startup()
 {
   SetStateSafeOp();
   
+  if (use_posix)
+  {
+    if (!StartupPosix())
+      SetStateError();
+    return;
+  }
+#ifdef __RTAI__
   command_sem = rt_typed_sem_init(nam2num((shm_id+"C").c_str()), 1, BIN_SEM | FIFO_Q );
   status_sem = rt_typed_sem_init(nam2num((shm_id+"S").c_str()), 1, BIN_SEM | FIFO_Q );
   
   shm = (M3Sds*)rt_shm_alloc(nam2num((shm_id+"M").c_str()),sizeof(M3Sds),USE_VMALLOC);  
   memset(shm,0,sizeof(M3Sds));
-  
+  shm->n_byte_status = GetStatusSdsSize();
+  shm->n_byte_cmd = GetCommandSdsSize();
+#endif
 }
 
 void  M3CompShm::Shutdown()
 {  
+  if (use_posix)
+  {
+    if (sds)
+    {
+      munmap(sds,sds_layout.total_size);
+      shm_unlink((std::string(M3_SHM_SDS_PREFIX)+shm_id).c_str());
+      sds = NULL;
+    }
+    return;
+  }
+#ifdef __RTAI__
   rt_shm_free(nam2num((shm_id+"M").c_str()));
   rt_sem_delete(command_sem);
   rt_sem_delete(status_sem);
+#endif
 }
 
 }	
-
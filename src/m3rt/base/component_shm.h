@@ -23,6 +23,7 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include "m3rt/base/component.h"
 #include "m3rt/base/component_base.pb.h"
 //#include <m3rt/toolbox/toolbox.h>
+#ifdef __RTAI__
 #ifdef __cplusplus
 extern "C" {
 #endif 
@@ -37,9 +38,12 @@ extern "C" {
 #ifdef __cplusplus
 }  // extern "C"
 #endif 
+#endif
 #include "m3rt/base/m3rt_def.h"
 #include "m3rt/base/m3ec_def.h"
 #include "m3rt/base/toolbox.h"
+#include "m3rt/base/shm_sds.h"
+#include <vector>
 
 
 namespace m3rt
@@ -47,12 +51,17 @@ namespace m3rt
 ////////////////////////////////////////////////////////////////
  
 /**
- * @brief
+ * @brief Exchange of a status and a command struct with an external process.
+ * Two backends, selected by shm_backend in the component config:
+ * - rtai (default with RTAI): M3Sds in RTAI shared memory, guarded by the shm_id+"S"/"C" semaphores
+ * - posix (always available): /dev/shm/m3sds_<shm_id>, layout and client side in shm_sds.h
  *
  */
 class M3CompShm: public M3Component{
 	public:
-		M3CompShm(int p=EC_PRIORITY):M3Component(p),shm(NULL),status_sem(NULL), command_sem(NULL){}
+		M3CompShm(int p=EC_PRIORITY):M3Component(p),shm(NULL),status_sem(NULL), command_sem(NULL),
+                sds(NULL),shm_mode(0600),use_posix(true),cmd_seq(0),cmd_reset(false),client_timeout_ms(0),
+                client_heartbeat(0),client_stale_cycles(0),client_alive(false){}
 		
 	protected:		
         /**
@@ -111,32 +120,65 @@ class M3CompShm: public M3Component{
          *
          * @param sds
          */
-        virtual void ResetCommandSds(unsigned char * sds){memset(sds,0,MAX_SDS_SIZE_BYTES);}
+        virtual void ResetCommandSds(unsigned char * sds){memset(sds,0,GetCommandSdsSize());}
+        /**
+         * @brief With the posix backend, false if the client heartbeat stalled for client_timeout_ms
+         * (never published if client_timeout_ms is 0). Always true with the rtai backend.
+         *
+         * @return bool
+         */
+        bool IsClientAlive(){return !use_posix || client_alive;}
         /**
          * @brief
          *
          */
-        void request_status(){rt_sem_wait(status_sem);}
+#ifdef __RTAI__
+        void request_status(){if (status_sem) rt_sem_wait(status_sem);}
         /**
          * @brief
          *
          */
-        void release_status(){rt_sem_signal(status_sem);}
+        void release_status(){if (status_sem) rt_sem_signal(status_sem);}
         /**
          * @brief
          *
          */
-        void request_command(){rt_sem_wait(command_sem);}
+        void request_command(){if (command_sem) rt_sem_wait(command_sem);}
         /**
          * @brief
          *
          */
-        void release_command(){rt_sem_signal(command_sem);}
+        void release_command(){if (command_sem) rt_sem_signal(command_sem);}
+#else
+        void request_status(){}
+        void release_status(){}
+        void request_command(){}
+        void release_command(){}
+#endif
 	private:
+        bool StartupPosix();
+        void StepCommandPosix();
+#ifdef __RTAI__
         M3Sds * shm;				 
         SEM * status_sem; 
         SEM * command_sem;	 
+#else
+        void * shm; // to preserve initializer
+        void * status_sem;
+        void * command_sem;
+#endif
         std::string shm_id; 
+        M3ShmSdsHeader * sds; /**< posix backend */
+        M3ShmSdsLayout sds_layout; /**< Computed at startup, the client can write the header */
+        int shm_mode; /**< Of /dev/shm/m3sds_<shm_id>, shm_mode in the config (octal) */
+        bool use_posix;
+        uint32_t cmd_seq; /**< Last command publish applied */
+        bool cmd_reset; /**< cmd_local reset since the component left OP */
+        std::vector<unsigned char> cmd_local; /**< Last complete command, what SetCommandFromSds gets */
+        int client_timeout_ms;
+        uint64_t client_heartbeat;
+        int client_stale_cycles;
+        bool client_alive;
 };
 
 }
@@ -0,0 +1,376 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "m3rt/base/config_snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace m3rt
+{
+using namespace std;
+
+/*
+ * Layout (little endian, as written by this host):
+ *   header  : magic[8] version:u32 reserved:u32 payload_size:u64 payload_hash:u64
+ *   payload : m3_robot:str
+ *             n:u32 { path:str exists:u8 mtime_sec:u64 mtime_nsec:u64 size:u64 hash:u64 [node] }
+ *             n:u32 { library:str }
+ *             n:u32 { component_type:str name:str type:str file:str }
+ *   str     : len:u32 bytes
+ *   node    : kind:u8 (0 null, 1 scalar:str, 2 sequence n:u32 {node}, 3 map n:u32 {node node})
+ */
+static const char snapshot_magic[8] = {'M', '3', 'C', 'F', 'G', 'S', 'N', 'P'};
+
+struct M3SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t payload_size;
+    uint64_t payload_hash;
+};
+
+enum {NODE_NULL = 0, NODE_SCALAR = 1, NODE_SEQUENCE = 2, NODE_MAP = 3};
+
+static uint64_t fnv_hash(const char *p, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+M3ConfigSnapshot * GetConfigSnapshot()
+{
+    static M3ConfigSnapshot snapshot;
+    return &snapshot;
+}
+
+string M3ConfigSnapshot::GetPath()
+{
+    const char *robot = getenv(M3_ROBOT_ENV_VAR);
+    if(robot == NULL || robot[0] == '\0')
+        return string();
+    string s(robot);
+    return s.substr(0, s.find(':')) + M3_CONFIG_SNAPSHOT_FILE;
+}
+
+#ifndef YAMLCPP_03
+////////////////////////////////////////////////////////////////////////////////
+
+class M3SnapshotWriter
+{
+public:
+    void U8(uint8_t v){buf.append((const char *)&v, 1);}
+    void U32(uint32_t v){buf.append((const char *)&v, 4);}
+    void U64(uint64_t v){buf.append((const char *)&v, 8);}
+    void Str(const string& s){U32(s.size()); buf.append(s);}
+    void Node(const YAML::Node& n)
+    {
+        if(n.IsScalar()) {
+            U8(NODE_SCALAR);
+            Str(n.Scalar());
+        } else if(n.IsSequence()) {
+            U8(NODE_SEQUENCE);
+            U32(n.size());
+            for(YAML::const_iterator it = n.begin(); it != n.end(); ++it)
+                Node(*it);
+        } else if(n.IsMap()) {
+            U8(NODE_MAP);
+            U32(n.size());
+            for(YAML::const_iterator it = n.begin(); it != n.end(); ++it) {
+                Node(it->first);
+                Node(it->second);
+            }
+        } else {
+            U8(NODE_NULL);
+        }
+    }
+    string buf;
+};
+
+class M3SnapshotReader
+{
+public:
+    M3SnapshotReader(const char *p, size_t n):cur(p), end(p + n), ok(true){}
+    bool Get(void *v, size_t n)
+    {
+        if(!ok || (size_t)(end - cur) < n)
+            return ok = false;
+        memcpy(v, cur, n);
+        cur += n;
+        return true;
+    }
+    uint8_t U8(){uint8_t v = 0; Get(&v, 1); return v;}
+    uint32_t U32(){uint32_t v = 0; Get(&v, 4); return v;}
+    uint64_t U64(){uint64_t v = 0; Get(&v, 8); return v;}
+    string Str()
+    {
+        uint32_t n = U32();
+        if(!ok || (size_t)(end - cur) < n) {
+            ok = false;
+            return string();
+        }
+        string s(cur, n);
+        cur += n;
+        return s;
+    }
+    /**
+     * @brief Build the node into out, or only skip it if out is NULL.
+     */
+    void Node(YAML::Node *out, int depth = 0)
+    {
+        if(depth > 256) { //Corrupted file, don't blow the stack
+            ok = false;
+            return;
+        }
+        uint8_t kind = U8();
+        if(!ok) return;
+        if(kind == NODE_SCALAR) {
+            uint32_t n = U32();
+            if(!ok || (size_t)(end - cur) < n) {
+                ok = false;
+                return;
+            }
+            if(out)
+                *out = YAML::Node(string(cur, n));
+            cur += n;
+        } else if(kind == NODE_SEQUENCE) {
+            uint32_t n = U32();
+            if(out)
+                *out = YAML::Node(YAML::NodeType::Sequence);
+            for(uint32_t i = 0; i < n && ok; i++) {
+                if(out) {
+                    YAML::Node v;
+                    Node(&v, depth + 1);
+                    out->push_back(v);
+                } else {
+                    Node(NULL, depth + 1);
+                }
+            }
+        } else if(kind == NODE_MAP) {
+            uint32_t n = U32();
+            if(out)
+                *out = YAML::Node(YAML::NodeType::Map);
+            for(uint32_t i = 0; i < n && ok; i++) {
+                if(out) {
+                    YAML::Node k, v;
+                    Node(&k, depth + 1);
+                    Node(&v, depth + 1);
+                    if(k.IsScalar())
+                        (*out)[k.Scalar()] = v;
+                    else
+                        (*out)[k] = v;
+                } else {
+                    Node(NULL, depth + 1);
+                    Node(NULL, depth + 1);
+                }
+            }
+        } else if(kind == NODE_NULL) {
+            if(out)
+                *out = YAML::Node(YAML::NodeType::Null);
+        } else {
+            ok = false;
+        }
+    }
+    const char *cur;
+    const char *end;
+    bool ok;
+};
+
+bool M3ConfigSnapshot::Load()
+{
+    valid = false;
+    string path = GetPath();
+    if(path.empty())
+        return false;
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(M3SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return false;
+    const char *base = (const char *)map;
+    M3SnapshotHeader h;
+    memcpy(&h, base, sizeof(h));
+    const char *payload = base + sizeof(h);
+    size_t payload_size = st.st_size - sizeof(h);
+    if(memcmp(h.magic, snapshot_magic, sizeof(snapshot_magic)) != 0 || h.version != M3_CONFIG_SNAPSHOT_VERSION
+            || h.payload_size != payload_size || h.payload_hash != fnv_hash(payload, payload_size)) {
+        M3_INFO("Ignoring config snapshot %s (other version or corrupted)\n", path.c_str());
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    M3SnapshotReader r(payload, payload_size);
+    string robot = r.Str();
+    const char *env = getenv(M3_ROBOT_ENV_VAR);
+    bool ok = r.ok && env && robot == env;
+    //First pass: check every source file, nodes are only skipped
+    uint32_t nsrc = r.U32();
+    vector<M3YamlSource> sources;
+    vector<const char *> node_pos;
+    for(uint32_t i = 0; i < nsrc && ok && r.ok; i++) {
+        M3YamlSource s;
+        s.path = r.Str();
+        s.exists = r.U8() != 0;
+        s.mtime_sec = r.U64();
+        s.mtime_nsec = r.U64();
+        s.size = r.U64();
+        s.hash = r.U64();
+        node_pos.push_back(r.cur);
+        if(s.exists)
+            r.Node(NULL);
+        struct stat fs;
+        bool exists = stat(s.path.c_str(), &fs) == 0;
+        if(exists != s.exists) {
+            ok = false;
+        } else if(exists && (fs.st_mtim.tv_sec != s.mtime_sec || fs.st_mtim.tv_nsec != s.mtime_nsec || fs.st_size != s.size)) {
+            //Touched: still valid if the content did not change
+            unsigned long long hash;
+            ok = GetFileHash(s.path, hash) && hash == s.hash;
+            s.mtime_sec = fs.st_mtim.tv_sec;
+            s.mtime_nsec = fs.st_mtim.tv_nsec;
+            s.size = fs.st_size;
+        }
+        sources.push_back(s);
+    }
+    vector<string> libs;
+    vector<Component> comps;
+    if(ok && r.ok) {
+        uint32_t n = r.U32();
+        for(uint32_t i = 0; i < n && r.ok; i++)
+            libs.push_back(r.Str());
+        n = r.U32();
+        for(uint32_t i = 0; i < n && r.ok; i++) {
+            Component c;
+            c.component_type = r.Str();
+            c.name = r.Str();
+            c.type = r.Str();
+            c.file = r.Str();
+            comps.push_back(c);
+        }
+    }
+    //Second pass: build the trees
+    for(size_t i = 0; i < sources.size() && ok && r.ok; i++) {
+        if(!sources[i].exists)
+            continue;
+        M3SnapshotReader rn(node_pos[i], payload + payload_size - node_pos[i]);
+        rn.Node(&sources[i].node);
+        r.ok = rn.ok;
+    }
+    munmap(map, st.st_size);
+    if(!r.ok) {
+        M3_INFO("Ignoring config snapshot %s (corrupted)\n", path.c_str());
+        return false;
+    }
+    if(!ok) {
+        M3_INFO("Config files changed since the last start, not using the config snapshot\n");
+        return false;
+    }
+    SeedYamlCache(sources);
+    libraries.swap(libs);
+    components.swap(comps);
+    valid = true;
+    return true;
+}
+
+bool M3ConfigSnapshot::Save()
+{
+    string path = GetPath();
+    const char *env = getenv(M3_ROBOT_ENV_VAR);
+    if(path.empty() || !env)
+        return false;
+    vector<M3YamlSource> sources;
+    GetYamlCacheSources(sources);
+    M3SnapshotWriter w;
+    w.Str(env);
+    w.U32(sources.size());
+    for(size_t i = 0; i < sources.size(); i++) {
+        const M3YamlSource & s = sources[i];
+        w.Str(s.path);
+        w.U8(s.exists ? 1 : 0);
+        w.U64(s.mtime_sec);
+        w.U64(s.mtime_nsec);
+        w.U64(s.size);
+        w.U64(s.hash);
+        if(s.exists)
+            w.Node(s.node);
+    }
+    w.U32(libraries.size());
+    for(size_t i = 0; i < libraries.size(); i++)
+        w.Str(libraries[i]);
+    w.U32(components.size());
+    for(size_t i = 0; i < components.size(); i++) {
+        w.Str(components[i].component_type);
+        w.Str(components[i].name);
+        w.Str(components[i].type);
+        w.Str(components[i].file);
+    }
+    M3SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, snapshot_magic, sizeof(snapshot_magic));
+    h.version = M3_CONFIG_SNAPSHOT_VERSION;
+    h.payload_size = w.buf.size();
+    h.payload_hash = fnv_hash(w.buf.data(), w.buf.size());
+    //Write then rename, a crash never leaves a half written snapshot
+    string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(!f) {
+        M3_WARN("Unable to write the config snapshot %s\n", tmp.c_str());
+        return false;
+    }
+    bool ret = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(w.buf.data(), 1, w.buf.size(), f) == w.buf.size();
+    ret = (fclose(f) == 0) && ret;
+    if(!ret || rename(tmp.c_str(), path.c_str()) != 0) {
+        M3_WARN("Unable to write the config snapshot %s\n", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    M3_INFO("Saved config snapshot %s (%d files, %d components)\n", path.c_str(), (int)sources.size(), (int)components.size());
+    return true;
+}
+#else
+bool M3ConfigSnapshot::Load()
+{
+    valid = false;
+    return false;
+}
+
+bool M3ConfigSnapshot::Save()
+{
+    return false;
+}
+#endif
+
+}
@@ -0,0 +1,96 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M3RT_CONFIG_SNAPSHOT_H
+#define M3RT_CONFIG_SNAPSHOT_H
+
+#include "m3rt/base/toolbox.h"
+#include <string>
+#include <vector>
+
+namespace m3rt
+{
+/**
+ * @brief Fully resolved configuration of the last start: component libraries, components
+ * (in creation order) and the parsed tree of every config file read, missing files included.
+ * Saved in binary form to $M3_ROBOT[0]/M3_CONFIG_SNAPSHOT_FILE. On the next start it is mapped,
+ * checked against the config files (mtime/size, then content hash) and seeds the yaml cache,
+ * so nothing is resolved or parsed again.
+ *
+ */
+class M3ConfigSnapshot
+{
+public:
+    /**
+     * @brief
+     *
+     */
+    struct Component
+    {
+        std::string component_type; /**< ec_components or rt_components */
+        std::string name;
+        std::string type;
+        std::string file; /**< Relative to the robot config dir, as passed to ReadConfig() */
+    };
+    M3ConfigSnapshot():valid(false){}
+    /**
+     * @brief Map and check the snapshot, seed the yaml cache if it is still valid.
+     *
+     * @return bool False if there is no valid snapshot (cold start)
+     */
+    bool Load();
+    /**
+     * @brief Write libraries, components and the current yaml cache content.
+     *
+     * @return bool
+     */
+    bool Save();
+    /**
+     * @brief
+     *
+     * @return bool True if the last Load() succeeded
+     */
+    bool IsValid(){return valid;}
+    /**
+     * @brief Once the components of a start were created from it.
+     *
+     */
+    void Invalidate(){valid = false;}
+    /**
+     * @brief
+     *
+     * @return std::string Empty if M3_ROBOT is not set
+     */
+    static std::string GetPath();
+    std::vector<std::string> libraries;
+    std::vector<Component> components;
+private:
+    bool valid;
+};
+
+/**
+ * @brief The process wide snapshot, shared by the factory (libraries) and M3RtSystem (components).
+ *
+ * @return M3ConfigSnapshot *
+ */
+M3ConfigSnapshot * GetConfigSnapshot();
+
+}
+
+#endif
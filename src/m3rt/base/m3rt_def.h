@@ -59,6 +59,15 @@ typedef double mReal;
 #define SEMNAM_M3READY  "M3READY"
 
 #define RT_DATA_SERVICE_PERIOD_HZ 250
+#define RT_DATA_SERVICE_STREAM_TIMEOUT_NS 100000000 //Max wait for an rt cycle in streaming mode (100ms)
+#define RT_DATA_CLIENT_TIMEOUT_US 4000000 //Max wait for a status packet on the client side (4s, same as M3RtProxy)
+#define RT_LOG_BUFFER_BYTES 16777216 //Default log_buffer_bytes: log memory, session buffers first, the rest for snapshots
+#define RT_LOG_SNAPSHOT_MIN_SLOTS 16 //Sampled cycles buffered between the rt thread and the log writer, whatever the budget
+#define RT_LOG_SNAPSHOT_MAX_SLOTS 10000
+#define RT_LOG_WRITER_PERIOD_NS 10000000 //Log writer wake up period (encodes the snapshots, writes full pages)
+#define RT_LOG_SUMMARY_BINS_PER_FILE 1000 //Bins of a log summary level per .pb.sum file
+#define RT_LOG_TAIL_WINDOW 2000 //Log entries sent to a tail subscriber and not acknowledged yet
+#define RT_LOG_TAIL_MAX_PER_PACKET 200 //Log entries per data service packet
 
 /*-------------------- ENVIRONMENT AND CONFIG ----------------------------*/
 #define M3_ROBOT_ENV_VAR "M3_ROBOT"
@@ -66,6 +75,30 @@ typedef double mReal;
 #define M3_CONFIG_FILENAME    "m3_config.yml"
 //#define M3_COMP_LIB_FILENAME    "m3_component_libs.yml"
 #define M3_COMP_LIB_FILENAME  "m3_config.yml"
+#define M3_YAML_PREFETCH_THREADS 8 //Max threads parsing component config files at startup
+#define M3_CONFIG_SNAPSHOT_FILE "/robot_log/m3_config.snapshot" //Resolved config of the last start, relative to the first M3_ROBOT path
+#define M3_CONFIG_SNAPSHOT_VERSION 1 //Bump when the snapshot layout changes
+
+/*-------------------- LOGGING (M3_INFO/WARN/ERR/DEBUG) ----------------------------*/
+#define M3LOG_MSG_SIZE 256 //Max length of a formatted message
+#define M3LOG_RING_SIZE 64 //Messages buffered per thread before they are dropped
+#define M3LOG_MAX_THREADS 32 //Threads that can log at the same time without blocking
+#define M3LOG_MAX_SITES 512 //Call sites tracked for rate limiting
+#define M3LOG_MAX_PER_SEC 10 //Messages per second and per call site
+#define M3LOG_DRAIN_PERIOD_US 10000 //Writer thread period
+
+/*-------------------- STARTUP AND SHUTDOWN ----------------------------*/
+#define M3_READY_POLL_NS 1000000 //Max latency to notice a state posted without wakeup (from hard real-time)
+#define M3_THREAD_START_TIMEOUT_NS 1000000000 //Max wait for a service thread to come up
+#define M3_THREAD_STOP_TIMEOUT_NS 4000000000LL //Max wait for a thread to exit
+#define RT_SYSTEM_STARTUP_TIMEOUT_NS 10000000000LL //Max wait for the rt loop (dry run included)
+#define RT_DRY_RUN_OK_CYCLES 100 //Consecutive error free cycles ending the dry run
+#define M3_ASYNC_EVENT_TIMEOUT_NS 100000000 //Max sleep of an event driven async thread between stop checks
+#define RT_WARMUP_CYCLES 200 //Cycles run before startup completes, message buffers reach their steady state size
+#define RT_PREFAULT_STACK_BYTES 65536 //Rt thread stack faulted in before the loop
+#define RT_PREFAULT_HEAP_BYTES 16777216 //Rt thread malloc arena faulted in before the loop
+#define M3_ALLOC_GUARD_MAX_COMPONENTS 512 //Components tracked by the allocation guard
+
 /*-------------------- CONVERSION MACROS ----------------------------*/
 #define GRAV -9.809
 #ifndef M_PI
@@ -0,0 +1,165 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "m3rt/base/perf_counters.h"
+#include "m3rt/base/toolbox.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace m3rt
+{
+
+static const unsigned long long perf_events[M3PerfCounters::NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+static const char * perf_names[M3PerfCounters::NUM_COUNTERS] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+    return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned long long rdpmc(unsigned int counter)
+{
+    unsigned int low, high;
+    __asm__ __volatile__("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return (unsigned long long)low | ((unsigned long long)high << 32);
+}
+
+// Self-monitoring sequence from linux/perf_event.h: retry if the counter was rescheduled meanwhile
+static bool read_user(volatile struct perf_event_mmap_page *pc, unsigned long long & value)
+{
+    unsigned int seq;
+    unsigned long long count;
+    do {
+        seq = pc->lock;
+        __asm__ __volatile__("" ::: "memory");
+        const unsigned int idx = pc->index;
+        if(!pc->cap_user_rdpmc || idx == 0)
+            return false;
+        count = pc->offset;
+        const unsigned short width = pc->pmc_width;
+        const unsigned long long m = 1ULL << (width - 1);
+        unsigned long long pmc = rdpmc(idx - 1) & ((m << 1) - 1);
+        count += (pmc ^ m) - m; //Sign extend from width bits, wraps like the kernel's
+        __asm__ __volatile__("" ::: "memory");
+    } while(pc->lock != seq);
+    value = count;
+    return true;
+}
+#else
+static bool read_user(volatile struct perf_event_mmap_page *, unsigned long long &)
+{
+    return false;
+}
+#endif
+
+M3PerfCounters::M3PerfCounters():user_read(false),user_read_only(false)
+{
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        fd[i] = -1;
+        page[i] = NULL;
+    }
+}
+
+const char * M3PerfCounters::GetName(int idx)
+{
+    return idx >= 0 && idx < NUM_COUNTERS ? perf_names[idx] : "";
+}
+
+bool M3PerfCounters::Open()
+{
+    Close();
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_events[i];
+        attr.disabled = i == 0; //The group starts when the leader is enabled
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        fd[i] = perf_event_open(&attr, 0, -1, i == 0 ? -1 : fd[0], 0);
+        if(fd[i] == -1) {
+            M3_WARN("perf_event_open failed for %s (%s)\n", perf_names[i], strerror(errno));
+            Close();
+            return false;
+        }
+    }
+    user_read = true;
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        page[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd[i], 0);
+        if(page[i] == MAP_FAILED) {
+            page[i] = NULL;
+            user_read = false;
+        }
+    }
+    ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    unsigned long long v[NUM_COUNTERS];
+    if(user_read)
+        for(int i = 0; i < NUM_COUNTERS && user_read; i++)
+            user_read = read_user((volatile struct perf_event_mmap_page *)page[i], v[i]);
+    return true;
+}
+
+void M3PerfCounters::Close()
+{
+    for(int i = NUM_COUNTERS - 1; i >= 0; i--) {
+        if(page[i] != NULL)
+            munmap(page[i], sysconf(_SC_PAGESIZE));
+        page[i] = NULL;
+        if(fd[i] != -1)
+            close(fd[i]);
+        fd[i] = -1;
+    }
+    user_read = false;
+}
+
+bool M3PerfCounters::Read(unsigned long long v[NUM_COUNTERS])
+{
+    if(!IsOpen())
+        return false;
+    if(user_read) {
+        int i = 0;
+        for(; i < NUM_COUNTERS; i++)
+            if(!read_user((volatile struct perf_event_mmap_page *)page[i], v[i]))
+                break;
+        if(i == NUM_COUNTERS)
+            return true;
+    }
+    if(user_read_only)
+        return false;
+    unsigned long long buf[1 + NUM_COUNTERS]; //nr, then the values in group order
+    if(read(fd[0], buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+        return false;
+    for(int i = 0; i < NUM_COUNTERS; i++)
+        v[i] = buf[1 + i];
+    return true;
+}
+
+}
@@ -0,0 +1,91 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef M3RT_PERF_COUNTERS_H
+#define M3RT_PERF_COUNTERS_H
+
+namespace m3rt
+{
+/**
+ * @brief Hardware counters of the calling thread (user space only), opened as one perf_event_open group.
+ * Read() uses rdpmc on the mapped counter pages when the kernel allows it (no syscall, safe in hard
+ * real-time), read() on the group otherwise, unless SetUserReadOnly() is set.
+ *
+ */
+class M3PerfCounters
+{
+public:
+    enum {CYCLES=0, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES, NUM_COUNTERS};
+    M3PerfCounters();
+    ~M3PerfCounters(){Close();}
+    /**
+     * @brief Open and start the counters for the calling thread.
+     *
+     * @return bool False if the events are not available (no PMU, perf_event_paranoid, ...)
+     */
+    bool Open();
+    /**
+     * @brief
+     *
+     */
+    void Close();
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool IsOpen(){return fd[0] != -1;}
+    /**
+     * @brief
+     *
+     * @return bool True if Read() does not enter the kernel
+     */
+    bool IsUserRead(){return user_read;}
+    /**
+     * @brief Never fall back to read() (a syscall): Read() fails when rdpmc can't be used for a
+     * sample, e.g. while the events are descheduled. For hard real-time threads.
+     *
+     * @param on
+     */
+    void SetUserReadOnly(bool on){user_read_only = on;}
+    /**
+     * @brief Current counter values, only differences are meaningful.
+     *
+     * @param v
+     * @return bool False if the counters are closed, or rdpmc failed with SetUserReadOnly()
+     */
+    bool Read(unsigned long long v[NUM_COUNTERS]);
+    /**
+     * @brief
+     *
+     * @param idx
+     * @return const char*
+     */
+    static const char * GetName(int idx);
+private:
+    int fd[NUM_COUNTERS];
+    void * page[NUM_COUNTERS];
+    bool user_read;
+    bool user_read_only;
+};
+
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M3RT_SHM_SDS_H
+#define M3RT_SHM_SDS_H
+
+/*
+ * POSIX shared memory layout of M3CompShm, usable from C by the external process.
+ *
+ * /dev/shm/m3sds_<shm_id> holds a header followed by two buffers per direction
+ * (status: server -> client, command: client -> server), each sized to what the component
+ * actually uses. Every direction has a single writer and a sequence counter seq:
+ *  - seq odd: the writer is filling buffer ((seq>>1)+1)&1
+ *  - seq even: buffer (seq>>1)&1 is the last one published
+ * A reader copies the published buffer and keeps the copy if seq did not move by more than
+ * one write meanwhile (the writer only touched the other buffer). The writer never waits,
+ * the reader almost never retries. seq is also the futex word readers can sleep on.
+ * Each side bumps its heartbeat once per cycle so the other one can tell a stale peer.
+ *
+ * The mapping is writable by the client, so neither side takes buffer offsets or sizes from
+ * it: each one keeps a M3ShmSdsLayout computed from the sizes it was built for. The sizes in
+ * the header only let the client check that both agree.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define M3_SHM_SDS_MAGIC 0x4d335344 /* "M3SD", written last by the server */
+#define M3_SHM_SDS_VERSION 2
+#define M3_SHM_SDS_PREFIX "/m3sds_"
+#define M3_SHM_SDS_ALIGN 64
+#define M3_SHM_SDS_READ_RETRIES 4
+
+enum
+{
+    M3_SDS_STATUS = 0, /* Written by the server */
+    M3_SDS_COMMAND = 1 /* Written by the client */
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t total_size;
+    uint32_t size[2]; /* Bytes used in each direction, GetStatusSdsSize/GetCommandSdsSize */
+    uint32_t seq[2];
+    uint32_t waiters[2]; /* Readers sleeping on seq, the writer only wakes if non zero */
+    uint64_t heartbeat[2]; /* [M3_SDS_STATUS]: server, [M3_SDS_COMMAND]: client */
+    int32_t server_pid;
+    uint32_t reserved;
+} M3ShmSdsHeader;
+
+/* Process-local, never read back from the mapping */
+typedef struct
+{
+    uint32_t total_size;
+    uint32_t size[2];
+    uint32_t offset[2][2]; /* Offset of both buffers of each direction from the header */
+} M3ShmSdsLayout;
+
+static inline uint32_t m3_sds_align(uint32_t n)
+{
+    return (n + M3_SHM_SDS_ALIGN - 1) & ~(uint32_t)(M3_SHM_SDS_ALIGN - 1);
+}
+
+static inline uint32_t m3_sds_total_size(uint32_t status_size, uint32_t cmd_size)
+{
+    return m3_sds_align(sizeof(M3ShmSdsHeader)) + 2 * m3_sds_align(status_size) + 2 * m3_sds_align(cmd_size);
+}
+
+static inline void m3_sds_layout(M3ShmSdsLayout * l, uint32_t status_size, uint32_t cmd_size)
+{
+    uint32_t off = m3_sds_align(sizeof(M3ShmSdsHeader));
+    int d, i;
+    l->total_size = m3_sds_total_size(status_size, cmd_size);
+    l->size[M3_SDS_STATUS] = status_size;
+    l->size[M3_SDS_COMMAND] = cmd_size;
+    for (d = 0; d < 2; d++)
+        for (i = 0; i < 2; i++)
+        {
+            l->offset[d][i] = off;
+            off += m3_sds_align(l->size[d]);
+        }
+}
+
+/* Fill in the header of a zeroed area of l->total_size bytes. */
+static inline void m3_sds_init(M3ShmSdsHeader * h, const M3ShmSdsLayout * l)
+{
+    h->version = M3_SHM_SDS_VERSION;
+    h->header_size = sizeof(M3ShmSdsHeader);
+    h->total_size = l->total_size;
+    h->size[M3_SDS_STATUS] = l->size[M3_SDS_STATUS];
+    h->size[M3_SDS_COMMAND] = l->size[M3_SDS_COMMAND];
+    h->server_pid = (int32_t)getpid();
+    __atomic_store_n(&h->magic, M3_SHM_SDS_MAGIC, __ATOMIC_RELEASE);
+}
+
+static inline unsigned char * m3_sds_buffer(M3ShmSdsHeader * h, const M3ShmSdsLayout * l, int dir, int idx)
+{
+    return (unsigned char *)h + l->offset[dir][idx & 1];
+}
+
+/* Writer side. Returns the buffer to fill, m3_sds_write_end() publishes it. */
+static inline unsigned char * m3_sds_write_begin(M3ShmSdsHeader * h, const M3ShmSdsLayout * l, int dir)
+{
+    uint32_t s = __atomic_load_n(&h->seq[dir], __ATOMIC_RELAXED);
+    __atomic_store_n(&h->seq[dir], s + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return m3_sds_buffer(h, l, dir, (s >> 1) + 1);
+}
+
+/* wake=0 skips the futex syscall (hard real-time writer), readers then have to poll seq. */
+static inline void m3_sds_write_end(M3ShmSdsHeader * h, int dir, int wake)
+{
+    uint32_t s = __atomic_load_n(&h->seq[dir], __ATOMIC_RELAXED);
+    __atomic_store_n(&h->seq[dir], s + 1, __ATOMIC_RELEASE);
+    if (wake && __atomic_load_n(&h->waiters[dir], __ATOMIC_ACQUIRE))
+        syscall(SYS_futex, &h->seq[dir], FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+}
+
+/* Sequence number of the last publish, changes with every write. */
+static inline uint32_t m3_sds_seq(M3ShmSdsHeader * h, int dir)
+{
+    return __atomic_load_n(&h->seq[dir], __ATOMIC_ACQUIRE) & ~1u;
+}
+
+/*
+ * Reader side. Copies the last published buffer (min of size and the layout size) to dst.
+ * Returns 1 on success and sets *seq to its sequence number, 0 if the writer kept
+ * overwriting it (dst is then undefined).
+ */
+static inline int m3_sds_read(M3ShmSdsHeader * h, const M3ShmSdsLayout * l, int dir, void * dst, uint32_t size, uint32_t * seq)
+{
+    uint32_t s1, s2;
+    int i;
+    if (size > l->size[dir])
+        size = l->size[dir];
+    for (i = 0; i < M3_SHM_SDS_READ_RETRIES; i++)
+    {
+        s1 = __atomic_load_n(&h->seq[dir], __ATOMIC_ACQUIRE);
+        memcpy(dst, m3_sds_buffer(h, l, dir, s1 >> 1), size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&h->seq[dir], __ATOMIC_RELAXED);
+        if (s2 - (s1 & ~1u) < 3u)
+        {
+            if (seq)
+                *seq = s1 & ~1u;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Sleep until dir is published past seq (as returned by m3_sds_read/m3_sds_seq) or timeout_ns. */
+static inline void m3_sds_wait(M3ShmSdsHeader * h, int dir, uint32_t seq, long long timeout_ns)
+{
+    struct timespec ts;
+    uint32_t s;
+    ts.tv_sec = timeout_ns / 1000000000LL;
+    ts.tv_nsec = timeout_ns % 1000000000LL;
+    __atomic_add_fetch(&h->waiters[dir], 1, __ATOMIC_SEQ_CST);
+    s = __atomic_load_n(&h->seq[dir], __ATOMIC_SEQ_CST);
+    if ((s & ~1u) == seq)
+        syscall(SYS_futex, &h->seq[dir], FUTEX_WAIT, s, &ts, NULL, 0);
+    __atomic_sub_fetch(&h->waiters[dir], 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void m3_sds_beat(M3ShmSdsHeader * h, int side)
+{
+    __atomic_add_fetch(&h->heartbeat[side], 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t m3_sds_heartbeat(M3ShmSdsHeader * h, int side)
+{
+    return __atomic_load_n(&h->heartbeat[side], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Client side: map the area of a running M3CompShm and fill in l. The sizes are checked
+ * against what the client was built for, 0 takes the size published by the server.
+ * Returns NULL if the component is not up (errno set) or the layout does not match
+ * (errno=EPROTO).
+ */
+static inline M3ShmSdsHeader * m3_sds_attach(const char * shm_id, uint32_t status_size, uint32_t cmd_size,
+                                             M3ShmSdsLayout * l)
+{
+    char name[64];
+    struct stat st;
+    M3ShmSdsHeader * h;
+    int fd;
+    strcpy(name, M3_SHM_SDS_PREFIX);
+    strncat(name, shm_id, sizeof(name) - sizeof(M3_SHM_SDS_PREFIX));
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(M3ShmSdsHeader))
+    {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    h = (M3ShmSdsHeader *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        return NULL;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != M3_SHM_SDS_MAGIC || h->version != M3_SHM_SDS_VERSION
+            || h->total_size != (uint32_t)st.st_size
+            || (status_size && h->size[M3_SDS_STATUS] != status_size)
+            || (cmd_size && h->size[M3_SDS_COMMAND] != cmd_size))
+    {
+        munmap(h, st.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+    m3_sds_layout(l, h->size[M3_SDS_STATUS], h->size[M3_SDS_COMMAND]);
+    if (l->total_size != (uint32_t)st.st_size)
+    {
+        munmap(h, st.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+    return h;
+}
+
+static inline void m3_sds_detach(M3ShmSdsHeader * h, const M3ShmSdsLayout * l)
+{
+    if (h)
+        munmap(h, l->total_size);
+}
+
+#endif
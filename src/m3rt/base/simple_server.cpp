@@ -101,7 +101,7 @@ int M3SimpleServer:: WriteStringToPort ( string & s ) {
 // return -2 if no cmd data
 
 typedef float sizes_type;
-int M3SimpleServer::ReadStringFromPort ( string & s, int & size ) {
+int M3SimpleServer::ReadStringFromPort ( string & s, int & size, int timeout_us ) {
     //In theory can be more than one client writing to port. This shouldn't happen tho.
     int nr;
     sizes_type header;
@@ -109,9 +109,8 @@ int M3SimpleServer::ReadStringFromPort ( string & s, int & size ) {
         HandleNewConnection();
         return 0;
         }
-    tv.tv_sec=1; //0.5 second timeout
-    //tv.tv_usec=500000;
-    tv.tv_usec=0;
+    tv.tv_sec=timeout_us/1000000; //1 second timeout by default
+    tv.tv_usec=timeout_us%1000000;
     read_fds = master; // copy it
     int nfd=select ( fdmax+1, &read_fds, NULL, NULL, &tv );
     if ( nfd== -1 ) { //error
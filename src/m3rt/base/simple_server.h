@@ -64,9 +64,10 @@ public:
      *
      * @param s
      * @param size
+     * @param timeout_us How long to wait for a packet (0 polls the socket)
      * @return int
      */
-    int  ReadStringFromPort(std::string & s, int & size);//Non-blocking
+    int  ReadStringFromPort(std::string & s, int & size, int timeout_us=1000000);//Non-blocking
 protected:
     /**
      * @brief
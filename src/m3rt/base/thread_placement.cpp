@@ -0,0 +1,366 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "m3rt/base/thread_placement.h"
+#include "m3rt/base/toolbox.h"
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+namespace m3rt
+{
+using namespace std;
+
+#define M3_MAX_PLACED_THREADS 64
+
+static const char * thread_class_names[M3_NUM_THREAD_CLASSES] = {"rt_system", "data_service", "log_service", "service", "async", "log_writer"};
+
+struct M3ThreadPlacement
+{
+    bool has_cpus;
+    cpu_set_t cpus;
+    int policy; /**< -1: unchanged */
+    int priority;
+};
+
+struct M3PlacedThread
+{
+    char name[16];
+    int cls;
+    pid_t tid;
+    bool rtai_task;
+};
+
+static M3ThreadPlacement placement[M3_NUM_THREAD_CLASSES];
+static M3PlacedThread placed[M3_MAX_PLACED_THREADS];
+static int num_placed = 0;
+static bool placement_init = false;
+static pthread_mutex_t placement_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void placement_reset()
+{
+    for(int i = 0; i < M3_NUM_THREAD_CLASSES; i++) {
+        placement[i].has_cpus = false;
+        CPU_ZERO(&placement[i].cpus);
+        placement[i].policy = -1;
+        placement[i].priority = 0;
+    }
+    placement_init = true;
+}
+
+// "0-2,5" -> {0,1,2,5}
+static bool parse_cpu_list(const string & s, cpu_set_t & set)
+{
+    CPU_ZERO(&set);
+    const char * p = s.c_str();
+    while(*p) {
+        char * end;
+        long a = strtol(p, &end, 10);
+        if(end == p || a < 0 || a >= CPU_SETSIZE)
+            return false;
+        long b = a;
+        p = end;
+        if(*p == '-') {
+            b = strtol(p + 1, &end, 10);
+            if(end == p + 1 || b < a || b >= CPU_SETSIZE)
+                return false;
+            p = end;
+        }
+        for(long c = a; c <= b; c++)
+            CPU_SET(c, &set);
+        while(*p == ',' || *p == ' ' || *p == '\n')
+            p++;
+    }
+    return true;
+}
+
+static string format_cpu_list(const cpu_set_t & set)
+{
+    string s;
+    char buf[32];
+    for(int c = 0; c < CPU_SETSIZE; c++) {
+        if(!CPU_ISSET(c, &set))
+            continue;
+        int e = c;
+        while(e + 1 < CPU_SETSIZE && CPU_ISSET(e + 1, &set))
+            e++;
+        if(e == c)
+            snprintf(buf, sizeof(buf), "%s%d", s.empty() ? "" : ",", c);
+        else
+            snprintf(buf, sizeof(buf), "%s%d-%d", s.empty() ? "" : ",", c, e);
+        s += buf;
+        c = e;
+    }
+    return s.empty() ? "-" : s;
+}
+
+// /sys/devices/system/cpu/{isolated,nohz_full,online}
+static void read_sys_cpu_list(const char * name, cpu_set_t & set)
+{
+    CPU_ZERO(&set);
+    string path = string("/sys/devices/system/cpu/") + name;
+    FILE * f = fopen(path.c_str(), "r");
+    if(f == NULL)
+        return;
+    char buf[256];
+    if(fgets(buf, sizeof(buf), f) != NULL) {
+        string s(buf);
+        while(!s.empty() && (s[s.size() - 1] == '\n' || s[s.size() - 1] == ' '))
+            s.erase(s.size() - 1);
+        if(s != "(null)")
+            parse_cpu_list(s, set);
+    }
+    fclose(f);
+}
+
+static bool cpu_subset(const cpu_set_t & a, const cpu_set_t & b)
+{
+    cpu_set_t and_set;
+    CPU_AND(&and_set, &a, &b);
+    return CPU_EQUAL(&and_set, &a);
+}
+
+static bool cpu_overlap(const cpu_set_t & a, const cpu_set_t & b)
+{
+    cpu_set_t and_set;
+    CPU_AND(&and_set, &a, &b);
+    return CPU_COUNT(&and_set) > 0;
+}
+
+static int parse_policy(const string & s)
+{
+    if(s == "fifo") return SCHED_FIFO;
+    if(s == "rr") return SCHED_RR;
+    if(s == "other") return SCHED_OTHER;
+    if(s == "batch") return SCHED_BATCH;
+    if(s == "idle") return SCHED_IDLE;
+    return -1;
+}
+
+static const char * policy_name(int policy)
+{
+    switch(policy) {
+    case SCHED_FIFO: return "fifo";
+    case SCHED_RR: return "rr";
+    case SCHED_OTHER: return "other";
+    case SCHED_BATCH: return "batch";
+    case SCHED_IDLE: return "idle";
+    }
+    return "?";
+}
+
+static void apply_placement(const M3PlacedThread & t)
+{
+    const M3ThreadPlacement & p = placement[t.cls];
+    if(p.has_cpus && sched_setaffinity(t.tid, sizeof(cpu_set_t), &p.cpus) != 0)
+        M3_WARN("Unable to set the CPUs of thread %s (%s)\n", t.name, strerror(errno));
+    if(!t.rtai_task && p.policy >= 0) {
+        struct sched_param sp;
+        sp.sched_priority = p.priority;
+        if(sched_setscheduler(t.tid, p.policy, &sp) != 0)
+            M3_WARN("Unable to set %s scheduling of thread %s (%s)\n", policy_name(p.policy), t.name, strerror(errno));
+    }
+}
+
+bool ReadThreadPlacement()
+{
+    bool ret = true;
+    pthread_mutex_lock(&placement_mutex);
+    placement_reset();
+#ifndef YAMLCPP_03
+    vector<YAML::Node> docs;
+    GetAllYamlDocs(M3_CONFIG_FILENAME, docs);
+    cpu_set_t online;
+    read_sys_cpu_list("online", online);
+    //Last robot path wins, like for the other options
+    for(size_t d = 0; d < docs.size(); d++) {
+        if(!docs[d].IsMap() || !docs[d]["threads"])
+            continue;
+        const YAML::Node threads = docs[d]["threads"];
+        for(YAML::const_iterator it = threads.begin(); it != threads.end(); ++it) {
+            const string cls_name = it->first.as<string>();
+            int cls = 0;
+            while(cls < M3_NUM_THREAD_CLASSES && cls_name != thread_class_names[cls])
+                cls++;
+            if(cls == M3_NUM_THREAD_CLASSES) {
+                M3_ERR("Unknown thread class %s in threads section of %s\n", cls_name.c_str(), M3_CONFIG_FILENAME);
+                ret = false;
+                continue;
+            }
+            M3ThreadPlacement & p = placement[cls];
+            const YAML::Node entry = it->second;
+            if(entry["cpus"]) {
+                string list;
+                if(entry["cpus"].IsSequence()) {
+                    for(size_t i = 0; i < entry["cpus"].size(); i++)
+                        list += (i ? "," : "") + entry["cpus"][i].as<string>();
+                } else {
+                    list = entry["cpus"].as<string>();
+                }
+                cpu_set_t set;
+                if(!parse_cpu_list(list, set) || CPU_COUNT(&set) == 0) {
+                    M3_ERR("Invalid cpus %s for thread class %s\n", list.c_str(), cls_name.c_str());
+                    ret = false;
+                } else if(CPU_COUNT(&online) > 0 && !cpu_subset(set, online)) {
+                    M3_ERR("cpus %s for thread class %s are not all online (online: %s)\n", list.c_str(), cls_name.c_str(), format_cpu_list(online).c_str());
+                    ret = false;
+                } else {
+                    p.has_cpus = true;
+                    p.cpus = set;
+                }
+            }
+            if(entry["policy"]) {
+                const string policy = entry["policy"].as<string>();
+                p.policy = parse_policy(policy);
+                if(p.policy < 0) {
+                    M3_ERR("Unknown policy %s for thread class %s (fifo, rr, other, batch, idle)\n", policy.c_str(), cls_name.c_str());
+                    ret = false;
+                }
+            }
+            if(p.policy >= 0) {
+                const int pmin = sched_get_priority_min(p.policy), pmax = sched_get_priority_max(p.policy);
+                p.priority = entry["priority"] ? entry["priority"].as<int>(pmin) : pmin;
+                if(p.priority < pmin || p.priority > pmax) {
+                    M3_WARN("Priority %d of thread class %s out of [%d,%d] for %s, clamped\n", p.priority, cls_name.c_str(), pmin, pmax, policy_name(p.policy));
+                    p.priority = CLAMP(p.priority, pmin, pmax);
+                }
+            }
+        }
+    }
+    //The rt loop should own an isolated, tickless CPU
+    cpu_set_t isolated, nohz;
+    read_sys_cpu_list("isolated", isolated);
+    read_sys_cpu_list("nohz_full", nohz);
+    const M3ThreadPlacement & rt = placement[M3_THREAD_RT_SYSTEM];
+    if(!rt.has_cpus) {
+        if(CPU_COUNT(&isolated) > 0)
+            M3_INFO("CPUs %s are isolated but rt_system is not pinned (threads section of %s)\n", format_cpu_list(isolated).c_str(), M3_CONFIG_FILENAME);
+    } else {
+        if(CPU_COUNT(&isolated) == 0)
+            M3_WARN("rt_system is pinned to CPUs %s but no CPU is isolated (isolcpus), other tasks can still run there\n", format_cpu_list(rt.cpus).c_str());
+        else if(!cpu_subset(rt.cpus, isolated))
+            M3_WARN("rt_system CPUs %s are not all isolated (isolcpus: %s)\n", format_cpu_list(rt.cpus).c_str(), format_cpu_list(isolated).c_str());
+        if(CPU_COUNT(&nohz) > 0 && !cpu_subset(rt.cpus, nohz))
+            M3_INFO("rt_system CPUs %s are not all nohz_full (%s)\n", format_cpu_list(rt.cpus).c_str(), format_cpu_list(nohz).c_str());
+        for(int cls = 0; cls < M3_NUM_THREAD_CLASSES; cls++)
+            if(cls != M3_THREAD_RT_SYSTEM && placement[cls].has_cpus && cpu_overlap(placement[cls].cpus, rt.cpus))
+                M3_WARN("Thread class %s shares CPUs with rt_system (%s)\n", thread_class_names[cls], format_cpu_list(placement[cls].cpus).c_str());
+    }
+#endif
+    for(int i = 0; i < num_placed; i++)
+        apply_placement(placed[i]);
+    pthread_mutex_unlock(&placement_mutex);
+    return ret;
+}
+
+void ApplyThreadPlacement(M3ThreadClass cls, const char * name, bool rtai_task)
+{
+    pthread_mutex_lock(&placement_mutex);
+    if(!placement_init)
+        placement_reset();
+    const pid_t tid = syscall(SYS_gettid);
+    int i = 0;
+    while(i < num_placed && placed[i].tid != tid)
+        i++;
+    if(i == num_placed) {
+        //Reuse the slot of a thread that exited
+        for(i = 0; i < num_placed; i++) {
+            cpu_set_t set;
+            if(sched_getaffinity(placed[i].tid, sizeof(set), &set) != 0)
+                break;
+        }
+        if(i == M3_MAX_PLACED_THREADS) {
+            pthread_mutex_unlock(&placement_mutex);
+            return;
+        }
+        if(i == num_placed)
+            num_placed++;
+    }
+    M3PlacedThread & t = placed[i];
+    strncpy(t.name, name, sizeof(t.name) - 1);
+    t.name[sizeof(t.name) - 1] = '\0';
+    t.cls = cls;
+    t.tid = tid;
+    t.rtai_task = rtai_task;
+    apply_placement(t);
+    pthread_mutex_unlock(&placement_mutex);
+}
+
+unsigned long GetThreadCpuMask(M3ThreadClass cls, unsigned long default_mask)
+{
+    if(!placement_init || !placement[cls].has_cpus)
+        return default_mask;
+    unsigned long mask = 0;
+    for(int c = 0; c < (int)(8 * sizeof(mask)); c++)
+        if(CPU_ISSET(c, &placement[cls].cpus))
+            mask |= 1UL << c;
+    return mask ? mask : default_mask;
+}
+
+int GetThreadPolicy(M3ThreadClass cls, int default_policy)
+{
+    if(!placement_init || placement[cls].policy < 0)
+        return default_policy;
+    return placement[cls].policy;
+}
+
+void PrintThreadPlacement()
+{
+    cpu_set_t isolated, nohz, rt_cpus;
+    read_sys_cpu_list("isolated", isolated);
+    read_sys_cpu_list("nohz_full", nohz);
+    CPU_ZERO(&rt_cpus);
+    pthread_mutex_lock(&placement_mutex);
+    for(int i = 0; i < num_placed; i++) {
+        cpu_set_t set;
+        if(placed[i].cls == M3_THREAD_RT_SYSTEM && sched_getaffinity(placed[i].tid, sizeof(set), &set) == 0)
+            CPU_OR(&rt_cpus, &rt_cpus, &set);
+    }
+    BannerPrint(80, "Thread placement");
+    M3_PRINTF("%-16s %-13s %7s %-12s %-6s %4s\n", "thread", "class", "tid", "cpus", "policy", "prio");
+    for(int i = 0; i < num_placed; i++) {
+        const M3PlacedThread & t = placed[i];
+        cpu_set_t set;
+        if(sched_getaffinity(t.tid, sizeof(set), &set) != 0)
+            continue; //Exited
+        const int policy = sched_getscheduler(t.tid);
+        struct sched_param sp;
+        sp.sched_priority = 0;
+        sched_getparam(t.tid, &sp);
+        string flags;
+        if(CPU_COUNT(&isolated) > 0 && cpu_subset(set, isolated))
+            flags += " isolated";
+        if(CPU_COUNT(&nohz) > 0 && cpu_subset(set, nohz))
+            flags += " nohz_full";
+        if(t.cls != M3_THREAD_RT_SYSTEM && cpu_overlap(set, rt_cpus))
+            flags += " shares rt_system CPU";
+        M3_PRINTF("%-16s %-13s %7d %-12s %-6s %4d%s\n", t.name, thread_class_names[t.cls], (int)t.tid, format_cpu_list(set).c_str(),
+                  policy < 0 ? "?" : policy_name(policy & ~SCHED_RESET_ON_FORK), sp.sched_priority, flags.c_str());
+    }
+    pthread_mutex_unlock(&placement_mutex);
+    BannerPrint(80, "");
+}
+
+}
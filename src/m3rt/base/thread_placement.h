@@ -0,0 +1,83 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef M3RT_THREAD_PLACEMENT_H
+#define M3RT_THREAD_PLACEMENT_H
+
+/*
+ * CPU set, scheduling policy and priority per thread class, from the threads section of m3_config.yml:
+ *
+ * threads:
+ *   rt_system:    {cpus: [3], policy: fifo, priority: 90}
+ *   data_service: {cpus: "1-2", policy: fifo, priority: 60}
+ *   log_writer:   {cpus: [0], policy: other}
+ *
+ * Classes without an entry keep the defaults (inherited affinity, RTAI masks). Policies: fifo, rr,
+ * other, batch, idle. RTAI tasks get the CPU set and policy through rt_task_init_schmod(), their
+ * priority stays the RTAI one.
+ */
+
+namespace m3rt
+{
+enum M3ThreadClass {M3_THREAD_RT_SYSTEM=0, M3_THREAD_DATA_SERVICE, M3_THREAD_LOG_SERVICE, M3_THREAD_SERVICE,
+                    M3_THREAD_ASYNC, M3_THREAD_LOG_WRITER, M3_NUM_THREAD_CLASSES};
+
+/**
+ * @brief Read and check the threads section of m3_config.yml (CPUs online, isolcpus/nohz_full, priorities)
+ * and apply it to the threads already registered.
+ *
+ * @return bool False if an entry was rejected
+ */
+bool ReadThreadPlacement();
+/**
+ * @brief Register the calling thread under cls for the placement report and apply the configured
+ * CPU set, policy and priority to it.
+ *
+ * @param cls
+ * @param name Up to 15 chars are kept
+ * @param rtai_task Placed by rt_task_init_schmod(), only the CPU set is applied
+ */
+void ApplyThreadPlacement(M3ThreadClass cls, const char * name, bool rtai_task=false);
+/**
+ * @brief CPU mask for rt_task_init_schmod().
+ *
+ * @param cls
+ * @param default_mask Returned if cls has no CPU set
+ * @return unsigned long
+ */
+unsigned long GetThreadCpuMask(M3ThreadClass cls, unsigned long default_mask);
+/**
+ * @brief Policy for rt_task_init_schmod().
+ *
+ * @param cls
+ * @param default_policy Returned if cls has no policy
+ * @return int
+ */
+int GetThreadPolicy(M3ThreadClass cls, int default_policy);
+/**
+ * @brief Actual CPU set, policy and priority of every registered thread that is still running,
+ * with the isolated / nohz_full state of its CPUs.
+ *
+ */
+void PrintThreadPlacement();
+
+}
+
+#endif
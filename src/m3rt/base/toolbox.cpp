@@ -18,6 +18,7 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "m3rt/base/toolbox.h"
+#include "m3rt/base/thread_placement.h"
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
@@ -31,95 +32,343 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include <ctime>
 #include <sstream>
 #include <map>
+#include <pthread.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <alloca.h>
+#include <errno.h>
+#include <sys/mman.h>
 namespace m3rt
 {
 using namespace std;
 
-void M3_WARN(const char *format, ...)
+////////////////////////////////////////////////////////////////////////////////
+// Logging: the rt thread must never wait on a terminal or a file. Once M3LogStartup()
+// has been called, messages are formatted into a ring owned by the calling thread
+// and written out by log_writer_thread. Rings are static, claiming one does not allocate.
+
+enum {M3LOG_INFO=0,M3LOG_WARN,M3LOG_ERR,M3LOG_DEBUG};
+static const char * log_prefix[]={"M3 INFO: ","M3 WARNING: ","M3 ERROR: ","M3 DEBUG: "};
+
+struct M3LogRecord
 {
-    //FILE * pFile = NULL;
-    string path;
+    int level;
+    int suppressed; // messages from the same call site dropped before this one
+    char text[M3LOG_MSG_SIZE];
+};
+
+struct M3LogRing
+{
+    volatile int in_use;
+    volatile unsigned int head; // written by the owner thread only
+    volatile unsigned int tail; // written by the writer thread only
+    volatile int dropped;
+    M3LogRecord rec[M3LOG_RING_SIZE];
+};
+
+struct M3LogSite
+{
+    const char * volatile key; // format string of the call site
+    volatile int level;
+    volatile unsigned int last_hash;
+    volatile long long last_ns; // last message let through
+    volatile long long window_ns;
+    volatile int window_cnt;
+    volatile int suppressed;
+    char text[64]; // start of the last message, for the suppression report
+};
+
+static M3LogRing log_rings[M3LOG_MAX_THREADS];
+static M3LogSite log_sites[M3LOG_MAX_SITES];
+static volatile bool log_thread_active=false;
+static volatile bool log_thread_end=false;
+static pthread_t log_thread;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_key_once=PTHREAD_ONCE_INIT;
+static FILE * log_file=NULL;
+
+static long long log_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+static void log_release_ring(void * r)
+{
+    ((M3LogRing *)r)->in_use=0; // the writer still drains what is left
+}
+
+static void log_make_key()
+{
+    pthread_key_create(&log_ring_key,log_release_ring);
+}
+
+static M3LogRing * log_get_ring()
+{
+    pthread_once(&log_key_once,log_make_key);
+    M3LogRing * r=(M3LogRing *)pthread_getspecific(log_ring_key);
+    if(r)
+        return r;
+    for(int i = 0; i < M3LOG_MAX_THREADS; i++) {
+        if(__sync_bool_compare_and_swap(&log_rings[i].in_use,0,1)) {
+            pthread_setspecific(log_ring_key,&log_rings[i]);
+            return &log_rings[i];
+        }
+    }
+    return NULL;
+}
+
+static M3LogSite * log_get_site(const char * format)
+{
+    unsigned int h=(unsigned int)(((size_t)format)>>3)%M3LOG_MAX_SITES;
+    for(int i = 0; i < M3LOG_MAX_SITES; i++) {
+        M3LogSite * s=&log_sites[(h+i)%M3LOG_MAX_SITES];
+        if(s->key==format)
+            return s;
+        if(s->key==NULL && __sync_bool_compare_and_swap(&s->key,(const char *)NULL,format))
+            return s;
+        if(s->key==format)
+            return s;
+    }
+    return NULL;
+}
+
+static unsigned int log_hash(const char * s)
+{
+    unsigned int h=2166136261u; //FNV-1a
+    for(; *s; s++)
+        h=(h^(unsigned char)*s)*16777619u;
+    return h;
+}
+
+static void log_write(int level, const char * text)
+{
+    fputs(log_prefix[level],stdout);
+    fputs(text,stdout);
+    if(log_file) {
+        fputs(log_prefix[level],log_file);
+        fputs(text,log_file);
+    }
+}
+
+static void log_drain()
+{
+    for(int i = 0; i < M3LOG_MAX_THREADS; i++) {
+        M3LogRing * r=&log_rings[i];
+        while(r->tail!=r->head) {
+            __sync_synchronize();
+            M3LogRecord * m=&r->rec[r->tail%M3LOG_RING_SIZE];
+            if(m->suppressed>0) {
+                char buf[64];
+                snprintf(buf,64,"(%d similar messages suppressed)\n",m->suppressed);
+                log_write(m->level,buf);
+            }
+            log_write(m->level,m->text);
+            __sync_synchronize();
+            r->tail++;
+        }
+        int d=r->dropped;
+        if(d>0) {
+            __sync_fetch_and_sub(&r->dropped,d);
+            char buf[64];
+            snprintf(buf,64,"%d messages dropped, log ring full\n",d);
+            log_write(M3LOG_WARN,buf);
+        }
+    }
+}
+
+// Report call sites that went quiet with messages still held back
+static void log_report_suppressed(long long now)
+{
+    for(int i = 0; i < M3LOG_MAX_SITES; i++) {
+        M3LogSite * s=&log_sites[i];
+        if(s->key==NULL || s->suppressed==0 || now-s->last_ns<1000000000LL)
+            continue;
+        int n=__sync_lock_test_and_set(&s->suppressed,0);
+        if(n==0)
+            continue;
+        char buf[M3LOG_MSG_SIZE];
+        char text[64];
+        memcpy(text,s->text,64);
+        text[63]=0;
+        char * nl=strchr(text,'\n');
+        if(nl)
+            *nl=0;
+        snprintf(buf,M3LOG_MSG_SIZE,"(%d similar messages suppressed: %s)\n",n,text);
+        log_write(s->level,buf);
+    }
+}
+
+static void * log_writer_thread(void * arg)
+{
+    ApplyThreadPlacement(M3_THREAD_LOG_WRITER, "log_writer");
+    long long last_report=log_time_ns();
+    while(!log_thread_end) {
+        usleep(M3LOG_DRAIN_PERIOD_US);
+        log_drain();
+        long long now=log_time_ns();
+        if(now-last_report>1000000000LL) {
+            log_report_suppressed(now);
+            last_report=now;
+        }
+        fflush(stdout);
+        if(log_file)
+            fflush(log_file);
+    }
+    log_drain();
+    log_report_suppressed(log_time_ns()+2000000000LL);
+    fflush(stdout);
+    return 0;
+}
+
+static void log_message(int level, const char * format, va_list args)
+{
+    char buffer[M3LOG_MSG_SIZE];
+    vsnprintf(buffer, M3LOG_MSG_SIZE, format, args);
+    M3LogRing * r=log_thread_active ? log_get_ring() : NULL;
+    if(r==NULL) { //Writer not running (or too many threads), print right away
+        printf("%s%s", log_prefix[level], buffer);
+        return;
+    }
+    M3LogSite * s=log_get_site(format);
+    int suppressed=0;
+    if(s) {
+        long long now=log_time_ns();
+        unsigned int h=log_hash(buffer);
+        //Same text again within a second: fold it
+        bool repeat = (h==s->last_hash && now-s->last_ns<1000000000LL);
+        if(now-s->window_ns>1000000000LL) {
+            s->window_ns=now;
+            s->window_cnt=0;
+        }
+        if(repeat || ++s->window_cnt>M3LOG_MAX_PER_SEC) {
+            s->level=level;
+            __sync_fetch_and_add(&s->suppressed,1);
+            return;
+        }
+        s->last_hash=h;
+        s->last_ns=now;
+        s->level=level;
+        size_t n=strnlen(buffer,sizeof(s->text)-1); //Truncated, always terminated
+        memcpy(s->text,buffer,n);
+        s->text[n]=0;
+        suppressed=__sync_lock_test_and_set(&s->suppressed,0);
+    }
+    if(r->head-r->tail>=M3LOG_RING_SIZE) {
+        __sync_fetch_and_add(&r->dropped,1+suppressed);
+        return;
+    }
+    M3LogRecord * m=&r->rec[r->head%M3LOG_RING_SIZE];
+    m->level=level;
+    m->suppressed=suppressed;
+    memcpy(m->text,buffer,M3LOG_MSG_SIZE);
+    __sync_synchronize();
+    r->head++;
+}
+
+bool M3LogStartup()
+{
+    if(log_thread_active)
+        return true;
+    vector<string> vpath;
+    if(GetEnvironmentVariable(M3_ROBOT_ENV_VAR, vpath) && vpath.size()) {
+        string path=vpath[0]+LOG_FILE;
+        log_file=fopen(path.c_str(),"a");
+    }
+    log_thread_end=false;
+    if(pthread_create(&log_thread, NULL, log_writer_thread, NULL) != 0) {
+        M3_ERR("Unable to start the log writer thread, logging synchronously\n");
+        if(log_file)
+            fclose(log_file);
+        log_file=NULL;
+        return false;
+    }
+    log_thread_active=true;
+    return true;
+}
+
+void M3LogShutdown()
+{
+    if(!log_thread_active)
+        return;
+    log_thread_active=false; //New messages are printed directly
+    log_thread_end=true;
+    pthread_join(log_thread, NULL);
+    if(log_file)
+        fclose(log_file);
+    log_file=NULL;
+}
 
-    /*	if (GetEnvironmentVar(M3_ROBOT_ENV_VAR, path))
-        {
-            path.append(LOG_FILE);
-            pFile = fopen (path.c_str(),"a");
-        }	*/
+void M3ReadySignal::Post(int s)
+{
+    pthread_mutex_lock(&mutex);
+    state=s;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
 
-    char buffer[256];
+static void timespec_add_ns(struct timespec& t, long long ns)
+{
+    t.tv_sec += ns / 1000000000LL;
+    t.tv_nsec += ns % 1000000000LL;
+    if(t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+}
+
+int M3ReadySignal::Wait(long long timeout_ns)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    timespec_add_ns(deadline, timeout_ns);
+    pthread_mutex_lock(&mutex);
+    int s;
+    while((s = state) == PENDING) {
+        //Wake up every M3_READY_POLL_NS to catch PostNoWake()
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        if(t.tv_sec > deadline.tv_sec || (t.tv_sec == deadline.tv_sec && t.tv_nsec >= deadline.tv_nsec))
+            break;
+        timespec_add_ns(t, M3_READY_POLL_NS);
+        if(t.tv_sec > deadline.tv_sec || (t.tv_sec == deadline.tv_sec && t.tv_nsec > deadline.tv_nsec))
+            t = deadline;
+        pthread_cond_timedwait(&cond, &mutex, &t);
+    }
+    pthread_mutex_unlock(&mutex);
+    return s;
+}
+
+void M3_WARN(const char *format, ...)
+{
     va_list args;
     va_start(args, format);
-    vsprintf(buffer, format, args);
-    printf("M3 WARNING: ");
-    printf("%s", buffer);
-    /*	 if (pFile)
-         {
-            fprintf(pFile,"M3 WARNING: ");
-            fprintf(pFile,"%s", buffer);
-            fclose (pFile);
-         }*/
+    log_message(M3LOG_WARN, format, args);
     va_end(args);
 }
 
 void M3_ERR(const char *format, ...)
 {
-    FILE *pFile = NULL;
-    string path;
-
-    /*if (GetEnvironmentVariable(M3_ROBOT_ENV_VAR, path))
-    {
-        path.append(LOG_FILE);
-        pFile = fopen (path.c_str(),"a");
-    }*/
-
-    char buffer[256];
     va_list args;
     va_start(args, format);
-    vsprintf(buffer, format, args);
-    printf("M3 ERROR: ");
-    printf("%s", buffer);
-    if(pFile) {
-        fprintf(pFile, "M3 ERROR: ");
-        fprintf(pFile, "%s", buffer);
-        fclose(pFile);
-    }
+    log_message(M3LOG_ERR, format, args);
     va_end(args);
 }
 
 void M3_DEBUG(const char *format, ...)
 {
-    char buffer[256];
     va_list args;
     va_start(args, format);
-    vsprintf(buffer, format, args);
-    printf("M3 DEBUG: ");
-    printf("%s", buffer);
+    log_message(M3LOG_DEBUG, format, args);
     va_end(args);
 }
 
 void M3_INFO(const char *format, ...)
 {
-    //FILE * pFile = NULL;
-    string path;
-
-    /*	if (GetEnvironmentVar(M3_ROBOT_ENV_VAR, path))
-        {
-            path.append(LOG_FILE);
-            pFile = fopen (path.c_str(),"a");
-        }	*/
-
-    char buffer[256];
     va_list args;
     va_start(args, format);
-    vsprintf(buffer, format, args);
-    printf("M3 INFO: ");
-    printf("%s", buffer);
-    /*	 if (pFile)
-         {
-            fprintf(pFile,"M3 INFO: ");
-            fprintf(pFile,"%s", buffer);
-            fclose (pFile);
-         }*/
+    log_message(M3LOG_INFO, format, args);
     va_end(args);
 }
 
@@ -344,7 +593,7 @@ bool GetYamlStream(const char *filename, YAML::Emitter &out)
                 M3_WARN("%s does not exists, no file or directory.\n",(*it).c_str());
                 continue;
             }
-            YAML::Node node = YAML::LoadFile((*it).c_str());
+            YAML::Node node = LoadYamlFileCached(*it);
             if(!node.IsNull())
                 out << node;
         }catch(...){}
@@ -368,7 +617,7 @@ bool GetAllYamlDocs(const char* filename, std::vector<YAML::Node>& docs )
     if(!GetFileConfigPath(filename,vpath)) return false;
     for(std::vector<std::string>::iterator it = vpath.begin(); it != vpath.end(); ++it) {
         try{
-            const YAML::Node& node = YAML::LoadFile(*it);
+            const YAML::Node& node = LoadYamlFileCached(*it);
             //cout<<endl<<endl<<YAML::Dump(node)<<endl<<endl;
             //cout<<"Adding "<<*it<<endl;
             docs.push_back(node);
@@ -385,7 +634,7 @@ bool GetAllYamlDocs(std::vector<std::string> vpath, std::vector<YAML::Node>& doc
     //GetFileConfigPath(filename,vpath);
     for(std::vector<std::string>::iterator it = vpath.begin(); it != vpath.end(); ++it) {
         try{
-            const YAML::Node& node = YAML::LoadFile(*it);
+            const YAML::Node& node = LoadYamlFileCached(*it);
             //cout<<endl<<endl<<YAML::Dump(node)<<endl<<endl;
             //cout<<"Adding "<<*it<<endl;
             docs.push_back(node);
@@ -397,6 +646,180 @@ bool GetAllYamlDocs(std::vector<std::string> vpath, std::vector<YAML::Node>& doc
 }
 #endif
 
+#ifndef YAMLCPP_03
+////////////////////////////////////////////////////////////////////////////////
+// Config cache: m3_config.yml is read by the factory and four times by M3RtSystem,
+// component files are probed on every robot path. Parse each file only once.
+
+//Files probed but missing are kept too (exists=false): the config snapshot depends on them
+static map<string, M3YamlSource> yaml_cache;
+static pthread_mutex_t yaml_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+bool GetFileHash(const std::string& path, unsigned long long& hash, std::string * content)
+{
+    ifstream fin(path.c_str(), ios::in | ios::binary);
+    if(!fin)
+        return false;
+    string s((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+    hash = 14695981039346656037ULL; //FNV-1a
+    for(size_t i = 0; i < s.size(); i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 1099511628211ULL;
+    }
+    if(content)
+        content->swap(s);
+    return true;
+}
+
+YAML::Node LoadYamlFileCached(const std::string& path)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        M3YamlSource e;
+        e.path = path;
+        pthread_mutex_lock(&yaml_cache_mutex);
+        yaml_cache[path] = e;
+        pthread_mutex_unlock(&yaml_cache_mutex);
+        return YAML::LoadFile(path); //Let yaml-cpp throw BadFile as usual
+    }
+    pthread_mutex_lock(&yaml_cache_mutex);
+    map<string, M3YamlSource>::iterator it = yaml_cache.find(path);
+    if(it != yaml_cache.end() && it->second.exists && it->second.size == st.st_size
+            && it->second.mtime_sec == st.st_mtim.tv_sec && it->second.mtime_nsec == st.st_mtim.tv_nsec) {
+        YAML::Node node = YAML::Clone(it->second.node); //Callers may modify their tree
+        pthread_mutex_unlock(&yaml_cache_mutex);
+        return node;
+    }
+    pthread_mutex_unlock(&yaml_cache_mutex);
+    //Parse outside the lock so prefetch threads run in parallel
+    M3YamlSource e;
+    string content;
+    if(!GetFileHash(path, e.hash, &content))
+        return YAML::LoadFile(path);
+    e.path = path;
+    YAML::Node node = YAML::Load(content);
+    e.node = YAML::Clone(node);
+    e.exists = true;
+    e.mtime_sec = st.st_mtim.tv_sec;
+    e.mtime_nsec = st.st_mtim.tv_nsec;
+    e.size = st.st_size;
+    pthread_mutex_lock(&yaml_cache_mutex);
+    yaml_cache[path] = e;
+    pthread_mutex_unlock(&yaml_cache_mutex);
+    return node;
+}
+
+void GetYamlCacheSources(std::vector<M3YamlSource>& sources)
+{
+    sources.clear();
+    pthread_mutex_lock(&yaml_cache_mutex);
+    for(map<string, M3YamlSource>::iterator it = yaml_cache.begin(); it != yaml_cache.end(); ++it)
+        sources.push_back(it->second);
+    pthread_mutex_unlock(&yaml_cache_mutex);
+}
+
+void SeedYamlCache(const std::vector<M3YamlSource>& sources)
+{
+    pthread_mutex_lock(&yaml_cache_mutex);
+    for(size_t i = 0; i < sources.size(); i++)
+        yaml_cache[sources[i].path] = sources[i];
+    pthread_mutex_unlock(&yaml_cache_mutex);
+}
+
+static void yaml_prefetch_job(int idx, void *arg)
+{
+    try {
+        LoadYamlFileCached((*(const vector<string> *)arg)[idx]);
+    } catch(...) {}
+}
+
+void PrefetchYamlFiles(const std::vector<std::string>& paths)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    RunParallel(paths.size(), (int)std::min((long)M3_YAML_PREFETCH_THREADS, std::max(1L, ncpu)),
+                yaml_prefetch_job, (void *)&paths);
+}
+
+void ClearYamlCache()
+{
+    pthread_mutex_lock(&yaml_cache_mutex);
+    yaml_cache.clear();
+    pthread_mutex_unlock(&yaml_cache_mutex);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct M3ParallelJob
+{
+    int n;
+    int next;
+    void (*job)(int, void *);
+    void *arg;
+    pthread_mutex_t mutex;
+};
+
+static void *parallel_job_thread(void *arg)
+{
+    M3ParallelJob *p = (M3ParallelJob *)arg;
+    while(true) {
+        pthread_mutex_lock(&p->mutex);
+        int i = p->next++;
+        pthread_mutex_unlock(&p->mutex);
+        if(i >= p->n)
+            break;
+        p->job(i, p->arg);
+    }
+    return 0;
+}
+
+void RunParallel(int n, int max_threads, void (*job)(int idx, void *arg), void *arg)
+{
+    M3ParallelJob p;
+    p.n = n;
+    p.next = 0;
+    p.job = job;
+    p.arg = arg;
+    pthread_mutex_init(&p.mutex, NULL);
+    int nthreads = std::min(max_threads, n) - 1; //The calling thread takes part
+    vector<pthread_t> threads(std::max(nthreads, 0));
+    int started = 0;
+    for(int i = 0; i < nthreads; i++)
+        if(pthread_create(&threads[started], NULL, parallel_job_thread, &p) == 0)
+            started++;
+    parallel_job_thread(&p);
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&p.mutex);
+}
+
+// Not inlined: the frame must sit below the caller's for the pages to be the ones used later
+static void __attribute__((noinline)) prefault_stack(size_t bytes)
+{
+    char * volatile buf = (char *)alloca(bytes);
+    memset(buf, 0, bytes);
+}
+
+bool LockAndPrefaultMemory(size_t stack_bytes, size_t heap_bytes)
+{
+    bool ret = true;
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        M3_WARN("mlockall failed (%s), the rt loop can page fault\n", strerror(errno));
+        ret = false;
+    }
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    prefault_stack(stack_bytes);
+    const long page = sysconf(_SC_PAGESIZE);
+    char * heap = (char *)malloc(heap_bytes);
+    if(heap == NULL)
+        return false;
+    for(size_t i = 0; i < heap_bytes; i += page)
+        heap[i] = 0;
+    free(heap);
+    return ret;
+}
+
 std::string GetYamlDoc(const char* filename, YAML::Node& doc, void * )
 {
     if(!filename) return std::string();
@@ -425,10 +848,7 @@ std::string GetYamlDoc(const char* filename, YAML::Node& doc, void * )
         root_path = it->second;
 #ifndef YAMLCPP_03
         try{
-            if(m3rt::file_exists(path))
-                doc = YAML::LoadFile(path);
-            else
-                continue;
+            doc = LoadYamlFileCached(path); //Throws BadFile if missing (and records the miss for the config snapshot)
         }catch(YAML::Exception){
             continue;
         }
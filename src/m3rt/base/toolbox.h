@@ -30,6 +30,10 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/stat.h>
 #include <ctime>
 #include <time.h>
+#include <pthread.h>
+#ifdef __cplusplus11__
+#include <atomic>
+#endif
 namespace m3rt
 {
 
@@ -58,6 +62,73 @@ void M3_INFO(const char * format, ...);
  * @param format...
  */
 void M3_DEBUG(const char * format, ...);
+/**
+ * @brief Start the writer thread: from then on the M3_* functions only format into a per-thread
+ * ring and never block on terminal or file I/O. Messages also go to $M3_ROBOT/LOG_FILE.
+ * Each call site (format string) is limited to M3LOG_MAX_PER_SEC messages, identical
+ * repeats within a second are folded into a count.
+ * Before this is called (and after M3LogShutdown) messages are printed synchronously.
+ *
+ * @return bool
+ */
+bool M3LogStartup();
+/**
+ * @brief Flush pending messages and stop the writer thread.
+ *
+ */
+void M3LogShutdown();
+
+/**
+ * @brief State posted by a thread when it is up, has failed or has exited, so the other
+ * side blocks on it instead of sleeping a fixed amount of time.
+ *
+ */
+class M3ReadySignal
+{
+public:
+    enum {PENDING=0, READY=1, FAILED=-1};
+    M3ReadySignal():state(PENDING){pthread_mutex_init(&mutex,NULL);pthread_cond_init(&cond,NULL);}
+    ~M3ReadySignal(){pthread_cond_destroy(&cond);pthread_mutex_destroy(&mutex);}
+    /**
+     * @brief Back to PENDING, call before starting the thread.
+     *
+     */
+    void Reset(){state=PENDING;}
+    /**
+     * @brief
+     *
+     * @param s READY or FAILED
+     */
+    void Post(int s);
+    /**
+     * @brief Store only, no syscall: usable from a hard real-time task.
+     * Wait() notices it within M3_READY_POLL_NS.
+     *
+     * @param s READY or FAILED
+     */
+    void PostNoWake(int s){state=s;}
+    /**
+     * @brief
+     *
+     * @param timeout_ns
+     * @return int The posted state, PENDING on timeout
+     */
+    int Wait(long long timeout_ns);
+    /**
+     * @brief
+     *
+     * @return int
+     */
+    int Get(){return state;}
+private:
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#ifdef __cplusplus11__
+    std::atomic<int> state;
+#else
+    volatile int state;
+#endif
+};
 
 /**
  * @brief
@@ -239,6 +310,83 @@ bool GetAllYamlDocs(const char* filename, std::vector< YAML::Node >& docs );
  * @return bool
  */
 bool GetAllYamlDocs(std::vector< std::string > vpath, std::vector< YAML::Node >& docs );
+/**
+ * @brief Run job(0) ... job(n-1) on up to max_threads threads (the caller included), return when all are done.
+ *
+ * @param n
+ * @param max_threads
+ * @param job
+ * @param arg Passed to every job
+ */
+void RunParallel(int n, int max_threads, void (*job)(int idx, void * arg), void * arg);
+/**
+ * @brief Lock the process memory and fault in stack_bytes of the calling thread's stack and
+ * heap_bytes of its malloc arena. Trimming and mmap'ed chunks are disabled so that freed memory
+ * stays mapped: later allocations of up to heap_bytes don't page fault.
+ *
+ * @param stack_bytes
+ * @param heap_bytes
+ * @return bool False if the memory could not be locked (prefaulted anyway)
+ */
+bool LockAndPrefaultMemory(size_t stack_bytes, size_t heap_bytes);
+/**
+ * @brief FNV-1a hash of a file's content.
+ *
+ * @param path
+ * @param hash
+ * @param content If not NULL, receives the content
+ * @return bool False if the file can't be read
+ */
+bool GetFileHash(const std::string& path, unsigned long long& hash, std::string * content=NULL);
+#ifndef YAMLCPP_03
+/**
+ * @brief A file seen by the yaml cache, missing files included (exists=false).
+ *
+ */
+struct M3YamlSource
+{
+    M3YamlSource():exists(false),mtime_sec(0),mtime_nsec(0),size(0),hash(0){}
+    std::string path;
+    bool exists;
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long size;
+    unsigned long long hash;
+    YAML::Node node;
+};
+/**
+ * @brief Same as YAML::LoadFile, but each file is parsed once (again if the file's mtime or
+ * size changed). Every caller gets its own copy of the cached tree and may modify it.
+ *
+ * @param path Full path to the file
+ * @return YAML::Node
+ */
+YAML::Node LoadYamlFileCached(const std::string& path);
+/**
+ * @brief Parse files into the cache in parallel (at most M3_YAML_PREFETCH_THREADS threads).
+ * Errors are ignored here, they show up when the file is actually loaded.
+ *
+ * @param paths Full paths
+ */
+void PrefetchYamlFiles(const std::vector< std::string >& paths);
+/**
+ * @brief
+ *
+ */
+void ClearYamlCache();
+/**
+ * @brief Copy of every file loaded or probed through the cache so far.
+ *
+ * @param sources
+ */
+void GetYamlCacheSources(std::vector<M3YamlSource>& sources);
+/**
+ * @brief Insert already parsed files (from a config snapshot). Entries are still revalidated by mtime/size.
+ *
+ * @param sources
+ */
+void SeedYamlCache(const std::vector<M3YamlSource>& sources);
+#endif
 
 }
 
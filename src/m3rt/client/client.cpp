@@ -0,0 +1,467 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "m3rt/client/client.h"
+#include "m3rt/base/toolbox.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+typedef float sizes_type; //Same as M3SimpleServer
+#define DATA_PACKET_HEADER 9999 //The hardcoded header number
+
+//////////////////////////////////////////////////////////////////////////////////////
+void * client_io_thread(void * arg)
+{
+    M3RtClient * c = (M3RtClient *)arg;
+    c->io_thread_active=true;
+    while(!c->io_thread_end)
+    {
+        int res=c->WaitReadable(100000);
+        if (res==0)
+            continue;
+        if (res<0 || !c->ReadPacket(c->rx_buf,c->timeout_us))
+        {
+            c->io_thread_error=true;
+            pthread_mutex_lock(&c->rx_mutex);
+            pthread_cond_broadcast(&c->rx_cond);
+            pthread_mutex_unlock(&c->rx_mutex);
+            break;
+        }
+        pthread_mutex_lock(&c->rx_mutex);
+        c->rx_latest.swap(c->rx_buf);
+        c->rx_seq++;
+        pthread_cond_broadcast(&c->rx_cond);
+        pthread_mutex_unlock(&c->rx_mutex);
+    }
+    c->io_thread_active=false;
+    return 0;
+}
+//////////////////////////////////////////////////////////////////////////////////////
+
+M3RtClient::~M3RtClient()
+{
+    Disconnect();
+    pthread_cond_destroy(&rx_cond);
+    pthread_mutex_destroy(&rx_mutex);
+}
+
+bool M3RtClient::Connect(const string host, int port)
+{
+    if (IsConnected())
+        Disconnect();
+    struct addrinfo hints, *res, *p;
+    stringstream ss;
+    ss << port;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), ss.str().c_str(), &hints, &res) != 0)
+    {
+        m3rt::M3_ERR("M3RtClient: unable to resolve %s\n",host.c_str());
+        return false;
+    }
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (socket_fd == -1)
+            continue;
+        if (connect(socket_fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    freeaddrinfo(res);
+    if (socket_fd == -1)
+    {
+        m3rt::M3_ERR("M3RtClient: unable to connect to %s port %d\n",host.c_str(),port);
+        return false;
+    }
+    //Small packets every step, don't let Nagle hold them back
+    int yes=1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    tx_seq=rx_seq=rx_consumed=0;
+    io_thread_error=false;
+    map_valid=false;
+    return true;
+}
+
+void M3RtClient::Disconnect()
+{
+    StopIOThread();
+    if (socket_fd != -1)
+        close(socket_fd);
+    socket_fd=-1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+int M3RtClient::SubscribeStatus(const string name)
+{
+    for (size_t i=0; i<status_names.size(); i++)
+        if (status_names[i]==name)
+            return i;
+    status_names.push_back(name);
+    status_data.push_back(string());
+    status_updated.push_back(0);
+    map_valid=false;
+    //Subscriptions made before the next Send() share one request
+    M3ControlRequest * req=NULL;
+    if (command.control_size() && command.control(command.control_size()-1).op()==M3CONTROL_SUBSCRIBE)
+        req=command.mutable_control(command.control_size()-1);
+    else
+    {
+        req=command.add_control();
+        req->set_seq(control_seq++);
+        req->set_op(M3CONTROL_SUBSCRIBE);
+    }
+    req->add_name(name);
+    return status_names.size()-1;
+}
+
+int M3RtClient::PublishCommand(const string name)
+{
+    for (int i=0; i<command.name_cmd_size(); i++)
+        if (command.name_cmd(i)==name)
+            return i;
+    command.add_name_cmd(name);
+    command.add_datum_cmd();
+    return command.name_cmd_size()-1;
+}
+
+int M3RtClient::PublishParam(const string name)
+{
+    for (int i=0; i<command.name_param_size(); i++)
+        if (command.name_param(i)==name)
+            return i;
+    command.add_name_param(name);
+    command.add_datum_param();
+    return command.name_param_size()-1;
+}
+
+void M3RtClient::SetCommand(int idx, const string & datum)
+{
+    if (idx>=0 && idx<command.datum_cmd_size())
+        command.mutable_datum_cmd(idx)->assign(datum);
+}
+
+void M3RtClient::SetParam(int idx, const string & datum)
+{
+    if (idx>=0 && idx<command.datum_param_size())
+        command.mutable_datum_param(idx)->assign(datum);
+}
+
+const string & M3RtClient::GetStatus(int idx)
+{
+    static const string empty;
+    if (idx<0 || (size_t)idx>=status_data.size())
+        return empty;
+    return status_data[idx];
+}
+
+bool M3RtClient::IsStatusUpdated(int idx)
+{
+    if (idx<0 || (size_t)idx>=status_updated.size())
+        return false;
+    return status_updated[idx]!=0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+bool M3RtClient::Send()
+{
+    if (!IsConnected())
+        return false;
+#if GOOGLE_PROTOBUF_VERSION >= 3004000
+    size_t size=command.ByteSizeLong();
+#else
+    size_t size=command.ByteSize();
+#endif
+    size_t hs=2*sizeof(sizes_type);
+    sizes_type header[2];
+    header[0]=static_cast<sizes_type>(DATA_PACKET_HEADER);
+    header[1]=static_cast<sizes_type>(size);
+    //resize() keeps the capacity, no allocation once the largest packet has been sent
+    tx_buf.resize(hs+size);
+    memcpy(&tx_buf[0],header,hs);
+    command.SerializeWithCachedSizesToArray((google::protobuf::uint8 *)&tx_buf[hs]);
+    if (!WriteAll(tx_buf.data(),tx_buf.size()))
+        return false;
+    command.clear_control();
+    if (!streaming)
+        tx_seq++;
+    return true;
+}
+
+bool M3RtClient::Receive()
+{
+    if (!IsConnected())
+        return false;
+    std::fill(status_updated.begin(),status_updated.end(),0);
+    bool got=false;
+    if (io_thread_active)
+    {
+        pthread_mutex_lock(&rx_mutex);
+        long long target = streaming ? rx_consumed+1 : tx_seq-(pipelined?1:0);
+        if (target>rx_consumed)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME,&ts);
+            ts.tv_sec+=timeout_us/1000000;
+            ts.tv_nsec+=(timeout_us%1000000)*1000;
+            ts.tv_sec+=ts.tv_nsec/1000000000;
+            ts.tv_nsec%=1000000000;
+            while (rx_seq<target && !io_thread_error)
+                if (pthread_cond_timedwait(&rx_cond,&rx_mutex,&ts)==ETIMEDOUT)
+                    break;
+        }
+        bool ok = !io_thread_error && rx_seq>=target;
+        got = rx_seq>rx_consumed;
+        if (got)
+        {
+            rx_latest.swap(rx_parse);
+            rx_consumed=rx_seq;
+        }
+        pthread_mutex_unlock(&rx_mutex);
+        if (got)
+            DispatchStatus(rx_parse);
+        if (!ok)
+            m3rt::M3_ERR("M3RtClient: no status received from the data service\n");
+        return ok;
+    }
+    if (streaming)
+    {
+        //Block for one packet, then skip to the most recent one already pushed
+        if (!ReadPacket(rx_parse,timeout_us))
+            return false;
+        int res;
+        while ((res=WaitReadable(0))>0)
+            if (!ReadPacket(rx_parse,timeout_us))
+                return false;
+        if (res<0)
+            return false;
+        got=true;
+    }
+    else
+    {
+        long long target = tx_seq-(pipelined?1:0);
+        while (rx_seq<target)
+        {
+            if (!ReadPacket(rx_parse,timeout_us))
+                return false;
+            rx_seq++;
+            got=true;
+        }
+        rx_consumed=rx_seq;
+    }
+    if (got)
+        DispatchStatus(rx_parse);
+    return true;
+}
+
+bool M3RtClient::Step()
+{
+    if (!streaming || command.name_cmd_size() || command.name_param_size() || command.control_size())
+        if (!Send())
+            return false;
+    return Receive();
+}
+
+void M3RtClient::SetStreaming(bool on)
+{
+    if (on==streaming)
+        return;
+    if (!on)
+        Drain();
+    streaming=on;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+bool M3RtClient::StartIOThread()
+{
+    if (io_thread_active || !IsConnected())
+        return io_thread_active;
+    io_thread_end=false;
+    io_thread_error=false;
+    rx_seq=rx_consumed;
+    if (pthread_create(&hio, NULL, &client_io_thread, (void*)this) != 0)
+    {
+        m3rt::M3_ERR("M3RtClient: unable to start the I/O thread\n");
+        return false;
+    }
+    while (!io_thread_active && !io_thread_error)
+        usleep(1000);
+    return true;
+}
+
+void M3RtClient::StopIOThread()
+{
+    if (!io_thread_active)
+        return;
+    io_thread_end=true;
+    pthread_join(hio, NULL);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+//Return 1 if readable, 0 on timeout, -1 on error
+int M3RtClient::WaitReadable(int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd=socket_fd;
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    int res=poll(&pfd,1,timeout/1000);
+    if (res<0)
+        return errno==EINTR ? 0 : -1;
+    if (res==0)
+        return 0;
+    return 1;
+}
+
+bool M3RtClient::ReadAll(char * buf, int size, int timeout)
+{
+    int total=0;
+    while (total<size)
+    {
+        int res=WaitReadable(timeout);
+        if (res<=0)
+        {
+            m3rt::M3_ERR("M3RtClient: %s while reading from the data service\n",res==0?"timeout":"error");
+            return false;
+        }
+        int n=recv(socket_fd,buf+total,size-total,0);
+        if (n<=0)
+        {
+            if (n<0 && errno==EINTR)
+                continue;
+            m3rt::M3_ERR("M3RtClient: data service connection broken\n");
+            return false;
+        }
+        total+=n;
+    }
+    return true;
+}
+
+bool M3RtClient::WriteAll(const char * buf, int size)
+{
+    int total=0;
+    while (total<size)
+    {
+        int n=send(socket_fd,buf+total,size-total,MSG_NOSIGNAL);
+        if (n<0)
+        {
+            if (errno==EINTR)
+                continue;
+            m3rt::M3_ERR("M3RtClient: error writing to the data service\n");
+            return false;
+        }
+        total+=n;
+    }
+    return true;
+}
+
+bool M3RtClient::ReadPacket(string & s, int timeout)
+{
+    int size;
+    if (!ReadAll((char *)&size,sizeof(int),timeout))
+        return false;
+    if (size<0)
+    {
+        m3rt::M3_ERR("M3RtClient: packet size out of bounds, may be corrupted data: %d\n",size);
+        return false;
+    }
+    s.resize(size);
+    if (size==0)
+        return true;
+    return ReadAll(&s[0],size,timeout);
+}
+
+void M3RtClient::Drain()
+{
+    if (io_thread_active)
+    {
+        long long seq;
+        do{
+            pthread_mutex_lock(&rx_mutex);
+            seq=rx_seq;
+            pthread_mutex_unlock(&rx_mutex);
+            usleep(50000);
+            pthread_mutex_lock(&rx_mutex);
+            rx_consumed=rx_seq;
+            pthread_mutex_unlock(&rx_mutex);
+        }while (seq!=rx_consumed);
+        tx_seq=rx_consumed;
+        return;
+    }
+    //Drop whatever was pushed in the meantime
+    while (WaitReadable(50000)>0)
+        if (!ReadPacket(rx_parse,timeout_us))
+            break;
+    tx_seq=rx_seq=rx_consumed;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+void M3RtClient::BuildStatusMap()
+{
+    status_map.resize(status.name_size());
+    for (int j=0; j<status.name_size(); j++)
+    {
+        status_map[j]=-1;
+        for (size_t k=0; k<status_names.size(); k++)
+            if (status_names[k]==status.name(j))
+            {
+                status_map[j]=k;
+                break;
+            }
+    }
+    map_valid=true;
+}
+
+void M3RtClient::DispatchStatus(const string & s)
+{
+    if (!status.ParseFromString(s))
+    {
+        m3rt::M3_WARN("M3RtClient: unable to parse status packet (%d bytes)\n",(int)s.size());
+        return;
+    }
+    for (int i=0; i<status.control_size(); i++)
+        if (!status.control(i).ok())
+            m3rt::M3_WARN("M3RtClient: control request %d failed on the data service\n",status.control(i).seq());
+    //The server keeps its subscription order, only remap when the set changes
+    if (!map_valid || status_map.size()!=(size_t)status.name_size())
+        BuildStatusMap();
+    for (int j=0; j<status.name_size(); j++)
+    {
+        int k=status_map[j];
+        if (k<0 || status.datum(j).size()==0) //Allow 0 len on serialize errors
+            continue;
+        //Swap rather than copy, the old buffer is reused by the next parse
+        status_data[k].swap(*status.mutable_datum(j));
+        status_updated[k]=1;
+    }
+}
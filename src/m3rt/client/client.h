@@ -0,0 +1,224 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M3RT_CLIENT_H
+#define M3RT_CLIENT_H
+
+#include "m3rt/base/m3rt_def.h"
+#include "m3rt/base/component_base.pb.h"
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#ifdef __cplusplus11__
+#include <atomic>
+#endif
+
+//No m3rt namespace for swig-ability
+
+/**
+ * @brief Client side of the M3RtDataService protocol (same wire format as M3RtProxy).
+ * Components are registered once and then addressed by the slot index returned at
+ * registration, so a step does no name lookup and no allocation once the buffers have grown.
+ *
+ */
+class M3RtClient
+{
+public:
+    M3RtClient():socket_fd(-1),timeout_us(RT_DATA_CLIENT_TIMEOUT_US),streaming(false),pipelined(false),
+            map_valid(false),control_seq(0),tx_seq(0),rx_seq(0),rx_consumed(0),io_thread_active(false),io_thread_end(false),io_thread_error(false){
+            status_names.reserve(50);
+            status_data.reserve(50);
+            status_updated.reserve(50);
+            pthread_mutex_init(&rx_mutex,NULL);
+            pthread_cond_init(&rx_cond,NULL);
+        }
+    /**
+     * @brief
+     *
+     */
+    ~M3RtClient();
+    /**
+     * @brief Connect to a data service previously attached with M3RtService::AttachDataService.
+     *
+     * @param host
+     * @param port
+     * @return bool
+     */
+    bool Connect(const std::string host, int port);
+    /**
+     * @brief
+     *
+     */
+    void Disconnect();
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool IsConnected(){return socket_fd!=-1;}
+    /**
+     * @brief The server side subscription goes out as a control request with the next Send().
+     *
+     * @param name
+     * @return int Slot index to use with GetStatus/IsStatusUpdated
+     */
+    int SubscribeStatus(const std::string name);
+    /**
+     * @brief
+     *
+     * @param name
+     * @return int Slot index to use with SetCommand
+     */
+    int PublishCommand(const std::string name);
+    /**
+     * @brief
+     *
+     * @param name
+     * @return int Slot index to use with SetParam
+     */
+    int PublishParam(const std::string name);
+    /**
+     * @brief Serialized command message for the component registered at idx.
+     *
+     * @param idx
+     * @param datum
+     */
+    void SetCommand(int idx, const std::string & datum);
+    /**
+     * @brief Serialized param message for the component registered at idx.
+     *
+     * @param idx
+     * @param datum
+     */
+    void SetParam(int idx, const std::string & datum);
+    /**
+     * @brief Serialized status of the component registered at idx, as of the last Receive().
+     *
+     * @param idx
+     * @return const std::string &
+     */
+    const std::string & GetStatus(int idx);
+    /**
+     * @brief True if the last Receive() brought a new status for idx.
+     *
+     * @param idx
+     * @return bool
+     */
+    bool IsStatusUpdated(int idx);
+    /**
+     * @brief Send the current commands and params in a single packet.
+     *
+     * @return bool
+     */
+    bool Send();
+    /**
+     * @brief Wait for the status matching the last Send() (or the freshest one when streaming)
+     * and dispatch it to the subscribed slots.
+     *
+     * @return bool
+     */
+    bool Receive();
+    /**
+     * @brief Send() then Receive(). When streaming, commands are only sent if something is published
+     * or a control request is pending.
+     *
+     * @return bool
+     */
+    bool Step();
+    /**
+     * @brief Keep one command packet in flight: the status returned by Step() is the reply to
+     * the previous step, the network round trip is hidden behind the client's own loop.
+     *
+     * @param on
+     */
+    void SetPipelined(bool on){pipelined=on;}
+    /**
+     * @brief Must follow M3RtService::ClientStartStreaming/ClientStopStreaming on the same port.
+     * Turning it off drops the status packets pushed in the meantime.
+     *
+     * @param on
+     */
+    void SetStreaming(bool on);
+    /**
+     * @brief
+     *
+     * @param us Max wait for a status packet
+     */
+    void SetTimeout(int us){timeout_us=us>0?us:RT_DATA_CLIENT_TIMEOUT_US;}
+    /**
+     * @brief Read the socket from a background thread, Receive() then only picks up the latest packet.
+     *
+     * @return bool
+     */
+    bool StartIOThread();
+    /**
+     * @brief
+     *
+     */
+    void StopIOThread();
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool IsIOThreadActive(){return io_thread_active;}
+protected:
+    friend void * client_io_thread(void * arg);
+    bool ReadPacket(std::string & s, int timeout);
+    bool ReadAll(char * buf, int size, int timeout);
+    bool WriteAll(const char * buf, int size);
+    int WaitReadable(int timeout);
+    void Drain();
+    void DispatchStatus(const std::string & s);
+    void BuildStatusMap();
+    int socket_fd;
+    int timeout_us;
+    bool streaming;
+    bool pipelined;
+    bool map_valid;
+    int control_seq;
+    M3CommandAll command;
+    M3StatusAll status;
+    std::string tx_buf;
+    std::string rx_buf; /**< Packet being read by the I/O thread */
+    std::string rx_latest; /**< Last complete packet, swapped under rx_mutex */
+    std::string rx_parse; /**< Packet being dispatched by Receive() */
+    std::vector<std::string> status_names;
+    std::vector<std::string> status_data;
+    std::vector<char> status_updated;
+    std::vector<int> status_map; /**< Position in M3StatusAll -> slot index, -1 if not subscribed */
+    long long tx_seq; /**< Command packets sent that expect a reply (lockstep only) */
+    long long rx_seq;
+    long long rx_consumed;
+    pthread_t hio;
+    pthread_mutex_t rx_mutex;
+    pthread_cond_t rx_cond;
+#ifdef __cplusplus11__
+    std::atomic<bool> io_thread_active;
+    std::atomic<bool> io_thread_end;
+    std::atomic<bool> io_thread_error;
+#else
+    bool io_thread_active;
+    bool io_thread_end;
+    bool io_thread_error;
+#endif
+};
+
+#endif
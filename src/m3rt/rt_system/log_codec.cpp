@@ -0,0 +1,350 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "m3rt/rt_system/log_codec.h"
+#include "m3rt/base/toolbox.h"
+#include "m3rt/base/thread_placement.h"
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#ifdef M3_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef M3_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace m3rt
+{
+using namespace std;
+
+//Frame magic numbers, little endian on disk
+static const unsigned char lz4_magic[4] = {0x04, 0x22, 0x4d, 0x18};
+static const unsigned char zstd_magic[4] = {0x28, 0xb5, 0x2f, 0xfd};
+
+bool ParseLogCodec(const string & name, int * codec)
+{
+    *codec = M3_LOG_CODEC_NONE;
+    if(name == "none" || name.empty())
+        return true;
+    if(name == "lz4") {
+#ifdef M3_HAVE_LZ4
+        *codec = M3_LOG_CODEC_LZ4;
+        return true;
+#else
+        M3_WARN("Log compression lz4 is not built in, logs are not compressed\n");
+        return false;
+#endif
+    }
+    if(name == "zstd") {
+#ifdef M3_HAVE_ZSTD
+        *codec = M3_LOG_CODEC_ZSTD;
+        return true;
+#else
+        M3_WARN("Log compression zstd is not built in, logs are not compressed\n");
+        return false;
+#endif
+    }
+    M3_WARN("Unknown log compression %s, logs are not compressed\n", name.c_str());
+    return false;
+}
+
+const char * GetLogCodecExtension(int codec)
+{
+    if(codec == M3_LOG_CODEC_LZ4)
+        return ".lz4";
+    if(codec == M3_LOG_CODEC_ZSTD)
+        return ".zst";
+    return "";
+}
+
+static void * CreateCompressCtx(int codec)
+{
+#ifdef M3_HAVE_ZSTD
+    if(codec == M3_LOG_CODEC_ZSTD)
+        return ZSTD_createCCtx();
+#endif
+    return NULL;
+}
+
+static void FreeCompressCtx(int codec, void * ctx)
+{
+#ifdef M3_HAVE_ZSTD
+    if(codec == M3_LOG_CODEC_ZSTD && ctx)
+        ZSTD_freeCCtx((ZSTD_CCtx *)ctx);
+#endif
+}
+
+static bool Compress(int codec, int level, void * ctx, const string & in, string & out)
+{
+#ifdef M3_HAVE_LZ4
+    if(codec == M3_LOG_CODEC_LZ4) {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level;
+        prefs.frameInfo.contentSize = in.size(); //Lets readers size their buffer
+        out.resize(LZ4F_compressFrameBound(in.size(), &prefs));
+        size_t n = LZ4F_compressFrame(&out[0], out.size(), in.data(), in.size(), &prefs);
+        if(LZ4F_isError(n)) {
+            M3_ERR("lz4 compression failed: %s\n", LZ4F_getErrorName(n));
+            return false;
+        }
+        out.resize(n);
+        return true;
+    }
+#endif
+#ifdef M3_HAVE_ZSTD
+    if(codec == M3_LOG_CODEC_ZSTD) {
+        out.resize(ZSTD_compressBound(in.size()));
+        size_t n = ZSTD_compressCCtx((ZSTD_CCtx *)ctx, &out[0], out.size(), in.data(), in.size(), level ? level : 3);
+        if(ZSTD_isError(n)) {
+            M3_ERR("zstd compression failed: %s\n", ZSTD_getErrorName(n));
+            return false;
+        }
+        out.resize(n);
+        return true;
+    }
+#endif
+    out = in;
+    return true;
+}
+
+bool DecompressLogData(const string & in, string & out)
+{
+    if(in.size() >= 4 && memcmp(in.data(), lz4_magic, 4) == 0) {
+#ifdef M3_HAVE_LZ4
+        LZ4F_dctx * dctx;
+        if(LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+            return false;
+        out.clear();
+        char buf[65536];
+        const char * src = in.data();
+        size_t left = in.size();
+        size_t hint = 1;
+        while(left > 0 && hint != 0) {
+            size_t dst_size = sizeof(buf);
+            size_t src_size = left;
+            hint = LZ4F_decompress(dctx, buf, &dst_size, src, &src_size, NULL);
+            if(LZ4F_isError(hint)) {
+                LZ4F_freeDecompressionContext(dctx);
+                M3_ERR("lz4 decompression failed: %s\n", LZ4F_getErrorName(hint));
+                return false;
+            }
+            out.append(buf, dst_size);
+            src += src_size;
+            left -= src_size;
+        }
+        LZ4F_freeDecompressionContext(dctx);
+        return hint == 0;
+#else
+        M3_ERR("Log data is lz4 compressed, lz4 is not built in\n");
+        return false;
+#endif
+    }
+    if(in.size() >= 4 && memcmp(in.data(), zstd_magic, 4) == 0) {
+#ifdef M3_HAVE_ZSTD
+        unsigned long long n = ZSTD_getFrameContentSize(in.data(), in.size());
+        if(n == ZSTD_CONTENTSIZE_ERROR || n == ZSTD_CONTENTSIZE_UNKNOWN)
+            return false;
+        out.resize(n);
+        size_t r = ZSTD_decompress(&out[0], out.size(), in.data(), in.size());
+        if(ZSTD_isError(r)) {
+            M3_ERR("zstd decompression failed: %s\n", ZSTD_getErrorName(r));
+            return false;
+        }
+        out.resize(r);
+        return true;
+#else
+        M3_ERR("Log data is zstd compressed, zstd is not built in\n");
+        return false;
+#endif
+    }
+    out = in;
+    return true;
+}
+
+bool ReadLogPage(const string & filename, M3StatusLogPage * page)
+{
+    ifstream f(filename.c_str(), ios::in | ios::binary);
+    if(!f)
+        return false;
+    ostringstream ss;
+    ss << f.rdbuf();
+    string data;
+    if(!DecompressLogData(ss.str(), data))
+        return false;
+    return page->ParseFromString(data);
+}
+
+////////////////////////////////////////////////////////////
+
+void * log_compress_thread(void * arg)
+{
+    M3LogPageWriter * w = (M3LogPageWriter *)arg;
+    ApplyThreadPlacement(M3_THREAD_LOG_WRITER, "log_compress");
+    void * ctx = CreateCompressCtx(w->config.codec);
+    string buf;
+    pthread_mutex_lock(&w->mutex);
+    while(true) {
+        while(w->running && w->queue.empty())
+            pthread_cond_wait(&w->cond_job, &w->mutex);
+        if(w->queue.empty())
+            break;
+        M3LogPageWriter::Job * job = w->queue.front();
+        w->queue.pop_front();
+        pthread_mutex_unlock(&w->mutex);
+        bool ok = w->WriteJob(*job, ctx, buf);
+        pthread_mutex_lock(&w->mutex);
+        if(!ok)
+            w->failed = true;
+        w->free_jobs.push_back(job);
+        pthread_cond_signal(&w->cond_space);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    FreeCompressCtx(w->config.codec, ctx);
+    return NULL;
+}
+
+M3LogPageWriter::~M3LogPageWriter()
+{
+    Shutdown();
+    for(size_t i = 0; i < free_jobs.size(); i++)
+        delete free_jobs[i];
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond_job);
+    pthread_cond_destroy(&cond_space);
+}
+
+bool M3LogPageWriter::Startup(const M3LogCompression & c)
+{
+    config = c;
+    failed = false;
+    bytes_in = bytes_out = 0;
+    running = true;
+    if(config.codec == M3_LOG_CODEC_NONE)
+        config.threads = 0; //Nothing worth a thread
+    for(int i = 0; i < config.threads; i++) {
+        pthread_t t;
+        if(pthread_create(&t, NULL, log_compress_thread, this) != 0) {
+            M3_WARN("Unable to start a log compression thread, %d running\n", i);
+            break;
+        }
+        workers.push_back(t);
+    }
+    if(workers.empty())
+        inline_ctx = CreateCompressCtx(config.codec);
+    while(free_jobs.size() < 2 * workers.size()) //Kept across restarts
+        free_jobs.push_back(new Job);
+    return true;
+}
+
+bool M3LogPageWriter::WriteJob(Job & job, void * ctx, string & buf)
+{
+    const string * out = &job.data;
+    if(config.codec != M3_LOG_CODEC_NONE) {
+        if(!Compress(config.codec, config.level, ctx, job.data, buf))
+            return false;
+        out = &buf;
+    }
+    string filename = job.filename + GetLogCodecExtension(config.codec);
+    fstream output(filename.c_str(), ios::out | ios::trunc | ios::binary);
+    output.write(out->data(), out->size());
+    output.close();
+    if(!output) {
+        M3_ERR("Failed to write logfile %s.", filename.c_str());
+        return false;
+    }
+    pthread_mutex_lock(&mutex);
+    bytes_in += job.data.size();
+    bytes_out += out->size();
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+bool M3LogPageWriter::Write(const string & filename, string & data)
+{
+    if(workers.empty()) {
+        Job job;
+        job.filename = filename;
+        job.data.swap(data);
+        bool ok = WriteJob(job, inline_ctx, inline_buf);
+        data.swap(job.data);
+        if(!ok)
+            failed = true;
+        return ok;
+    }
+    pthread_mutex_lock(&mutex);
+    while(free_jobs.empty() && !failed)
+        pthread_cond_wait(&cond_space, &mutex);
+    if(failed) {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+    Job * job = free_jobs.back();
+    free_jobs.pop_back();
+    job->filename = filename;
+    job->data.swap(data); //The caller gets the buffer of an already written page back
+    queue.push_back(job);
+    pthread_cond_signal(&cond_job);
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+bool M3LogPageWriter::Flush()
+{
+    pthread_mutex_lock(&mutex);
+    //Every job is back in free_jobs once written
+    while(free_jobs.size() < 2 * workers.size())
+        pthread_cond_wait(&cond_space, &mutex);
+    bool ok = !failed;
+    pthread_mutex_unlock(&mutex);
+    return ok;
+}
+
+bool M3LogPageWriter::Shutdown()
+{
+    pthread_mutex_lock(&mutex);
+    running = false;
+    pthread_cond_broadcast(&cond_job);
+    pthread_mutex_unlock(&mutex);
+    for(size_t i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], NULL);
+    workers.clear();
+    FreeCompressCtx(config.codec, inline_ctx);
+    inline_ctx = NULL;
+    return !failed;
+}
+
+long long M3LogPageWriter::GetBytesIn()
+{
+    pthread_mutex_lock(&mutex);
+    long long n = bytes_in;
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+long long M3LogPageWriter::GetBytesOut()
+{
+    pthread_mutex_lock(&mutex);
+    long long n = bytes_out;
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+}
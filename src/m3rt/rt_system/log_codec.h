@@ -0,0 +1,163 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M3RT_LOG_CODEC_H
+#define M3RT_LOG_CODEC_H
+
+#include "m3rt/base/component_base.pb.h"
+#include <pthread.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+namespace m3rt
+{
+
+enum M3LogCodec
+{
+    M3_LOG_CODEC_NONE = 0,
+    M3_LOG_CODEC_LZ4,  /**< LZ4 frame format, .pb.log.lz4 (M3_HAVE_LZ4) */
+    M3_LOG_CODEC_ZSTD  /**< zstd frame format, .pb.log.zst (M3_HAVE_ZSTD) */
+};
+
+/**
+ * @brief log_compression section of m3_config.yml
+ *
+ */
+struct M3LogCompression
+{
+    M3LogCompression():codec(M3_LOG_CODEC_NONE),level(0),threads(0){}
+    int codec;
+    int level; /**< 0: codec default */
+    int threads; /**< Pages compressed in parallel, 0: on the log writer thread */
+};
+
+/**
+ * @brief
+ *
+ * @param name none, lz4 or zstd
+ * @param codec
+ * @return bool False if unknown or not built in (codec is then M3_LOG_CODEC_NONE)
+ */
+bool ParseLogCodec(const std::string & name, int * codec);
+/**
+ * @brief
+ *
+ * @param codec
+ * @return const char * Appended to .pb.log
+ */
+const char * GetLogCodecExtension(int codec);
+/**
+ * @brief Decompress a log file content, whatever the codec (found from the frame magic).
+ * Uncompressed data is copied as is.
+ *
+ * @param in
+ * @param out
+ * @return bool False if compressed with a codec not built in, or corrupted
+ */
+bool DecompressLogData(const std::string & in, std::string & out);
+/**
+ * @brief Read and parse a .pb.log[.lz4|.zst] file.
+ *
+ * @param filename
+ * @param page
+ * @return bool
+ */
+bool ReadLogPage(const std::string & filename, M3StatusLogPage * page);
+
+/**
+ * @brief Writes serialized log pages to their files, compressed with the configured codec.
+ * With threads > 0, independent pages are compressed and written by a pool of workers,
+ * Write() only blocks when 2*threads pages are already queued.
+ *
+ */
+class M3LogPageWriter
+{
+public:
+    M3LogPageWriter():inline_ctx(NULL),running(false),failed(false),bytes_in(0),bytes_out(0){
+        pthread_mutex_init(&mutex,NULL);
+        pthread_cond_init(&cond_job,NULL);
+        pthread_cond_init(&cond_space,NULL);
+    }
+    ~M3LogPageWriter();
+    /**
+     * @brief
+     *
+     * @param c
+     * @return bool
+     */
+    bool Startup(const M3LogCompression & c);
+    /**
+     * @brief
+     *
+     * @param filename Without the codec extension
+     * @param data Serialized M3StatusLogPage, swapped away (left with a recycled buffer)
+     * @return bool False once a write failed
+     */
+    bool Write(const std::string & filename, std::string & data);
+    /**
+     * @brief Wait for the queued pages to be written, from the thread calling Write().
+     *
+     * @return bool False if any write failed
+     */
+    bool Flush();
+    /**
+     * @brief Write what is queued and stop the workers.
+     *
+     * @return bool False if any write failed
+     */
+    bool Shutdown();
+    /**
+     * @brief
+     *
+     * @return long long Serialized bytes
+     */
+    long long GetBytesIn();
+    /**
+     * @brief
+     *
+     * @return long long Bytes on disk
+     */
+    long long GetBytesOut();
+private:
+    struct Job
+    {
+        std::string filename;
+        std::string data;
+    };
+    friend void * log_compress_thread(void * arg);
+    bool WriteJob(Job & job, void * ctx, std::string & buf);
+    M3LogCompression config;
+    std::vector<pthread_t> workers;
+    std::deque<Job *> queue;
+    std::vector<Job *> free_jobs;
+    void * inline_ctx; /**< Compression context of the calling thread, threads==0 */
+    std::string inline_buf;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_job;
+    pthread_cond_t cond_space;
+    bool running;
+    bool failed;
+    long long bytes_in;
+    long long bytes_out;
+};
+
+}
+
+#endif
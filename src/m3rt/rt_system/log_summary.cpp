@@ -0,0 +1,285 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "m3rt/rt_system/log_summary.h"
+#include "m3rt/base/toolbox.h"
+#include <sstream>
+#include <limits>
+
+namespace m3rt
+{
+using namespace std;
+using google::protobuf::FieldDescriptor;
+
+static bool IsNumeric(const FieldDescriptor * f)
+{
+    switch(f->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_STRING:
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+        return false;
+    default:
+        return true;
+    }
+}
+
+bool GetLogFieldValue(const google::protobuf::Message & msg, const vector<const FieldDescriptor *> & path,
+                      const vector<int> & index, mReal * v)
+{
+    const google::protobuf::Message * m = &msg;
+    for(size_t j = 0; j < path.size(); j++) {
+        const FieldDescriptor * f = path[j];
+        const google::protobuf::Reflection * r = m->GetReflection();
+        int i = index[j];
+        if(f->is_repeated() && i >= r->FieldSize(*m, f))
+            return false;
+        if(j + 1 < path.size()) {
+            m = f->is_repeated() ? &r->GetRepeatedMessage(*m, f, i) : &r->GetMessage(*m, f);
+            continue;
+        }
+        switch(f->cpp_type()) {
+        case FieldDescriptor::CPPTYPE_DOUBLE: *v = f->is_repeated() ? r->GetRepeatedDouble(*m, f, i) : r->GetDouble(*m, f); break;
+        case FieldDescriptor::CPPTYPE_FLOAT: *v = f->is_repeated() ? r->GetRepeatedFloat(*m, f, i) : r->GetFloat(*m, f); break;
+        case FieldDescriptor::CPPTYPE_INT32: *v = f->is_repeated() ? r->GetRepeatedInt32(*m, f, i) : r->GetInt32(*m, f); break;
+        case FieldDescriptor::CPPTYPE_INT64: *v = f->is_repeated() ? r->GetRepeatedInt64(*m, f, i) : r->GetInt64(*m, f); break;
+        case FieldDescriptor::CPPTYPE_UINT32: *v = f->is_repeated() ? r->GetRepeatedUInt32(*m, f, i) : r->GetUInt32(*m, f); break;
+        case FieldDescriptor::CPPTYPE_UINT64: *v = f->is_repeated() ? r->GetRepeatedUInt64(*m, f, i) : r->GetUInt64(*m, f); break;
+        case FieldDescriptor::CPPTYPE_BOOL: *v = f->is_repeated() ? r->GetRepeatedBool(*m, f, i) : r->GetBool(*m, f); break;
+        case FieldDescriptor::CPPTYPE_ENUM: *v = f->is_repeated() ? r->GetRepeatedEnum(*m, f, i)->number() : r->GetEnum(*m, f)->number(); break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+//base.timestamp, 0 if the status has none
+static long long GetTimestamp(const google::protobuf::Message & m)
+{
+    const FieldDescriptor * b = m.GetDescriptor()->FindFieldByName("base");
+    if(b == NULL || b->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE || b->is_repeated())
+        return 0;
+    const google::protobuf::Message & base = m.GetReflection()->GetMessage(m, b);
+    const FieldDescriptor * t = base.GetDescriptor()->FindFieldByName("timestamp");
+    if(t == NULL || t->cpp_type() != FieldDescriptor::CPPTYPE_INT64 || t->is_repeated())
+        return 0;
+    return base.GetReflection()->GetInt64(base, t);
+}
+
+void M3LogSummaryWriter::ListFields(Component & c, const google::protobuf::Message & m, const string & prefix,
+                                    vector<const FieldDescriptor *> & path, vector<int> & index)
+{
+    const google::protobuf::Reflection * r = m.GetReflection();
+    vector<const FieldDescriptor *> fields;
+    r->ListFields(m, &fields);
+    for(size_t k = 0; k < fields.size(); k++) {
+        const FieldDescriptor * f = fields[k];
+        if(path.empty() && f->name() == "base")
+            continue;
+        int n = f->is_repeated() ? r->FieldSize(m, f) : 1;
+        for(int i = 0; i < n; i++) {
+            ostringstream name;
+            name << prefix << f->name();
+            if(f->is_repeated())
+                name << "[" << i << "]";
+            path.push_back(f);
+            index.push_back(f->is_repeated() ? i : -1);
+            if(f->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE)
+                ListFields(c, f->is_repeated() ? r->GetRepeatedMessage(m, f, i) : r->GetMessage(m, f), name.str() + ".", path, index);
+            else if(IsNumeric(f)) {
+                c.fields.push_back(name.str());
+                c.path.push_back(path);
+                c.index.push_back(index);
+            }
+            path.pop_back();
+            index.pop_back();
+        }
+    }
+}
+
+int M3LogSummaryWriter::AddComponent(const string & name, const google::protobuf::Message & prototype)
+{
+    Component c;
+    c.name = name;
+    vector<const FieldDescriptor *> path;
+    vector<int> index;
+    ListFields(c, prototype, "", path, index);
+    c.value.resize(c.fields.size());
+    c.valid.resize(c.fields.size());
+    components.push_back(c);
+    return components.size() - 1;
+}
+
+void M3LogSummaryWriter::ResetBin(Bin & b)
+{
+    for(size_t i = 0; i < b.n.size(); i++) {
+        b.min[i] = numeric_limits<mReal>::max();
+        b.max[i] = -numeric_limits<mReal>::max();
+        b.sum[i] = 0;
+        b.n[i] = 0;
+    }
+    b.count = 0;
+    b.timestamp = 0;
+}
+
+bool M3LogSummaryWriter::Startup(const string & p, const vector<mReal> & periods_s, M3LogPageWriter * w)
+{
+    Shutdown();
+    prefix = p;
+    writer = w;
+    for(size_t j = 0; j < periods_s.size(); j++) {
+        Level l;
+        l.period = MAX(1, (int)(periods_s[j] * RT_TASK_FREQUENCY + 0.5));
+        l.ms = (int)(l.period * 1000.0 / RT_TASK_FREQUENCY + 0.5);
+        l.bin = -1;
+        l.first_bin = 0;
+        l.num_bins = 0;
+        l.acc.resize(components.size());
+        l.page = new M3LogSummaryPage();
+        l.page->set_period_cycles(l.period);
+        l.page->set_rt_frequency(RT_TASK_FREQUENCY);
+        for(size_t k = 0; k < components.size(); k++) {
+            Bin & b = l.acc[k];
+            size_t n = components[k].fields.size();
+            b.min.resize(n);
+            b.max.resize(n);
+            b.sum.resize(n);
+            b.n.resize(n);
+            ResetBin(b);
+            M3LogSummary * s = l.page->add_summary();
+            s->set_component(components[k].name);
+            for(size_t i = 0; i < n; i++)
+                s->add_field(components[k].fields[i]);
+        }
+        levels.push_back(l);
+    }
+    return true;
+}
+
+bool M3LogSummaryWriter::Add(int comp, long long cycle, const google::protobuf::Message & status)
+{
+    bool ok = true;
+    Component & c = components[comp];
+    for(size_t i = 0; i < c.fields.size(); i++)
+        c.valid[i] = GetLogFieldValue(status, c.path[i], c.index[i], &c.value[i]);
+    long long timestamp = GetTimestamp(status);
+    for(size_t j = 0; j < levels.size(); j++) {
+        Level & l = levels[j];
+        long long bin = cycle / l.period;
+        if(bin != l.bin) {
+            if(l.bin >= 0 && !CloseBin(l))
+                ok = false;
+            l.bin = bin;
+        }
+        Bin & b = l.acc[comp];
+        if(b.count++ == 0)
+            b.timestamp = timestamp;
+        for(size_t i = 0; i < c.fields.size(); i++) {
+            if(!c.valid[i])
+                continue;
+            mReal v = c.value[i];
+            b.min[i] = MIN(b.min[i], v);
+            b.max[i] = MAX(b.max[i], v);
+            b.sum[i] += v;
+            b.n[i]++;
+        }
+    }
+    return ok;
+}
+
+bool M3LogSummaryWriter::CloseBin(Level & l)
+{
+    if(l.num_bins == 0)
+        l.first_bin = l.bin;
+    for(size_t k = 0; k < components.size(); k++) {
+        Bin & b = l.acc[k];
+        if(b.count == 0) //Component not sampled in that bin
+            continue;
+        M3LogSummaryBin * s = l.page->mutable_summary(k)->add_bin();
+        s->set_bin(l.bin);
+        s->set_timestamp(b.timestamp);
+        s->set_count(b.count);
+        for(size_t i = 0; i < b.n.size(); i++) {
+            if(b.n[i] == 0) {
+                s->add_min(numeric_limits<mReal>::quiet_NaN());
+                s->add_max(numeric_limits<mReal>::quiet_NaN());
+                s->add_mean(numeric_limits<mReal>::quiet_NaN());
+            } else {
+                s->add_min(b.min[i]);
+                s->add_max(b.max[i]);
+                s->add_mean(b.sum[i] / b.n[i]);
+            }
+        }
+        ResetBin(b);
+    }
+    l.num_bins++;
+    if(l.num_bins >= RT_LOG_SUMMARY_BINS_PER_FILE)
+        return WriteLevel(l);
+    return true;
+}
+
+static void AppendIdx(ostringstream & os, long long idx)
+{
+    ostringstream s;
+    s << idx;
+    for(int i = s.str().size(); i < 6; i++)
+        os << "0";
+    os << s.str();
+}
+
+bool M3LogSummaryWriter::WriteLevel(Level & l)
+{
+    ostringstream filename;
+    filename << prefix << "_" << l.ms << "ms_";
+    AppendIdx(filename, l.first_bin);
+    filename << "_";
+    AppendIdx(filename, l.bin);
+    filename << ".pb.sum";
+    bool ok = l.page->SerializeToString(&buf);
+    if(!ok)
+        M3_ERR("Failed to serialize log summary %s.", filename.str().c_str());
+    else
+        ok = writer->Write(filename.str(), buf);
+    //Cleared bins are kept for reuse
+    for(int k = 0; k < l.page->summary_size(); k++)
+        l.page->mutable_summary(k)->clear_bin();
+    l.num_bins = 0;
+    return ok;
+}
+
+bool M3LogSummaryWriter::Finish()
+{
+    bool ok = true;
+    for(size_t j = 0; j < levels.size(); j++) {
+        Level & l = levels[j];
+        if(l.bin >= 0 && !CloseBin(l))
+            ok = false;
+        l.bin = -1;
+        if(l.num_bins > 0 && !WriteLevel(l))
+            ok = false;
+    }
+    return ok;
+}
+
+void M3LogSummaryWriter::Shutdown()
+{
+    for(size_t j = 0; j < levels.size(); j++)
+        delete levels[j].page;
+    levels.clear();
+}
+
+}
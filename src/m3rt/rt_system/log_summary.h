@@ -0,0 +1,136 @@
+/*
+M3 -- Meka Robotics Real-Time Control System
+Copyright (c) 2010 Meka Robotics
+Author: edsinger@mekabot.com (Aaron Edsinger)
+
+M3 is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+M3 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with M3.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef M3RT_LOG_SUMMARY_H
+#define M3RT_LOG_SUMMARY_H
+
+#include "m3rt/base/m3rt_def.h"
+#include "m3rt/base/component_base.pb.h"
+#include "m3rt/rt_system/log_codec.h"
+#include <string>
+#include <vector>
+
+namespace m3rt
+{
+
+/**
+ * @brief Numeric value of a field reached through path (message fields, then a numeric leaf).
+ *
+ * @param m
+ * @param path
+ * @param index Element of each path entry, -1 if not repeated
+ * @param v
+ * @return bool False if a repeated field is too short or the leaf is not numeric
+ */
+bool GetLogFieldValue(const google::protobuf::Message & m, const std::vector<const google::protobuf::FieldDescriptor *> & path,
+                      const std::vector<int> & index, mReal * v);
+
+/**
+ * @brief Summary pyramid of a log session: min/max/mean of every numeric status field over bins
+ * of each period (log_summary in m3_config.yml). Each level is written every
+ * RT_LOG_SUMMARY_BINS_PER_FILE bins to prefix_<period_ms>ms_<first bin>_<last bin>.pb.sum
+ * (M3LogSummaryPage), through the page writer of the log. Runs on the log thread.
+ *
+ */
+class M3LogSummaryWriter
+{
+public:
+    M3LogSummaryWriter():writer(NULL){}
+    ~M3LogSummaryWriter(){Shutdown();}
+    /**
+     * @brief Summarize the numeric fields set in prototype, repeated ones element-wise (base aside).
+     *
+     * @param name
+     * @param prototype
+     * @return int Index for Add()
+     */
+    int AddComponent(const std::string & name, const google::protobuf::Message & prototype);
+    /**
+     * @brief After AddComponent.
+     *
+     * @param prefix path/name of the log session
+     * @param periods_s One level each
+     * @param w
+     * @return bool
+     */
+    bool Startup(const std::string & prefix, const std::vector<mReal> & periods_s, M3LogPageWriter * w);
+    /**
+     * @brief
+     *
+     * @param comp
+     * @param cycle rt cycle of the sample, increasing
+     * @param status
+     * @return bool False if a page could not be written
+     */
+    bool Add(int comp, long long cycle, const google::protobuf::Message & status);
+    /**
+     * @brief Close the current bins and write what is left.
+     *
+     * @return bool
+     */
+    bool Finish();
+    /**
+     * @brief
+     *
+     */
+    void Shutdown();
+private:
+    struct Component
+    {
+        std::string name;
+        std::vector<std::string> fields;
+        std::vector<std::vector<const google::protobuf::FieldDescriptor *> > path;
+        std::vector<std::vector<int> > index;
+        std::vector<mReal> value; /**< Last sample */
+        std::vector<char> valid;
+    };
+    struct Bin
+    {
+        std::vector<mReal> min;
+        std::vector<mReal> max;
+        std::vector<mReal> sum;
+        std::vector<int> n;
+        int count;
+        long long timestamp;
+    };
+    struct Level
+    {
+        int period; /**< rt cycles */
+        int ms;
+        long long bin; /**< Being filled, -1: none */
+        long long first_bin; /**< Of page */
+        int num_bins; /**< In page */
+        std::vector<Bin> acc; /**< Per component */
+        M3LogSummaryPage * page;
+    };
+    void ListFields(Component & c, const google::protobuf::Message & m, const std::string & prefix,
+                    std::vector<const google::protobuf::FieldDescriptor *> & path, std::vector<int> & index);
+    void ResetBin(Bin & b);
+    bool CloseBin(Level & l);
+    bool WriteLevel(Level & l);
+    std::string prefix;
+    std::vector<Component> components;
+    std::vector<Level> levels;
+    M3LogPageWriter * writer;
+    std::string buf;
+};
+
+}
+
+#endif
@@ -23,6 +23,8 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 %include <std_string.i>
 %include <std_vector.i>
 %template() std::vector<std::string>;
+%template() std::vector<std::vector<std::string> >;
+%template() std::vector<int>;
 		
 %{
 #include "rt_service.h"
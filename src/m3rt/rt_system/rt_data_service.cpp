@@ -19,6 +19,7 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "m3rt/rt_system/rt_data_service.h"
 #include "m3rt/base/m3rt_def.h"
+#include "m3rt/base/thread_placement.h"
 #include <unistd.h>
 #ifdef __RTAI__
 #ifdef __cplusplus
@@ -48,6 +49,10 @@ void data_thread(void * arg)
 	M3RtDataService * svc = (M3RtDataService *)arg;
 	svc->data_thread_active=true;
 	svc->data_thread_end=false;
+#ifndef __RTAI__
+	ApplyThreadPlacement(M3_THREAD_DATA_SERVICE, "data_service");
+#endif
+	svc->data_thread_ready.Post(M3ReadySignal::READY);
 		if (!svc->StartServer()) //blocks until connection
 	{
 		svc->data_thread_active=false;
@@ -66,13 +71,14 @@ void data_thread(void * arg)
 	//Need to consider multiple threads, name conflict
 	ss << "M3DSV" << svc->instances;
 	ss >> rt_name;
-	task = rt_task_init_schmod(nam2num(rt_name.c_str()), 4, 0, 0, SCHED_FIFO, 0xF); 
+	task = rt_task_init_schmod(nam2num(rt_name.c_str()), 4, 0, 0, GetThreadPolicy(M3_THREAD_DATA_SERVICE, SCHED_FIFO), GetThreadCpuMask(M3_THREAD_DATA_SERVICE, 0xF)); 
 	svc->instances++;
 	if (task==NULL)
 	{
 		M3_ERR("Failed to create M3RtDataService RT Task\n",0);
 		return;
 	}
+	ApplyThreadPlacement(M3_THREAD_DATA_SERVICE, rt_name.c_str(), true);
 	mlockall(MCL_CURRENT | MCL_FUTURE);
         printstart = rt_get_time_ns();
 #endif 
@@ -82,6 +88,16 @@ void data_thread(void * arg)
                 tstart = rt_get_time();
 #endif
                 if (svc->data_thread_end) break;
+		if (svc->IsStreaming())
+		{
+		   //Paced by the rt loop, no need to sleep
+		   if (!svc->StepStreaming())
+		   {
+		      svc->data_thread_error=true;
+		      break;
+		   }
+		   continue;
+		}
 		if (!svc->Step())
 		{
 		   svc->data_thread_error=true;		   
@@ -122,14 +138,27 @@ bool M3RtDataService::Startup()
 		return true;
 	}
 	M3_INFO("Startup of Data Service, port %d...\n",portno);
+	data_thread_ready.Reset();
 	ext_sem=sys->GetExtSem();
+#ifdef __RTAI__
+	stringstream ss;
+	string sem_name;
+	ss << "M3DW" << portno%100; // RTAI names must be <=6 chars
+	ss >> sem_name;
+	cycle_sem=rt_typed_sem_init(nam2num(sem_name.c_str()), 0, BIN_SEM);
+#else
+	cycle_sem=new sem_t();
+	sem_init(cycle_sem, 0, 0);
+#endif
+	if (!cycle_sem)
+		M3_WARN("Unable to create the cycle semaphore, streaming will not be available on port %d\n",portno);
 #ifdef __RTAI__
 	M3_INFO("Creating Data Service thread...\n");
 	hdt=rt_thread_create((void*)data_thread,this,10000);  // wait until thread starts
 #else
 	long int hdt = pthread_create((pthread_t *)&hdt, NULL, (void *(*)(void *))data_thread, (void*)this);
 #endif
-	usleep(100000);
+	data_thread_ready.Wait(M3_THREAD_START_TIMEOUT_NS);
 	if (!data_thread_active || !hdt)
 	{
 		M3_ERR("Unable to start M3RtDataSevice\n",0);
@@ -141,6 +170,7 @@ bool M3RtDataService::Startup()
 void M3RtDataService::Shutdown()
 {
 	M3_INFO("Shutting down Data Service , port %d...\n",portno);
+	ClientStopStreaming();
 	data_thread_end=true;
 #ifdef __RTAI__
 	rt_thread_join(hdt);
@@ -149,6 +179,32 @@ void M3RtDataService::Shutdown()
 #endif
 	if (data_thread_active)
 		M3_WARN("Data Service thread did not shut down correctly\n");
+	if (cycle_sem!=NULL)
+	{
+#ifdef __RTAI__
+		rt_sem_delete(cycle_sem);
+#else
+		sem_destroy(cycle_sem);
+		delete cycle_sem;
+#endif
+		cycle_sem=NULL;
+	}
+	ClientSubscribeLogTail("",-1);
+	if (ext_sem!=NULL)
+	{
+		//The rt thread stops serializing what nobody else reads
+#ifdef __RTAI__
+		rt_sem_wait(ext_sem);
+#else
+		sem_wait(ext_sem);
+#endif
+		UnsubscribeAllStatus();
+#ifdef __RTAI__
+		rt_sem_signal(ext_sem);
+#else
+		sem_post(ext_sem);
+#endif
+	}
 	server.Shutdown();
 	M3_INFO("Shutdown of Data Service , port %d\n done",portno);
 }
@@ -156,10 +212,166 @@ void M3RtDataService::Shutdown()
 
 void M3RtDataService::ClientSubscribeStatus(string name)
 {
-	for (int i=0;i<status_names.size();i++)
+	if (ext_sem==NULL)
+		return;
+#ifdef __RTAI__
+	rt_sem_wait(ext_sem);
+#else
+	sem_wait(ext_sem);
+#endif
+	SubscribeStatus(name);
+#ifdef __RTAI__
+	rt_sem_signal(ext_sem);
+#else
+	sem_post(ext_sem);
+#endif
+}
+
+void M3RtDataService::SubscribeStatus(const string & name)
+{
+	for (size_t i=0;i<status_names.size();i++)
 		if (name.compare(status_names[i])==0)
 			return;
 	status_names.push_back(name);
+	status_idx.push_back(sys->GetComponentIdx(name));
+	sys->AddExtStatusSubscriber(status_idx.back());
+}
+
+void M3RtDataService::UnsubscribeAllStatus()
+{
+	for (size_t i=0;i<status_idx.size();i++)
+		sys->RemoveExtStatusSubscriber(status_idx[i]);
+	status_names.clear();
+	status_idx.clear();
+}
+
+bool M3RtDataService::ClientStartStreaming(int rate_divisor)
+{
+	if (cycle_sem==NULL)
+		return false;
+	stream_divisor=MAX(1,rate_divisor);
+	if (!streaming)
+	{
+		stream_cnt=0;
+		sys->AddCycleListener(cycle_sem);
+		streaming=true;
+		M3_INFO("Data Service port %d now streaming status every %d rt cycles\n",portno,(int)stream_divisor);
+	}
+	return true;
+}
+
+void M3RtDataService::ClientStopStreaming()
+{
+	if (!streaming)
+		return;
+	streaming=false;
+	sys->RemoveCycleListener(cycle_sem);
+}
+
+bool M3RtDataService::ClientSubscribeLogTail(string session, long long seq)
+{
+	if (tail!=NULL)
+		M3LogTailBuffer::Release(tail);
+	tail=NULL;
+	if (session.empty())
+		return true;
+	tail=M3LogTailBuffer::Acquire(session);
+	if (tail==NULL)
+	{
+		M3_WARN("Unable to tail log %s: no such session, or it has no tail\n",session.c_str());
+		return false;
+	}
+	tail_next=tail_acked=(seq<0 ? tail->GetNextSeq() : seq);
+	M3_INFO("Data Service port %d now tailing log %s from entry %lld\n",portno,session.c_str(),tail_next);
+	return true;
+}
+
+//Entries go out with the status packet, as long as the client keeps up (acknowledges them)
+void M3RtDataService::AppendLogTail()
+{
+	status.clear_log_tail();
+	if (tail==NULL)
+		return;
+	long long n=MIN((long long)RT_LOG_TAIL_MAX_PER_PACKET,tail_acked+RT_LOG_TAIL_WINDOW-tail_next);
+	if (n<=0)
+		return;
+	M3LogTail * t=status.mutable_log_tail();
+	tail_next=tail->Read(tail_next,(int)n,t);
+	if (t->dropped()>0)
+	{
+		M3_WARN("Data Service port %d: %lld log entries lost, the tail client falls behind\n",portno,t->dropped());
+		tail_acked=MAX(tail_acked,t->first_seq());
+	}
+	if (t->end())
+	{
+		M3LogTailBuffer::Release(tail);
+		tail=NULL;
+	}
+}
+
+bool M3RtDataService::StepStreaming()
+{
+	int nw,nr,res;
+	bool cycle;
+	//Woken up by M3RtSystem::Step once the cycle is done
+#ifdef __RTAI__
+	cycle=(rt_sem_wait_timed(cycle_sem,nano2count(RT_DATA_SERVICE_STREAM_TIMEOUT_NS))<RTE_LOWERR); //Not RTE_TIMOUT or another error
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	ts.tv_nsec+=RT_DATA_SERVICE_STREAM_TIMEOUT_NS;
+	ts.tv_sec+=ts.tv_nsec/1000000000;
+	ts.tv_nsec%=1000000000;
+	cycle=(sem_timedwait(cycle_sem,&ts)==0); //ETIMEDOUT or EINTR otherwise
+#endif
+	//Commands flow independently: apply whatever arrived since the last cycle
+	while ((res=server.ReadStringFromPort(sread, nr, 0))!=0)
+	{
+		if (res==-1) //error
+			return false;
+		if (nr<=0)
+			continue;
+		command.ParseFromString(sread);
+#ifdef __RTAI__
+		rt_sem_wait(ext_sem);
+#else
+		sem_wait(ext_sem);
+#endif
+		sys->ParseCommandFromExt(command);
+		for (int i=0;i<command.control_size();i++)
+			HandleControl(command.control(i));
+#ifdef __RTAI__
+		rt_sem_signal(ext_sem);
+#else
+		sem_post(ext_sem);
+#endif
+	}
+	//No cycle ran (rt system stopped or stalled): nothing new to push, and it does not count
+	if (!cycle)
+		return true;
+	if (++stream_cnt<stream_divisor)
+		return true;
+	stream_cnt=0;
+#ifdef __RTAI__
+	rt_sem_wait(ext_sem);
+#else
+	sem_wait(ext_sem);
+#endif
+	bool ok=sys->SerializeStatusToExt(status,status_names);
+#ifdef __RTAI__
+	rt_sem_signal(ext_sem);
+#else
+	sem_post(ext_sem);
+#endif
+	if (!ok)
+		return false;
+	AppendLogTail();
+	status.SerializeToString(&swrite);
+	status.clear_control();
+	nw=server.WriteStringToPort(swrite);
+	if(nw<0)
+		return false;
+	return true;
 }
 	
 bool M3RtDataService::Step()
@@ -187,6 +399,8 @@ bool M3RtDataService::Step()
 		if (c!=NULL)
 		{
 			sys->ParseCommandFromExt(*c);
+			for (int i=0;i<c->control_size();i++)
+				HandleControl(c->control(i));
 			delete c;
 		}
 		if (!sys->SerializeStatusToExt(status,status_names))
@@ -203,12 +417,91 @@ bool M3RtDataService::Step()
 #else
 			sem_post(ext_sem);
 #endif
+		AppendLogTail();
 		status.SerializeToString(&swrite);
+		status.clear_control();
 		nw=server.WriteStringToPort(swrite);
 		if(nw<0)
 			return false;
 	}
 	return true;
 }
+
+void M3RtDataService::HandleControl(const M3ControlRequest & req)
+{
+	M3ControlReply * r=status.add_control();
+	r->set_seq(req.seq());
+	bool ok=true;
+	int idx;
+	switch (req.op())
+	{
+	case M3CONTROL_DIRECTORY:
+		for (int i=0;i<sys->GetNumComponents();i++)
+		{
+			r->add_name(sys->GetComponentName(i));
+			r->add_type(sys->GetComponentType(i));
+			r->add_state((M3COMP_STATE)sys->GetComponentState(i));
+		}
+		break;
+	case M3CONTROL_SUBSCRIBE:
+		for (int i=0;i<req.name_size();i++)
+		{
+			if (sys->GetComponentIdx(req.name(i))<0)
+			{
+				M3_WARN("Unable to subscribe to %s: no such component\n",req.name(i).c_str());
+				ok=false;
+				continue;
+			}
+			SubscribeStatus(req.name(i));
+		}
+		break;
+	case M3CONTROL_SET_STATE:
+		for (int i=0;i<req.name_size();i++)
+		{
+			idx=sys->GetComponentIdx(req.name(i));
+			if (idx<0)
+				ok=false;
+			else if (req.state()==M3COMP_STATE_OP)
+			{
+				if (!sys->SetComponentStateOp(idx)) //safeop_required, or not in SAFEOP
+					ok=false;
+			}
+			else if (req.state()==M3COMP_STATE_SAFEOP)
+			{
+				if (!sys->SetComponentStateSafeOp(idx))
+					ok=false;
+			}
+			else
+				ok=false;
+		}
+		break;
+	case M3CONTROL_GET_STATE:
+		for (int i=0;i<req.name_size();i++)
+		{
+			idx=sys->GetComponentIdx(req.name(i));
+			if (idx<0)
+			{
+				ok=false;
+				continue;
+			}
+			r->add_name(req.name(i));
+			r->add_state((M3COMP_STATE)sys->GetComponentState(idx));
+		}
+		break;
+	case M3CONTROL_LOG_TAIL:
+		ok=ClientSubscribeLogTail(req.name_size()>0 ? req.name(0) : "",req.has_log_seq() ? req.log_seq() : -1);
+		break;
+	case M3CONTROL_LOG_ACK:
+		//Entries not sent yet can't be acknowledged, that would open the window past RT_LOG_TAIL_WINDOW
+		if (req.log_seq()<0 || req.log_seq()>tail_next)
+			ok=false;
+		else
+			tail_acked=MAX(tail_acked,req.log_seq());
+		break;
+	default:
+		ok=false;
+	}
+	r->set_ok(ok);
+}
 ////////////////////////////////////////////////////////////
 }
@@ -24,6 +24,7 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include "m3rt/base/component_base.pb.h"
 #include "m3rt/base/toolbox.h"
 #include "m3rt/rt_system/rt_system.h"
+#include "m3rt/rt_system/rt_log_service.h"
 #include <pthread.h>
 #include <string>
 
@@ -54,7 +55,8 @@ namespace m3rt
 class M3RtDataService
 {
 public:
-	M3RtDataService(M3RtSystem * s, int port):sys(s),data_thread_active(false),data_thread_error(false),data_thread_end(false),portno(port){
+	M3RtDataService(M3RtSystem * s, int port):data_thread_active(false),data_thread_end(false),data_thread_error(false),
+            streaming(false),stream_divisor(1),portno(port),sys(s),stream_cnt(0),tail(NULL),tail_next(0),tail_acked(0),ext_sem(NULL),cycle_sem(NULL){
             status_names.reserve(50);
         }
     /**
@@ -81,22 +83,80 @@ public:
      */
     bool Step();
     /**
-     * @brief
+     * @brief Streaming mode: wait for the end of an rt cycle, apply pending commands
+     * and push the status every stream_divisor cycles.
+     *
+     * @return bool
+     */
+    bool StepStreaming();
+    /**
+     * @brief Takes ext_sem.
      *
      * @param name
      */
     void ClientSubscribeStatus(std::string name);
+    /**
+     * @brief Switch to server-push mode, status is sent every rate_divisor rt cycles.
+     *
+     * @param rate_divisor
+     * @return bool
+     */
+    bool ClientStartStreaming(int rate_divisor);
+    /**
+     * @brief Go back to lockstep mode (one status per command packet).
+     *
+     */
+    void ClientStopStreaming();
+    /**
+     * @brief Send the entries of a log session with the status packets, from seq on, with at most
+     * RT_LOG_TAIL_WINDOW of them not acknowledged (M3CONTROL_LOG_ACK).
+     *
+     * @param session Empty: stop
+     * @param seq -1: from the next entry
+     * @return bool False if no such session
+     */
+    bool ClientSubscribeLogTail(std::string session, long long seq);
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool IsStreaming(){return streaming;}
+    /**
+     * @brief Answer a control request received on the data port, the reply goes out
+     * with the next status packet. Called with ext_sem held.
+     *
+     * @param req
+     */
+    void HandleControl(const M3ControlRequest & req);
+    /**
+     * @brief Add name to status_names and count it in M3RtSystem. Called with ext_sem held.
+     *
+     * @param name
+     */
+    void SubscribeStatus(const std::string & name);
+    /**
+     * @brief Drop all the subscriptions. Called with ext_sem held.
+     *
+     */
+    void UnsubscribeAllStatus();
 #ifdef __cplusplus11__
     std::atomic<bool> data_thread_active; 
     std::atomic<bool> data_thread_end; 
     std::atomic<bool> data_thread_error; 
+    std::atomic<bool> streaming;
+    std::atomic<int> stream_divisor;
 #else
     bool data_thread_active; 
     bool data_thread_end; 
     bool data_thread_error; 
+    bool streaming;
+    int stream_divisor;
 #endif
+    M3ReadySignal data_thread_ready; /**< Posted once the thread runs, before it blocks on accept */
     static int instances; 
 private:
+    void AppendLogTail();
     M3StatusAll status; 
     M3SimpleServer server; 
     int portno; 
@@ -105,11 +165,19 @@ private:
     std::string swrite; 
     M3RtSystem * sys; 
     std::vector<std::string> status_names; 
+    std::vector<int> status_idx; /**< Component index of each of status_names, -1 if none */
     long hdt; 
+    int stream_cnt;
+    M3CommandAll command;
+    M3LogTailBuffer * tail; /**< Subscribed log session, NULL if none */
+    long long tail_next; /**< Next entry to send */
+    long long tail_acked; /**< Next entry the client expects */
 #ifdef __RTAI__	
     SEM * ext_sem; 
+    SEM * cycle_sem;
 #else
 	sem_t * ext_sem;
+	sem_t * cycle_sem;
 #endif
 };
 
@@ -19,11 +19,13 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "m3rt/rt_system/rt_log_service.h"
 #include "m3rt/base/m3rt_def.h"
+#include "m3rt/base/thread_placement.h"
 #include "m3rt/base/component_base.pb.h"
 #include "m3rt/rt_system/rt_system.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstdlib>
 #include <unistd.h>
 #ifdef __RTAI__
 #ifdef __cplusplus
@@ -43,25 +45,27 @@ extern "C" {
 namespace m3rt
 {
 	using namespace std;
-static bool log_thread_active=false;
-static bool log_thread_end=false;
+static const char * trigger_names[]={"api","state","overrun","threshold"};
 ///////////////////////////////////////////////////////////
 
 
-static void* log_thread(void * arg)
+void * log_thread(void * arg)
 {
-	M3RtLogService * svc = (M3RtLogService *)arg;
-	log_thread_active=true;
-	log_thread_end=false;
+	M3RtLogManager * mgr = (M3RtLogManager *)arg;
+	mgr->thread_active=true;
+	mgr->thread_end=false;
 	// TODO: Add the semaphore back in?
 #ifdef __RTAI__	
 	RT_TASK *task;
-	task = rt_task_init_schmod(nam2num("M3LSV"), 5, 0, 0, SCHED_FIFO, 0xF); 
+	task = rt_task_init_schmod(nam2num("M3LSV"), 5, 0, 0, GetThreadPolicy(M3_THREAD_LOG_SERVICE, SCHED_FIFO), GetThreadCpuMask(M3_THREAD_LOG_SERVICE, 0xF)); 
 	if (task==NULL)
 	{
 		M3_ERR("Failed to create M3RtLogService RT Task\n",0);
+		mgr->thread_active=false;
+		mgr->thread_ready.Post(M3ReadySignal::FAILED);
 		return 0;
 	}
+	ApplyThreadPlacement(M3_THREAD_LOG_SERVICE, "M3LSV", true);
  	rt_allow_nonroot_hrt();
 	mlockall(MCL_CURRENT | MCL_FUTURE);
 	rt_make_soft_real_time();
@@ -74,76 +78,152 @@ static void* log_thread(void * arg)
 	}
 	else
 		M3_INFO("M3RtLogService allocated ext_sem semaphore  %08x \n",svc->ext_sem);*/
+#else
+	ApplyThreadPlacement(M3_THREAD_LOG_SERVICE, "log_service");
 #endif	
-	while(!log_thread_end)
+	mgr->thread_ready.Post(M3ReadySignal::READY);
+	while(!mgr->thread_end)
 	{
-		if (!svc->WritePagesToDisk())
-			break;
-		usleep(100000);
+		mgr->WriteSnapshots();
+		mgr->thread_stop.Wait(RT_LOG_WRITER_PERIOD_NS);
 	}	
-	svc->WriteEntry(true);
-	svc->WritePagesToDisk();
+	mgr->WriteSnapshots();
 	M3_DEBUG("Exiting M3 Log Server Thread\n",0);
 #ifdef __RTAI__	
 	rt_task_delete(task);
 #endif
-	log_thread_active=false;
+	mgr->thread_active=false;
 	return 0;
 }
+static void ApplyFieldMask(google::protobuf::Message * m, const M3LogFieldMask & mask);
+
+static long long log_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+static long long GetSpaceUsed(const google::protobuf::Message & m)
+{
+#if GOOGLE_PROTOBUF_VERSION >= 3004000
+	return m.SpaceUsedLong();
+#else
+	return m.SpaceUsed();
+#endif
+}
 ////////////////////////////////////////////////////////////
 bool M3RtLogService::Startup()
 {
-	if (log_thread_active)
+	if (tail_entries>0 && capture_mode)
 	{
-		M3_ERR("M3RtLogService thread already active\n",0);
-		return false;
+		M3_WARN("M3RtLogService %s: no tail in capture mode\n",name.c_str());
+		tail_entries=0;
+		to_disk=true;
 	}
-	
-	//NOTE: This serialization needs to be done once only
-	//Likely a semaphore is needed on rt_system
-	//Otherwise can gen a protobuf error. Moved this out of the loop below.
-	vector<string> datums;
-	vector<M3Component*>::iterator k;
-	  for(k=components.begin(); k!=components.end(); ++k)
-	  {
-		  string d;
-		  if (!(*k)->SerializeStatus(d))
-			  return false;
-		  datums.push_back(d);
-	  }	   
-	 
 	//  Allocate all the memory now cause we don't want to do it in realtime loops
-	for (int i = 0; i < MAX_PAGE_QUEUE; i++)
-	{
-	  page=new M3StatusLogPage();
-	  for (int j = 0; j < page_size; j++)
-	  {
-	    int si=0;
-	    M3StatusAll * entry = page->add_entry();
-	    for(k=components.begin(); k!=components.end(); ++k)
-	    {
-		    entry->add_datum(datums[si]);
-		    entry->add_name((*k)->GetName());
-		    si++;
-	    }	   
-	  }	   
-	  pages.push_back(page);
-	  is_page_full.push_back(false);	  	
-	}
-	page = pages[0];
+	//  Entries are reused page after page, the tail only needs one
+	page=new M3StatusLogPage();
+	for (int j = 0; j < (to_disk ? page_size : 1); j++)
+	{
+		M3StatusAll * entry = page->add_entry();
+		for(int k=0;k<components.size();k++)
+		{
+			entry->add_datum();
+			entry->add_name(components[k]->GetName());
+		}	   
+	}
+	entry_idx=0;
+	for(int k=0;k<streams.size();k++)
+	{
+		streams[k].cnt=0;
+		if (!streams[k].mask.fields.empty() && streams[k].scratch==NULL)
+			streams[k].scratch=components[k]->GetStatus()->New();
+	}
+	summary_idx.assign(streams.size(),-1);
+	//Entries come at the rate of the fastest stream
+	int rate=downsample_rate;
+	for(int k=0;k<streams.size();k++)
+		rate=MIN(rate,streams[k].rate);
+	entry_hz=(mReal)RT_TASK_FREQUENCY/(rate+1);
+	if (tail_entries>0)
+		tail=M3LogTailBuffer::Create(name,tail_entries);
+	const vector<mReal> & periods=sys->GetLogSummaryPeriods();
+	if (!capture_mode && to_disk && !periods.empty())
+	{
+		//The fields summarized are those set in the status now, masked as logged
+		for(int k=0;k<streams.size();k++)
+		{
+			google::protobuf::Message * proto=components[k]->GetStatus();
+			if (streams[k].scratch)
+			{
+				streams[k].scratch->CopyFrom(*proto);
+				ApplyFieldMask(streams[k].scratch,streams[k].mask);
+				proto=streams[k].scratch;
+			}
+			summary_idx[k]=summary.AddComponent(components[k]->GetName(),*proto);
+		}
+		summary.Startup(path+"/"+name,periods,writer);
+		start_cycle=-1;
+	}
+	if (capture_mode)
+	{
+		pre_entries=(int)(capture.pre_s*entry_hz+0.5);
+		post_entries=(int)(capture.post_s*entry_hz+0.5);
+		for (int j = 0; j < pre_entries; j++)
+		{
+			M3StatusAll * entry = new M3StatusAll();
+			for(int k=0;k<components.size();k++)
+			{
+				entry->add_datum();
+				entry->add_name(components[k]->GetName());
+			}
+			history.push_back(entry);
+		}
+		hist_head=hist_count=post_left=0;
+		for (int i=0;i<capture.thresholds.size();i++)
+			ResolveThreshold(capture.thresholds[i]);
+		trigger_state=0;
+		M3_INFO("M3RtLogService %s: capture mode, %d entries before and %d after a trigger\n",name.c_str(),pre_entries,post_entries);
+	}
+	EstimateBuffers();
+	return !components.empty();
+}
 
-#ifdef __RTAI__
-	hlt=rt_thread_create((void*)log_thread, (void*)this, 10000);
-#else
-	pthread_create((pthread_t *)&hlt, NULL, (void *(*)(void *))log_thread, (void*)this);
-#endif
-	usleep(100000);
-	if (!log_thread_active)
+//From the current status: the entries grow to about that size once written
+void M3RtLogService::EstimateBuffers()
+{
+	string buf;
+	entry_bytes=0;
+	encode_ns=0;
+	for (int pass=0;pass<5;pass++)
 	{
-		M3_ERR("Unable to start M3RtLogService\n",0);
-		return false;
+		long long bytes=0;
+		long long t0=log_time_ns();
+		for(int k=0;k<streams.size();k++)
+		{
+			google::protobuf::Message * m=components[k]->GetStatus();
+			if (streams[k].scratch)
+			{
+				streams[k].scratch->CopyFrom(*m);
+				ApplyFieldMask(streams[k].scratch,streams[k].mask);
+				m=streams[k].scratch;
+			}
+			m->SerializePartialToString(&buf);
+			bytes+=buf.size()+components[k]->GetName().size()+2*sizeof(string);
+		}
+		long long dt=log_time_ns()-t0;
+		entry_bytes=bytes;
+		encode_ns=(pass==0 ? dt : MIN(encode_ns,dt));
 	}
-	return log_thread_active;
+	long long entries=pre_entries+tail_entries;
+	if (to_disk)
+		entries+=2*page_size; //Page and its serialized copy
+	else
+		entries++;
+	buffer_bytes=entries*entry_bytes;
+	M3_INFO("M3RtLogService %s: %.1f MB of buffers, entries of %lld B at %.0f Hz, encoded in %lld us\n",
+		name.c_str(),buffer_bytes/1048576.0,entry_bytes,entry_hz,encode_ns/1000);
 }
 ////////////////////////////////////////////////////////////
 void M3RtLogService::Shutdown()
@@ -151,26 +231,74 @@ void M3RtLogService::Shutdown()
 	M3_DEBUG("M3RtLogService %s: Pages Written: %d\n",name.c_str(),num_page_write);
 	M3_DEBUG("M3RtLogService %s: KByte Written: %d\n",name.c_str(),num_kbyte_write);
 	M3_DEBUG("M3RtLogService %s. Shutting down...\n",name.c_str());
-	
-	log_thread_end=true;
-#ifdef __RTAI__
-	rt_thread_join(hlt);
-#else
-	pthread_join((pthread_t)hlt, NULL);
-#endif
-	if (log_thread_active) M3_WARN("M3RtLogService thread did not shut down correctly\n");
-	while (pages.size()) 
+	delete page;
+	page=NULL;
+	summary.Shutdown();
+	if (tail)
 	{
-		M3StatusLogPage * p=pages[0];
-		pages.erase(pages.begin());
-		delete p;
+		tail->Close();
+		M3LogTailBuffer::Release(tail);
+		tail=NULL;
 	}
-	
-	page=NULL;
+	for(int k=0;k<streams.size();k++)
+	{
+		delete streams[k].scratch;
+		streams[k].scratch=NULL;
+	}
+	for (int j=0;j<history.size();j++)
+		delete history[j];
+	history.clear();
 }
 
 ////////////////////////////////////////////////////////////
-void M3RtLogService::AddComponent(string name)
+//Resolve a dotted field path against the status descriptor
+static bool AddFieldToMask(const google::protobuf::Descriptor * d, const string & path, M3LogFieldMask & mask)
+{
+	size_t dot=path.find('.');
+	string field=path.substr(0,dot);
+	const google::protobuf::FieldDescriptor * f=d->FindFieldByName(field);
+	if (f==NULL)
+		return false;
+	if (dot==string::npos)
+	{
+		mask.fields[field].fields.clear(); //Whole field
+		return true;
+	}
+	if (f->cpp_type()!=google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE)
+		return false;
+	map<string,M3LogFieldMask>::iterator it=mask.fields.find(field);
+	if (it!=mask.fields.end() && it->second.fields.empty())
+		return true; //Already kept whole
+	return AddFieldToMask(f->message_type(),path.substr(dot+1),mask.fields[field]);
+}
+
+//Clear what the mask does not keep
+static void ApplyFieldMask(google::protobuf::Message * m, const M3LogFieldMask & mask)
+{
+	if (mask.fields.empty())
+		return;
+	const google::protobuf::Reflection * r=m->GetReflection();
+	const google::protobuf::Descriptor * d=m->GetDescriptor();
+	for (int i=0;i<d->field_count();i++)
+	{
+		const google::protobuf::FieldDescriptor * f=d->field(i);
+		map<string,M3LogFieldMask>::const_iterator it=mask.fields.find(f->name());
+		if (it==mask.fields.end())
+			r->ClearField(m,f);
+		else if (!it->second.fields.empty() && f->cpp_type()==google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE)
+		{
+			if (f->is_repeated())
+			{
+				for (int j=0;j<r->FieldSize(*m,f);j++)
+					ApplyFieldMask(r->MutableRepeatedMessage(m,f,j),it->second);
+			}
+			else if (r->HasField(*m,f))
+				ApplyFieldMask(r->MutableMessage(m,f),it->second);
+		}
+	}
+}
+
+void M3RtLogService::AddComponent(string name, mReal freq, const vector<string> & fields)
 {
 	int idx=sys->GetComponentIdx(name);
 	if (idx>=0)
@@ -178,54 +306,45 @@ void M3RtLogService::AddComponent(string name)
 		for(int i=0;i<components.size(); i++)
 			if(components[i]->GetName().compare(name)==0)
 				return;
+		M3LogStream st;
+		st.component=sys->GetComponent(idx);
+		st.rate=freq>0 ? MAX(0,((int)((mReal)RT_TASK_FREQUENCY)/freq)-1) : downsample_rate;
+		const google::protobuf::Descriptor * d=st.component->GetStatus()->GetDescriptor();
+		for (int i=0;i<fields.size();i++)
+			if (!AddFieldToMask(d,fields[i],st.mask))
+				M3_WARN("M3RtLogService %s: no field %s in the status of %s\n",this->name.c_str(),fields[i].c_str(),name.c_str());
+		//Timestamp, to align the streams in the log
+		if (!st.mask.fields.empty() && d->FindFieldByName("base"))
+			st.mask.fields["base"].fields.clear();
 		M3_DEBUG("Logging component: %s\n",name.c_str());
-		components.push_back(sys->GetComponent(idx));
+		components.push_back(st.component);
+		streams.push_back(st);
 		return;
 	}
 	M3_WARN("M3RtLogService component not available: %s\n",name.c_str());
 }		
 ////////////////////////////////////////////////////////////
-bool M3RtLogService::Step()
-{
-  
-	if (downsample_cnt==0)
-	{
-		downsample_cnt=downsample_rate;		
-		M3StatusAll * entry = page->mutable_entry(entry_idx);
-		string * datum;
-		vector<M3Component*>::iterator j;
-		int k = 0;
-		for(j=components.begin(); j!=components.end(); ++j)
-		{
-			datum = entry->mutable_datum(k);
-			if (!(*j)->SerializeStatus(*datum))
-				return false;
-			entry->set_datum(k,*datum);
-			entry->set_name(k,(*j)->GetName());
-			k++;
-		}
-		entry_idx++;
-		return WriteEntry(false);		
-	}
-	downsample_cnt--;	
-	return true;
-}		
-////////////////////////////////////////////////////////////
-bool  M3RtLogService::WriteEntry(bool final)
+bool M3RtLogService::Trigger(int reason, M3Component * comp)
 {
-	if (page == NULL)
+	if (!capture_mode || snapshots==NULL || (reason==M3_LOG_TRIGGER_OVERRUN && !capture.on_overrun)
+		|| (reason==M3_LOG_TRIGGER_STATE && !capture.on_state))
 		return false;
-	if (entry_idx >= page_size || final)
-	{		
-		if (final)
-			page=NULL;
-		else 
-		{				
-			entry_idx = 0;
-			MarkPageFull();
-			page = GetNextPageToWrite();
-		}					
-	}
+	int expected=0;
+#ifdef __cplusplus11__
+	if (!trigger_state.compare_exchange_strong(expected,1))
+		return false;
+#else
+	if (!__atomic_compare_exchange_n(&trigger_state,&expected,1,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+		return false;
+#endif
+	trigger_seq=snapshots->GetWritten();
+	trigger_reason=reason;
+	trigger_comp=comp;
+#ifdef __cplusplus11__
+	trigger_state.store(2,std::memory_order_release);
+#else
+	__atomic_store_n(&trigger_state,2,__ATOMIC_RELEASE);
+#endif
 	return true;
 }
 ////////////////////////////////////////////////////////////
@@ -253,76 +372,709 @@ string  M3RtLogService::GetNextFilename(int num_entry)
 }
 ////////////////////////////////////////////////////////////
 
-void M3RtLogService::MarkPageFull()
+bool M3RtLogService::WritePage()
 {
-  if (is_page_full[page_idx_write])
-    M3_ERR("Buffer over run in log pages...\n");
-  
-  is_page_full[page_idx_write] = true;
+	string filename=GetNextFilename(page->entry_size());
+	if (!page->SerializeToString(&page_buf)) 
+	{
+		M3_ERR("Failed to serialize logfile %s.",filename.c_str());
+		return false;
+	}
+	if (verbose)
+	  M3_DEBUG("Writing logfile %d: %s of size %dK\n",pages_written,filename.c_str(),(int)page_buf.size()/1024);
+	pages_written++;
+	num_page_write++;		
+	num_kbyte_write+=page_buf.size()/1024;		
+	return writer->Write(filename,page_buf);
 }
 
-void M3RtLogService::MarkPageEmpty()
+bool M3RtLogService::EncodeEntry(M3LogSnapshot * slot, M3StatusAll * entry)
 {
-  is_page_full[page_idx_read] = false;
+	//Only the components sampled in that cycle
+	int n=0;
+	for(int k=0;k<streams.size();k++)
+	{
+		M3LogStream & st=streams[k];
+		if (!slot->due[st.gidx])
+			continue;
+		if (n>=entry->datum_size())
+		{
+			entry->add_datum();
+			entry->add_name();
+		}
+		entry->set_name(n,components[k]->GetName());
+		bool ok;
+		if (st.scratch)
+		{
+			st.scratch->CopyFrom(*slot->status[st.slot]);
+			ApplyFieldMask(st.scratch,st.mask);
+			ok=st.scratch->SerializePartialToString(entry->mutable_datum(n));
+		}
+		else
+			ok=slot->status[st.slot]->SerializeToString(entry->mutable_datum(n));
+		if (!ok)
+			M3_WARN("M3RtLogService %s: failed to serialize %s\n",name.c_str(),components[k]->GetName().c_str());
+		n++;
+	}
+	while (entry->datum_size()>n)
+	{
+		entry->mutable_datum()->RemoveLast();
+		entry->mutable_name()->RemoveLast();
+	}
+	return true;
 }
 
-M3StatusLogPage * M3RtLogService::GetNextPageToWrite()
-{  
-  page_idx_write++;
-  if (page_idx_write >= MAX_PAGE_QUEUE)
-  {
-    page_idx_write = 0;
-  }
-  
-  return pages[page_idx_write];    
+bool M3RtLogService::NextEntry()
+{
+	if (++entry_idx>=page_size)
+	{
+		entry_idx=0;
+		return WritePage();
+	}
+	return true;
 }
 
-M3StatusLogPage * M3RtLogService::GetNextPageToRead()
+bool M3RtLogService::WritePartialPage()
 {
-  M3StatusLogPage * next_page;
-  
-  if (is_page_full[page_idx_read])
-  {
-    next_page = pages[page_idx_read];
-    page_idx_read++;
-    if (page_idx_read >= MAX_PAGE_QUEUE)
-    {
-      page_idx_read = 0;
-    }
-  }
-  else
-    next_page = NULL;
-    
-  return next_page;      
+	if (entry_idx==0)
+		return true;
+	page->mutable_entry()->DeleteSubrange(entry_idx,page_size-entry_idx);
+	entry_idx=0;
+	bool ok=WritePage();
+	while (page->entry_size()<page_size)
+		page->add_entry();
+	return ok;
 }
 
-bool M3RtLogService::WritePagesToDisk()
+bool M3RtLogService::ResolveThreshold(M3LogThreshold & t)
 {
-	if (page==NULL)
+	t.idx=-1;
+	t.path.clear();
+	t.index.clear();
+	for(int k=0;k<components.size();k++)
+		if (components[k]->GetName()==t.component)
+			t.idx=k;
+	if (t.idx<0)
+	{
+		M3_WARN("M3RtLogService %s: trigger on %s ignored, component not logged\n",name.c_str(),t.component.c_str());
 		return false;
-	//if (verbose)
-	//  M3_INFO("M3RtLogService Pages: %d\n",pages.size());
-	M3StatusLogPage * p = GetNextPageToRead();	
-	
-	while (p)
-	{				
-		string filename=GetNextFilename(p->entry_size());
-		if (verbose)
-		  M3_DEBUG("Writing logfile %d: %s of size %dK\n",pages_written,filename.c_str(),p->ByteSize()/1024);
-		pages_written++;
-		fstream output(filename.c_str(), ios::out | ios::trunc | ios::binary);
-		if (!p->SerializeToOstream(&output)) 
+	}
+	const google::protobuf::Descriptor * d=components[t.idx]->GetStatus()->GetDescriptor();
+	size_t start=0;
+	while (true)
+	{
+		size_t dot=t.field.find('.',start);
+		string elem=t.field.substr(start,dot==string::npos ? string::npos : dot-start);
+		int i=-1;
+		size_t br=elem.find('[');
+		if (br!=string::npos)
+		{
+			i=atoi(elem.c_str()+br+1);
+			elem=elem.substr(0,br);
+		}
+		const google::protobuf::FieldDescriptor * f=d ? d->FindFieldByName(elem) : NULL;
+		if (f==NULL || f->is_repeated()!=(i>=0) || (dot!=string::npos)!=(f->cpp_type()==google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE)
+			|| f->cpp_type()==google::protobuf::FieldDescriptor::CPPTYPE_STRING)
+		{
+			M3_WARN("M3RtLogService %s: trigger on %s ignored, %s is not a numeric field of its status\n",name.c_str(),t.component.c_str(),t.field.c_str());
+			t.idx=-1;
+			return false;
+		}
+		t.path.push_back(f);
+		t.index.push_back(i);
+		if (dot==string::npos)
+			break;
+		d=f->message_type();
+		start=dot+1;
+	}
+	t.active=false;
+	return true;
+}
+
+bool M3RtLogService::CheckThresholds(M3LogSnapshot * slot, M3Component ** comp)
+{
+	bool fire=false;
+	for (int i=0;i<capture.thresholds.size();i++)
+	{
+		M3LogThreshold & t=capture.thresholds[i];
+		mReal v;
+		if (t.idx<0 || !slot->due[streams[t.idx].gidx] || !GetLogFieldValue(*slot->status[streams[t.idx].slot],t.path,t.index,&v))
+			continue;
+		bool active=t.op>0 ? v>t.value : v<t.value;
+		if (active && !t.active && !fire)
 		{
-			M3_ERR("Failed to write logfile %s.",filename.c_str());
+			fire=true;
+			*comp=components[t.idx];
+		}
+		t.active=active;
+	}
+	return fire;
+}
+
+bool M3RtLogService::BeginCapture(int reason, M3Component * comp)
+{
+	capture_cnt++;
+	capture_first=start_idx+entry_idx;
+	capture_desc=trigger_names[reason];
+	if (comp)
+		capture_desc+=string(" ")+comp->GetName();
+	M3_INFO("M3RtLogService %s: capture %d triggered (%s)\n",name.c_str(),capture_cnt,capture_desc.c_str());
+	//Oldest first
+	for (int i=0;i<hist_count;i++)
+	{
+		int j=(hist_head+history.size()-hist_count+i)%history.size();
+		page->mutable_entry(entry_idx)->Swap(history[j]);
+		if (!NextEntry())
 			return false;
+	}
+	hist_count=0;
+	return true;
+}
+
+bool M3RtLogService::EndCapture()
+{
+	int last=start_idx+entry_idx-1;
+	bool ok=WritePartialPage();
+	ofstream idx_file((path+"/"+name+".captures").c_str(),ios::app);
+	idx_file<<capture_cnt<<" "<<capture_first<<" "<<last<<" "<<capture_desc<<endl;
+	M3_INFO("M3RtLogService %s: capture %d written, entries %d-%d\n",name.c_str(),capture_cnt,capture_first,last);
+	return ok;
+}
+
+bool M3RtLogService::CaptureSnapshot(M3LogSnapshot * slot, long long seq)
+{
+	int reason=-1;
+	M3Component * comp=NULL;
+	M3Component * t_comp=NULL;
+	bool crossed=CheckThresholds(slot,&t_comp);
+#ifdef __cplusplus11__
+	bool pending=trigger_state.load(std::memory_order_acquire)==2;
+#else
+	bool pending=__atomic_load_n(&trigger_state,__ATOMIC_ACQUIRE)==2;
+#endif
+	if (pending && seq>=trigger_seq)
+	{
+		reason=trigger_reason;
+		comp=trigger_comp;
+#ifdef __cplusplus11__
+		trigger_state.store(0,std::memory_order_release);
+#else
+		__atomic_store_n(&trigger_state,0,__ATOMIC_RELEASE);
+#endif
+	}
+	if (reason<0 && crossed)
+	{
+		reason=M3_LOG_TRIGGER_THRESHOLD;
+		comp=t_comp;
+	}
+	if (reason>=0)
+	{
+		if (post_left==0)
+		{
+			if (!BeginCapture(reason,comp))
+				return false;
 		}
-		num_page_write++;		
-		num_kbyte_write+=p->ByteSize()/1024;		
-		MarkPageEmpty();
-		p = GetNextPageToRead();
+		else if (verbose)
+			M3_DEBUG("M3RtLogService %s: capture %d extended (%s)\n",name.c_str(),capture_cnt,trigger_names[reason]);
+		post_left=post_entries+1; //The trigger cycle itself
+	}
+	if (post_left==0)
+	{
+		if (history.empty())
+			return true;
+		EncodeEntry(slot,history[hist_head]);
+		hist_head=(hist_head+1)%history.size();
+		hist_count=MIN(hist_count+1,(int)history.size());
+		return true;
 	}
+	EncodeEntry(slot,page->mutable_entry(entry_idx));
+	if (!NextEntry())
+		return false;
+	if (--post_left==0)
+		return EndCapture();
 	return true;
 }
 
+bool M3RtLogService::Consume(M3LogSnapshot * slot, long long seq)
+{
+	bool due=false;
+	for(int k=0;k<streams.size() && !due;k++)
+		due=slot->due[streams[k].gidx];
+	if (!due)
+		return true;
+	if (capture_mode)
+		return CaptureSnapshot(slot,seq);
+	if (start_cycle<0)
+		start_cycle=slot->cycle;
+	for(int k=0;k<streams.size();k++)
+		if (summary_idx[k]>=0 && slot->due[streams[k].gidx] &&
+			!summary.Add(summary_idx[k],slot->cycle-start_cycle,*slot->status[streams[k].slot]))
+			return false;
+	M3StatusAll * entry=page->mutable_entry(entry_idx);
+	EncodeEntry(slot,entry);
+	if (tail)
+		tail->Push(*entry);
+	if (!to_disk)
+		return true; //The entry is reused
+	return NextEntry();
+}
+
+bool M3RtLogService::Finish()
+{
+	if (failed)
+		return false;
+	if (!to_disk)
+		return true;
+	if (!capture_mode)
+	{
+		bool ok=WritePartialPage();
+		return summary.Finish() && ok;
+	}
+	if (post_left>0)
+	{				
+		M3_INFO("M3RtLogService %s: capture %d cut short by shutdown\n",name.c_str(),capture_cnt);
+		post_left=0;
+		return EndCapture();
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+M3RtLogManager::~M3RtLogManager()
+{
+	RemoveAllSessions();
+	pthread_mutex_destroy(&mutex);
+}
+
+bool M3RtLogManager::StartThread()
+{
+	writer.Startup(sys->GetLogCompression());
+	thread_ready.Reset();
+	thread_stop.Reset();
+	thread_end=false;
+#ifdef __RTAI__
+	hlt=rt_thread_create((void*)log_thread, (void*)this, 10000);
+#else
+	pthread_create((pthread_t *)&hlt, NULL, (void *(*)(void *))log_thread, (void*)this);
+#endif
+	if (thread_ready.Wait(M3_THREAD_START_TIMEOUT_NS)!=M3ReadySignal::READY || !thread_active)
+	{
+		M3_ERR("Unable to start M3RtLogService\n",0);
+		writer.Shutdown();
+		return false;
+	}
+	return true;
+}
+
+void M3RtLogManager::StopThread()
+{
+	thread_end=true;
+	thread_stop.Post(M3ReadySignal::READY);
+#ifdef __RTAI__
+	rt_thread_join(hlt);
+#else
+	pthread_join((pthread_t)hlt, NULL);
+#endif
+	if (thread_active) M3_WARN("M3RtLogService thread did not shut down correctly\n");
+	//Waits for the pages still being compressed
+	if (!writer.Shutdown())
+		M3_WARN("M3RtLogService: some pages could not be written\n");
+	M3_DEBUG("M3RtLogService: %lld KByte on disk\n",writer.GetBytesOut()/1024);
+	snapshots.Clear();
+}
+
+void M3RtLogManager::Detach()
+{
+	sys->RemoveLogService();
+	sys->WaitLogIdle(); // wait in case we were stepping
+}
+
+void M3RtLogManager::Attach()
+{
+	sys->AttachLogService(this);
+}
+
+void M3RtLogManager::Drain()
+{
+	M3LogSnapshot * slot;
+	while ((slot=snapshots.BeginRead())!=NULL)
+	{
+		long long seq=snapshots.GetReadSeq();
+		for (int j=0;j<sessions.size();j++)
+		{
+			M3RtLogService * s=sessions[j];
+			if (!s->failed && !s->Consume(slot,seq))
+			{
+				M3_ERR("M3RtLogService %s: unable to write the log, session stopped\n",s->name.c_str());
+				s->failed=true;
+			}
+		}
+		snapshots.EndRead();
+	}
+}
+
+void M3RtLogManager::Rebuild()
+{
+	int n_streams=0;
+	components.clear();
+	watch_states=false;
+	for (int j=0;j<sessions.size();j++)
+	{
+		M3RtLogService * s=sessions[j];
+		if (s->capture_mode && s->capture.on_state)
+			watch_states=true;
+		for (int k=0;k<s->streams.size();k++)
+		{
+			M3LogStream & st=s->streams[k];
+			st.slot=-1;
+			for (int i=0;i<components.size();i++)
+				if (components[i]==st.component)
+					st.slot=i;
+			if (st.slot<0)
+			{
+				st.slot=components.size();
+				components.push_back(st.component);
+			}
+			st.gidx=n_streams++;
+		}
+	}
+	need.assign(components.size(),0);
+	long long session_bytes=0;
+	mReal hz=0,load=0;
+	for (int j=0;j<sessions.size();j++)
+	{
+		session_bytes+=sessions[j]->buffer_bytes;
+		hz=MAX(hz,sessions[j]->entry_hz);
+		load+=sessions[j]->entry_hz*sessions[j]->encode_ns/1e9;
+	}
+	long long budget=sys->GetLogBufferBytes();
+	int slots=snapshots.Allocate(components, budget-session_bytes, n_streams);
+	long long ring_bytes=slots*snapshots.GetSlotBytes();
+	mReal buffered_s=slots/MAX(hz,1.0);
+	M3_INFO("M3RtLogService: %d snapshots of %lld KB, %.1f MB with the sessions (log_buffer_bytes: %.1f MB), %.0f ms of logging at %.0f Hz\n",
+		slots,snapshots.GetSlotBytes()/1024,(ring_bytes+session_bytes)/1048576.0,budget/1048576.0,buffered_s*1000,hz);
+	if (session_bytes+ring_bytes>budget)
+		M3_WARN("M3RtLogService: log buffers exceed log_buffer_bytes, reduce page sizes or captures\n");
+	if (buffered_s*1e9<2*RT_LOG_WRITER_PERIOD_NS)
+		M3_WARN("M3RtLogService: snapshots cover less than two writer periods, raise log_buffer_bytes\n");
+	if (load>1)
+		M3_WARN("M3RtLogService: encoding needs %.0f%% of the log thread, snapshots will be dropped\n",load*100);
+	watch_state.resize(sys->GetNumComponents());
+	for (int i=0;i<watch_state.size();i++)
+		watch_state[i]=sys->GetComponent(i)->GetState();
+}
+
+bool M3RtLogManager::AddSession(M3RtLogService * s)
+{
+	s->snapshots=&snapshots;
+	s->writer=&writer;
+	if (!s->Startup() || (!thread_active && !StartThread()))
+	{
+		M3_WARN("M3RtLogService %s failed to start\n",s->name.c_str());
+		s->Shutdown();
+		delete s;
+		return false;
+	}
+	Detach();
+	pthread_mutex_lock(&mutex);
+	Drain();
+	sessions.push_back(s);
+	Rebuild();
+	pthread_mutex_unlock(&mutex);
+	Attach();
+	return true;
+}
+
+bool M3RtLogManager::RemoveSession(string name)
+{
+	int idx=-1;
+	for (int j=0;j<sessions.size();j++)
+		if (sessions[j]->name==name)
+			idx=j;
+	if (idx<0)
+		return false;
+	M3RtLogService * s=sessions[idx];
+	Detach();
+	pthread_mutex_lock(&mutex);
+	Drain();
+	s->Finish();
+	sessions.erase(sessions.begin()+idx);
+	if (!sessions.empty())
+		Rebuild();
+	pthread_mutex_unlock(&mutex);
+	if (sessions.empty())
+		StopThread();
+	else
+	{
+		Attach();
+		//The last pages of s are on disk when this returns
+		pthread_mutex_lock(&mutex);
+		writer.Flush();
+		pthread_mutex_unlock(&mutex);
+	}
+	s->Shutdown();
+	delete s;
+	return true;
+}
+
+void M3RtLogManager::RemoveAllSessions()
+{
+	while (!sessions.empty())
+		RemoveSession(sessions.back()->name);
+}
+
+bool M3RtLogManager::IsSessionRunning(string name)
+{
+	for (int j=0;j<sessions.size();j++)
+		if (sessions[j]->name==name)
+			return true;
+	return false;
+}
+
+vector<string> M3RtLogManager::GetSessionNames()
+{
+	vector<string> names;
+	for (int j=0;j<sessions.size();j++)
+		names.push_back(sessions[j]->name);
+	return names;
+}
+
+bool M3RtLogManager::Step()
+{
+	long long c=cycle++;
+	if (watch_states)
+		for (int i=0;i<watch_state.size();i++)
+		{
+			M3Component * c=sys->GetComponent(i);
+			int s=c->GetState();
+			if (s!=watch_state[i] && (s==M3COMP_STATE_ERR || s==M3COMP_STATE_SAFEOP))
+				Trigger(M3_LOG_TRIGGER_STATE,c);
+			watch_state[i]=s;
+		}
+	int n_due=0;
+	for (int j=0;j<sessions.size();j++)
+	{
+		vector<M3LogStream> & streams=sessions[j]->streams;
+		for(int k=0;k<streams.size();k++)
+		{
+			M3LogStream & st=streams[k];
+			st.due=(st.cnt==0);
+			if (st.due)
+			{
+				st.cnt=st.rate;
+				need[st.slot]=1;
+				n_due++;
+			}
+			else
+				st.cnt--;
+		}
+	}
+	if (n_due==0)
+		return true;
+	M3LogSnapshot * slot = snapshots.BeginWrite();
+	if (slot!=NULL) //Else the writer is behind, reported from its thread
+	{
+		for(int k=0;k<components.size();k++)
+		{
+			slot->present[k]=need[k];
+			if (need[k])
+				slot->status[k]->CopyFrom(*components[k]->GetStatus());
+		}
+		for (int j=0;j<sessions.size();j++)
+		{
+			vector<M3LogStream> & streams=sessions[j]->streams;
+			for(int k=0;k<streams.size();k++)
+				slot->due[streams[k].gidx]=streams[k].due;
+		}
+		slot->cycle=c;
+		snapshots.EndWrite();
+	}
+	for(int k=0;k<need.size();k++)
+		need[k]=0;
+	return true;
+}
+
+void M3RtLogManager::Trigger(int reason, M3Component * comp)
+{
+	for (int j=0;j<sessions.size();j++)
+		sessions[j]->Trigger(reason,comp);
+}
+
+bool M3RtLogManager::TriggerSession(string name)
+{
+	bool triggered=false;
+	pthread_mutex_lock(&mutex);
+	for (int j=0;j<sessions.size();j++)
+		if (name.empty() || sessions[j]->name==name)
+			triggered=sessions[j]->Trigger(M3_LOG_TRIGGER_API) || triggered;
+	pthread_mutex_unlock(&mutex);
+	return triggered;
+}
+
+bool M3RtLogManager::WriteSnapshots()
+{
+	pthread_mutex_lock(&mutex);
+	long long dropped=snapshots.GetDropped();
+	if (dropped!=dropped_reported)
+	{				
+		M3_ERR("M3RtLogService: %lld snapshots dropped, the writer falls behind\n",dropped-dropped_reported);
+		dropped_reported=dropped;
+	}
+	Drain();
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+pthread_mutex_t M3LogTailBuffer::registry_mutex=PTHREAD_MUTEX_INITIALIZER;
+vector<M3LogTailBuffer *> M3LogTailBuffer::registry;
+
+M3LogTailBuffer * M3LogTailBuffer::Create(const string & session, int num_entries)
+{
+	M3LogTailBuffer * b=new M3LogTailBuffer(session,MAX(1,num_entries));
+	pthread_mutex_lock(&registry_mutex);
+	registry.push_back(b);
+	pthread_mutex_unlock(&registry_mutex);
+	return b;
+}
+
+M3LogTailBuffer * M3LogTailBuffer::Acquire(const string & session)
+{
+	M3LogTailBuffer * b=NULL;
+	pthread_mutex_lock(&registry_mutex);
+	for (int i=registry.size()-1;i>=0 && b==NULL;i--)
+		if (registry[i]->session==session)
+			b=registry[i];
+	if (b)
+		b->refs++;
+	pthread_mutex_unlock(&registry_mutex);
+	return b;
+}
+
+void M3LogTailBuffer::Release(M3LogTailBuffer * b)
+{
+	pthread_mutex_lock(&registry_mutex);
+	bool last=(--b->refs==0);
+	if (last)
+		for (int i=0;i<registry.size();i++)
+			if (registry[i]==b)
+			{
+				registry.erase(registry.begin()+i);
+				break;
+			}
+	pthread_mutex_unlock(&registry_mutex);
+	if (last)
+		delete b;
+}
+
+void M3LogTailBuffer::Push(const M3StatusAll & entry)
+{
+	pthread_mutex_lock(&mutex);
+	//The slot keeps its capacity, no allocation once the buffer went round
+	if (!entry.SerializeToString(&entries[next_seq%entries.size()]))
+		entries[next_seq%entries.size()].clear();
+	next_seq++;
+	pthread_mutex_unlock(&mutex);
+}
+
+void M3LogTailBuffer::Close()
+{
+	pthread_mutex_lock(&mutex);
+	closed=true;
+	pthread_mutex_unlock(&mutex);
+}
+
+long long M3LogTailBuffer::Read(long long seq, int max, M3LogTail * tail)
+{
+	pthread_mutex_lock(&mutex);
+	long long oldest=MAX(0,next_seq-(long long)entries.size());
+	tail->set_session(session);
+	if (seq<oldest)
+	{
+		tail->set_dropped(oldest-seq);
+		seq=oldest;
+	}
+	seq=MIN(seq,next_seq);
+	tail->set_first_seq(seq);
+	int n=(int)MIN((long long)max,next_seq-seq);
+	for (int i=0;i<n;i++)
+		tail->add_entry(entries[(seq+i)%entries.size()]);
+	seq+=n;
+	if (closed && seq==next_seq)
+		tail->set_end(true);
+	pthread_mutex_unlock(&mutex);
+	return seq;
+}
+
+long long M3LogTailBuffer::GetNextSeq()
+{
+	pthread_mutex_lock(&mutex);
+	long long s=next_seq;
+	pthread_mutex_unlock(&mutex);
+	return s;
+}
+
+////////////////////////////////////////////////////////////
+int M3LogSnapshotRing::Allocate(vector<M3Component *> & components, long long budget_bytes, int num_streams)
+{
+	Clear();
+	//The status is read while the rt thread may step, as the page allocation did before
+	vector<google::protobuf::Message*> primed;
+	for(int k=0;k<components.size();k++)
+	{
+		google::protobuf::Message * m=components[k]->GetStatus()->New();
+		m->CopyFrom(*components[k]->GetStatus());
+		primed.push_back(m);
+	}
+	slot_bytes=sizeof(M3LogSnapshot)+num_streams+primed.size()*(sizeof(void*)+1);
+	for(int k=0;k<primed.size();k++)
+		slot_bytes+=GetSpaceUsed(*primed[k]);
+	int num_slots=(int)CLAMP(budget_bytes/slot_bytes,(long long)RT_LOG_SNAPSHOT_MIN_SLOTS,(long long)RT_LOG_SNAPSHOT_MAX_SLOTS);
+	slots.resize(num_slots);
+	for (int i=0;i<num_slots;i++)
+	{
+		for(int k=0;k<primed.size();k++)
+		{
+			google::protobuf::Message * m=primed[k]->New();
+			m->CopyFrom(*primed[k]);
+			slots[i].status.push_back(m);
+		}
+		slots[i].present.assign(primed.size(),0);
+		slots[i].due.assign(num_streams,0);
+		slots[i].cycle=0;
+	}
+	for(int k=0;k<primed.size();k++)
+		delete primed[k];
+	written_local=consumed_local=Load(written);
+	Store(consumed,written_local);
+	return num_slots;
+}
+
+void M3LogSnapshotRing::Clear()
+{
+	for (int i=0;i<slots.size();i++)
+		for(int k=0;k<slots[i].status.size();k++)
+			delete slots[i].status[k];
+	slots.clear();
+}
+
+M3LogSnapshot * M3LogSnapshotRing::BeginWrite()
+{
+	written_local=Load(written);
+	if (slots.empty() || written_local-Load(consumed)>=(long long)slots.size())
+	{
+		Store(dropped,Load(dropped)+1);
+		return NULL;
+	}
+	return &slots[written_local%slots.size()];
+}
+
+M3LogSnapshot * M3LogSnapshotRing::BeginRead()
+{
+	consumed_local=Load(consumed);
+	if (consumed_local>=Load(written))
+		return NULL;
+	return &slots[consumed_local%slots.size()];
+}
 	
 }
@@ -23,7 +23,14 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include "m3rt/base/component.h"
 #include "m3rt/base/component_base.pb.h"
 #include "m3rt/base/toolbox.h"
+#include "m3rt/rt_system/log_codec.h"
+#include "m3rt/rt_system/log_summary.h"
 #include <string>
+#include <vector>
+#include <map>
+#ifdef __cplusplus11__
+#include <atomic>
+#endif
 
 #ifdef __RTAI__
 #ifdef __cplusplus
@@ -40,80 +47,354 @@ extern "C" {
 namespace m3rt
 {
 
-#define MAX_PAGE_QUEUE 300 //In case log service not stopped properly, force shutdown
+/**
+ * @brief One sampled cycle: a status copy per logged component, only valid where present is set.
+ * A component logged by several sessions is copied once.
+ *
+ */
+struct M3LogSnapshot
+{
+    std::vector<google::protobuf::Message *> status;
+    std::vector<char> present;
+    std::vector<char> due; /**< Per stream (M3LogStream::gidx): sampled for its session */
+    long long cycle; /**< rt cycles since the log started */
+};
 
 /**
- * @brief
+ * @brief Status snapshots handed from the rt thread (single producer) to the log writer (single consumer).
+ * A slot holds one copy of the status message of every logged component, allocated up front.
  *
  */
-class M3RtLogService
+class M3LogSnapshotRing
 {
 public:
-	M3RtLogService(M3RtSystem * s, std::string n, std::string p, mReal freq,int ps,int vb):
-		sys(s),name(n),path(p),start_idx(0),page(NULL),entry(NULL),page_size(ps),verbose(vb),num_page_write(0),num_kbyte_write(0),num_kbytes_in_buffer(0),entry_idx(0),page_idx_read(0),page_idx_write(0),pages_written(0)
-	{
-		downsample_rate = MAX(0,((int)((mReal)RT_TASK_FREQUENCY)/freq)-1); 
-		downsample_cnt=0;
-	}
+    M3LogSnapshotRing():written(0),consumed(0),dropped(0),written_local(0),consumed_local(0),slot_bytes(0){}
+    ~M3LogSnapshotRing(){Clear();}
+    /**
+     * @brief Allocate as many slots as budget_bytes holds (RT_LOG_SNAPSHOT_MIN_SLOTS to
+     * RT_LOG_SNAPSHOT_MAX_SLOTS), each message primed with the current status so that
+     * copying into it does not allocate. Must be empty (consumed), sequence numbers carry on.
+     *
+     * @param components
+     * @param budget_bytes
+     * @param num_streams
+     * @return int Slots allocated
+     */
+    int Allocate(std::vector<M3Component *> & components, long long budget_bytes, int num_streams);
     /**
      * @brief
      *
-     * @return bool
      */
-    bool Startup();					//Called by M3RtService
+    void Clear();
     /**
      * @brief
      *
+     * @return M3LogSnapshot * Slot to fill, NULL if the writer is behind (counted as dropped)
      */
-    void Shutdown();				//Called by M3RtService
+    M3LogSnapshot * BeginWrite();
     /**
      * @brief
      *
-     * @return bool
      */
-    bool WritePagesToDisk();			//Called by M3RtLogService thread
+    void EndWrite(){Store(written, written_local+1);}
     /**
      * @brief
      *
-     * @param name
+     * @return M3LogSnapshot * Oldest slot not consumed, NULL if none
      */
-    void AddComponent(std::string name);			//Called by M3RtService
+    M3LogSnapshot * BeginRead();
     /**
      * @brief
      *
-     * @return bool
      */
-    bool Step();					//Called by M3RtSystem
+    void EndRead(){Store(consumed, consumed_local+1);}
     /**
      * @brief
      *
-     * @param final
-     * @return bool
+     * @return long long Snapshots lost
+     */
+    long long GetDropped(){return Load(dropped);}
+    /**
+     * @brief
+     *
+     * @return long long Sequence number the next written slot gets
+     */
+    long long GetWritten(){return Load(written);}
+    /**
+     * @brief
+     *
+     * @return long long Sequence number of the slot returned by BeginRead()
+     */
+    long long GetReadSeq(){return consumed_local;}
+    /**
+     * @brief
+     *
+     * @return long long Memory of a slot, as of Allocate
+     */
+    long long GetSlotBytes(){return slot_bytes;}
+private:
+#ifdef __cplusplus11__
+    typedef std::atomic<long long> counter_t;
+    static long long Load(counter_t & c){return c.load(std::memory_order_acquire);}
+    static void Store(counter_t & c, long long v){c.store(v, std::memory_order_release);}
+#else
+    typedef long long counter_t;
+    static long long Load(counter_t & c){return __atomic_load_n(&c, __ATOMIC_ACQUIRE);}
+    static void Store(counter_t & c, long long v){__atomic_store_n(&c, v, __ATOMIC_RELEASE);}
+#endif
+    std::vector<M3LogSnapshot> slots;
+    counter_t written;
+    counter_t consumed;
+    counter_t dropped;
+    long long written_local; /**< rt thread */
+    long long consumed_local; /**< Writer thread */
+    long long slot_bytes; 
+};
+
+/**
+ * @brief Status fields kept in the log, by name. A field without children is kept whole,
+ * an empty mask keeps the whole message.
+ *
+ */
+struct M3LogFieldMask
+{
+    std::map<std::string, M3LogFieldMask> fields;
+};
+
+/**
+ * @brief A logged component: its own sample rate and field mask.
+ *
+ */
+struct M3LogStream
+{
+    M3LogStream():component(NULL),rate(0),cnt(0),due(false),slot(0),gidx(0),scratch(NULL){}
+    M3Component * component;
+    int rate; /**< rt cycles skipped between samples */
+    int cnt;
+    bool due;
+    int slot; /**< Status in the shared snapshot */
+    int gidx; /**< Due flag in the shared snapshot */
+    M3LogFieldMask mask;
+    google::protobuf::Message * scratch; /**< Masked copy, writer thread */
+};
+
+enum M3LogTriggerReason
+{
+    M3_LOG_TRIGGER_API = 0,   /**< M3RtService::TriggerLogCapture */
+    M3_LOG_TRIGGER_STATE,     /**< A component went to ERR or SAFEOP */
+    M3_LOG_TRIGGER_OVERRUN,   /**< The rt cycle took longer than its period */
+    M3_LOG_TRIGGER_THRESHOLD  /**< M3LogThreshold crossed */
+};
+
+/**
+ * @brief Fires a capture when a numeric status field of a logged component crosses value.
+ *
+ */
+struct M3LogThreshold
+{
+    M3LogThreshold():op(1),value(0),idx(-1),active(false){}
+    std::string component;
+    std::string field; /**< Dotted path, name[i] for an element of a repeated field */
+    int op; /**< 1: fires going above value, -1: going below */
+    mReal value;
+    int idx; /**< In the logged components, resolved at Startup */
+    std::vector<const google::protobuf::FieldDescriptor *> path;
+    std::vector<int> index; /**< Element of each path entry, -1 if not repeated */
+    bool active; /**< Condition held on the last sample, fires on the edge only */
+};
+
+/**
+ * @brief Triggered capture: entries are kept in memory only, a trigger writes the pre_s seconds
+ * before it and the post_s seconds after it. A trigger during the post window extends it.
+ *
+ */
+struct M3LogCaptureConfig
+{
+    M3LogCaptureConfig():pre_s(0),post_s(0),on_state(true),on_overrun(true){}
+    mReal pre_s;
+    mReal post_s; /**< Both 0: continuous logging */
+    bool on_state;
+    bool on_overrun;
+    std::vector<M3LogThreshold> thresholds;
+};
+
+/**
+ * @brief Last entries of a log session, serialized, for the data port subscribers (M3CONTROL_LOG_TAIL).
+ * Filled by the log thread, read by the data service threads. Buffers are found by session name
+ * and stay readable once the session stopped, until the last reader releases them.
+ *
+ */
+class M3LogTailBuffer
+{
+public:
+    /**
+     * @brief Registered under session, released by the caller.
+     *
+     * @param session
+     * @param num_entries Entries kept, older ones are lost to the readers
+     * @return M3LogTailBuffer *
      */
-    bool WriteEntry(bool final);
+    static M3LogTailBuffer * Create(const std::string & session, int num_entries);
     /**
      * @brief
      *
-     * @return M3StatusLogPage
+     * @param session
+     * @return M3LogTailBuffer * Latest buffer of session, NULL if none
      */
-    M3StatusLogPage * GetNextPageToRead();
+    static M3LogTailBuffer * Acquire(const std::string & session);
     /**
      * @brief
      *
-     * @return M3StatusLogPage
+     * @param b
      */
-    M3StatusLogPage * GetNextPageToWrite();
+    static void Release(M3LogTailBuffer * b);
     /**
      * @brief
      *
+     * @param entry
+     */
+    void Push(const M3StatusAll & entry);
+    /**
+     * @brief No more entries, the readers get end once they have read them all.
+     *
+     */
+    void Close();
+    /**
+     * @brief Copy at most max entries from seq on. Starts at the oldest entry kept (dropped set)
+     * if seq is older.
+     *
+     * @param seq
+     * @param max
+     * @param tail
+     * @return long long Sequence number of the next entry to read
      */
-    void MarkPageEmpty();
+    long long Read(long long seq, int max, M3LogTail * tail);
     /**
      * @brief
      *
+     * @return long long Sequence number the next pushed entry gets
      */
-    void MarkPageFull();
+    long long GetNextSeq();
 private:
+    M3LogTailBuffer(const std::string & s, int num_entries):session(s),entries(num_entries),next_seq(0),closed(false),refs(1){
+        pthread_mutex_init(&mutex,NULL);
+    }
+    ~M3LogTailBuffer(){pthread_mutex_destroy(&mutex);}
+    std::string session;
+    std::vector<std::string> entries;
+    long long next_seq;
+    bool closed;
+    int refs; /**< registry_mutex */
+    pthread_mutex_t mutex;
+    static pthread_mutex_t registry_mutex;
+    static std::vector<M3LogTailBuffer *> registry;
+};
+
+/**
+ * @brief A log session: logs the status of a set of components to path/name_<first>_<last>.pb.log,
+ * one M3StatusLogPage of page_size entries per file (.lz4/.zst appended when compressed, see
+ * log_compression in m3_config.yml). Sessions run under M3RtLogManager, the rt thread only
+ * copies the status into the shared snapshot, serialization, compression and file I/O happen
+ * on the log thread.
+ * Each component is sampled at its own rate (the session rate by default): an entry holds the
+ * components sampled in that cycle only, they are told apart by name and aligned by base.timestamp.
+ * In capture mode (SetCapture) nothing reaches the disk until a trigger, each capture is listed
+ * in path/name.captures (number, first and last entry, reason).
+ * Outside capture mode, a min/max/mean summary of each numeric field is also written per
+ * log_summary period (M3LogSummaryWriter), for plots of long runs without reading every page.
+ * With SetTail, the last entries are also kept for the data port subscribers (M3LogTailBuffer),
+ * optionally without writing anything to disk.
+ *
+ */
+class M3RtLogService
+{
+public:
+	M3RtLogService(M3RtSystem * s, std::string n, std::string p, mReal freq,int ps,int vb):
+		sys(s),name(n),path(p),snapshots(NULL),writer(NULL),start_idx(0),page(NULL),page_size(ps),verbose(vb),num_page_write(0),num_kbyte_write(0),entry_idx(0),pages_written(0),failed(false),
+		capture_mode(false),pre_entries(0),post_entries(0),hist_head(0),hist_count(0),post_left(0),capture_cnt(0),capture_first(0),
+		trigger_state(0),trigger_seq(0),trigger_reason(0),trigger_comp(NULL),start_cycle(-1),
+		tail(NULL),tail_entries(0),to_disk(true),entry_hz(0),entry_bytes(0),buffer_bytes(0),encode_ns(0)
+	{
+		downsample_rate = MAX(0,((int)((mReal)RT_TASK_FREQUENCY)/freq)-1); 
+	}
+    /**
+     * @brief Allocate the pages.
+     *
+     * @return bool
+     */
+    bool Startup();					//Called by M3RtLogManager
+    /**
+     * @brief
+     *
+     */
+    void Shutdown();				//Called by M3RtLogManager
+    /**
+     * @brief Encode a snapshot into the page if the session sampled that cycle, write the page
+     * out once full.
+     *
+     * @param slot
+     * @param seq Sequence number of slot
+     * @return bool
+     */
+    bool Consume(M3LogSnapshot * slot, long long seq);	//Called by the log thread
+    /**
+     * @brief Write the last partial page (or capture).
+     *
+     * @return bool
+     */
+    bool Finish();	//Called by M3RtLogManager
+    /**
+     * @brief
+     *
+     * @param name
+     * @param freq Hz, 0: rate of the session
+     * @param fields Status fields kept (dotted for nested messages), empty: all
+     */
+    void AddComponent(std::string name, mReal freq=0, const std::vector<std::string> & fields=std::vector<std::string>());	//Called by M3RtService
+    /**
+     * @brief
+     *
+     * @return std::string
+     */
+    std::string GetName(){return name;}
+    /**
+     * @brief Switch to triggered capture, before Startup.
+     *
+     * @param c
+     */
+    void SetCapture(const M3LogCaptureConfig & c){capture=c;capture_mode=(c.pre_s>0 || c.post_s>0);}
+    /**
+     * @brief Keep the last num_entries entries for tail subscribers, before Startup. Continuous logging only.
+     *
+     * @param num_entries 0: no tail
+     * @param disk False: the tail only, no page or summary written
+     */
+    void SetTail(int num_entries, bool disk){tail_entries=num_entries;to_disk=disk || num_entries<=0;}
+    /**
+     * @brief Fire a capture, from any thread. The rt cycle it is called in is the trigger point.
+     *
+     * @param reason M3LogTriggerReason
+     * @param comp Component involved, can be NULL
+     * @return bool False if not in capture mode or a trigger is already pending
+     */
+    bool Trigger(int reason, M3Component * comp=NULL);
+private:
+    friend class M3RtLogManager;
+    bool EncodeEntry(M3LogSnapshot * slot, M3StatusAll * entry);
+    bool NextEntry();
+    bool WritePartialPage();
+    void EstimateBuffers();
+    bool ResolveThreshold(M3LogThreshold & t);
+    bool CheckThresholds(M3LogSnapshot * slot, M3Component ** comp);
+    bool CaptureSnapshot(M3LogSnapshot * slot, long long seq);
+    bool BeginCapture(int reason, M3Component * comp);
+    bool EndCapture();
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool WritePage();
 	
     /**
      * @brief
@@ -124,25 +405,157 @@ private:
     std::string GetNextFilename(int num_entry);
     std::string name; 
     std::string path; 
-    M3StatusAll * entry; 
-    std::vector<M3StatusLogPage*> pages; 
-    std::vector<bool> is_page_full; 
+    M3LogSnapshotRing * snapshots; /**< Shared, set by M3RtLogManager */
+    std::vector<M3LogStream> streams; /**< Parallel to components */
+    M3LogPageWriter * writer; /**< Shared, set by M3RtLogManager */
+    std::string page_buf; /**< Serialized page handed to the writer */
     std::vector<M3Component *> components; 
     int start_idx; 
-    int downsample_cnt; 
     int downsample_rate; 
     M3StatusLogPage * page; 
     M3RtSystem * sys; 
     int page_size; 
-    int hlt; 
     int verbose; 
     int num_page_write; 
     int num_kbyte_write; 
-    int num_kbytes_in_buffer; 
-    int entry_idx; 
-    int page_idx_write; 
-    int page_idx_read; 
+    int entry_idx; /**< Entries of page filled, writer thread */
     int pages_written; 
+    bool failed; /**< A page could not be written, the session stopped logging */
+    M3LogCaptureConfig capture; 
+    bool capture_mode; 
+    std::vector<M3StatusAll *> history; /**< Pre-trigger entries, writer thread */
+    int pre_entries; 
+    int post_entries; 
+    int hist_head; 
+    int hist_count; 
+    int post_left; /**< Entries still to write for the current capture, 0: armed */
+    int capture_cnt; 
+    int capture_first; 
+    std::string capture_desc; 
+#ifdef __cplusplus11__
+    std::atomic<int> trigger_state; /**< 0: none, 1: being posted, 2: pending */
+#else
+    int trigger_state; 
+#endif
+    long long trigger_seq; 
+    int trigger_reason; 
+    M3Component * trigger_comp; 
+    M3LogSummaryWriter summary; 
+    std::vector<int> summary_idx; /**< Per stream, -1: not summarized */
+    long long start_cycle; /**< Of the first snapshot consumed, summary bins count from it */
+    M3LogTailBuffer * tail; 
+    int tail_entries; 
+    bool to_disk; 
+    mReal entry_hz; /**< Rate of the fastest stream */
+    long long entry_bytes; /**< Estimated at Startup, from the current status */
+    long long buffer_bytes; /**< Page, serialized page, capture history and tail */
+    long long encode_ns; /**< Measured for one entry at Startup */
+};
+
+/**
+ * @brief Runs the log sessions. Every rt cycle, the status of the components due in any session
+ * is copied once into a shared snapshot. A single log thread encodes each snapshot for the
+ * sessions that sampled it and writes their pages. Adding or removing a session detaches the
+ * log from the rt system for the time it takes to reallocate the snapshots.
+ * Memory is bounded by log_buffer_bytes (m3_config.yml): the buffers of the sessions are taken
+ * from it first, the snapshots get the rest.
+ *
+ */
+class M3RtLogManager
+{
+public:
+    M3RtLogManager(M3RtSystem * s):sys(s),watch_states(false),cycle(0),dropped_reported(0),hlt(0),thread_active(false),thread_end(false){
+        pthread_mutex_init(&mutex,NULL);
+    }
+    ~M3RtLogManager();
+    /**
+     * @brief Start a session, owned by the manager from then on (deleted if it fails).
+     *
+     * @param s
+     * @return bool
+     */
+    bool AddSession(M3RtLogService * s);	//Called by M3RtService
+    /**
+     * @brief Stop a session once its last page is written.
+     *
+     * @param name
+     * @return bool False if not found
+     */
+    bool RemoveSession(std::string name);	//Called by M3RtService
+    /**
+     * @brief
+     *
+     */
+    void RemoveAllSessions();
+    /**
+     * @brief
+     *
+     * @return int
+     */
+    int GetNumSessions(){return sessions.size();}
+    /**
+     * @brief
+     *
+     * @param name
+     * @return bool
+     */
+    bool IsSessionRunning(std::string name);
+    /**
+     * @brief
+     *
+     * @return std::vector<std::string>
+     */
+    std::vector<std::string> GetSessionNames();
+    /**
+     * @brief Sample the sessions and fill the next snapshot.
+     *
+     * @return bool
+     */
+    bool Step();					//Called by M3RtSystem
+    /**
+     * @brief Trigger the capture sessions, rt thread.
+     *
+     * @param reason M3LogTriggerReason
+     * @param comp Can be NULL
+     */
+    void Trigger(int reason, M3Component * comp=NULL);
+    /**
+     * @brief Trigger a capture session from another thread.
+     *
+     * @param name Empty: all sessions
+     * @return bool False if no capture was triggered
+     */
+    bool TriggerSession(std::string name);
+    /**
+     * @brief Encode the pending snapshots for every session.
+     *
+     * @return bool
+     */
+    bool WriteSnapshots();			//Called by the log thread
+private:
+    friend void * log_thread(void * arg);
+    bool StartThread();
+    void StopThread();
+    void Detach();
+    void Attach();
+    void Drain();
+    void Rebuild();
+    M3RtSystem * sys; 
+    std::vector<M3RtLogService *> sessions; 
+    std::vector<M3Component *> components; /**< Union of the components of the sessions */
+    std::vector<char> need; /**< Components due this cycle, rt thread */
+    std::vector<int> watch_state; /**< Last state of every component, rt thread */
+    bool watch_states; 
+    long long cycle; /**< rt thread */
+    M3LogSnapshotRing snapshots; 
+    M3LogPageWriter writer; 
+    pthread_mutex_t mutex; /**< sessions and snapshot layout, against the log thread */
+    long long dropped_reported; 
+    int hlt; 
+    bool thread_active; 
+    bool thread_end; 
+    M3ReadySignal thread_ready; 
+    M3ReadySignal thread_stop; /**< Cuts the wait between page writes short on StopThread */
 };
 
 }
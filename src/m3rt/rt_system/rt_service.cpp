@@ -26,6 +26,9 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 
 static bool svc_thread_active=false;
 static bool svc_thread_end=false;
+static m3rt::M3ReadySignal svc_thread_ready;
+static m3rt::M3ReadySignal svc_thread_stop; //Posted by Shutdown, wakes up the monitoring loop
+static m3rt::M3ReadySignal svc_thread_exit;
 //////////////////////////////////////////////////////////////////////////////////////
 //Monitor services for errors, etc
 static void* service_thread(void * arg)
@@ -33,10 +36,13 @@ static void* service_thread(void * arg)
     M3RtService * svc = (M3RtService *)arg;
     svc_thread_end=false;
     m3rt::M3_INFO("Running Service Thread\n");
+    svc_thread_active=true;
+    m3rt::ApplyThreadPlacement(m3rt::M3_THREAD_SERVICE, "service");
+    svc_thread_ready.Post(m3rt::M3ReadySignal::READY);
     while(!svc_thread_end)
     {
-	svc_thread_active=true;
-        usleep(100000);
+        if (svc_thread_stop.Wait(100000000) != m3rt::M3ReadySignal::PENDING) //10Hz
+            break;
         if (svc->IsDataServiceError())
         {
             m3rt::M3_ERR("Detected dropped M3RtDataService. Stopping RtSystem;\n");
@@ -47,6 +53,7 @@ static void* service_thread(void * arg)
     }
     m3rt::M3_INFO("Exiting M3 Service Thread\n",0);
     svc_thread_active=false;
+    svc_thread_exit.Post(m3rt::M3ReadySignal::READY);
     return 0;
 }
 //////////////////////////////////////////////////////////////////////////////////////
@@ -61,10 +68,16 @@ bool M3RtService::IsServiceThreadActive()
 }
 bool M3RtService::Startup()
 {
+    m3rt::M3LogStartup(); //Keep terminal I/O off the rt thread
+    m3rt::ReadThreadPlacement(); //Before the threads start, the log writer is placed afterwards
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
     if(!factory.Startup()){
       m3rt::M3_ERR("Factory failed to start, exiting.\n");
       return false;
     }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    m3rt::M3_INFO("Component libraries loaded in %.1f ms\n", (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
 #ifdef __RTAI__
     // A.H: This one is absolutely necessary as it's should be in the main thread
     rt_allow_nonroot_hrt();
@@ -74,6 +87,9 @@ bool M3RtService::Startup()
         m3rt::M3_ERR("M3RtService thread already active\n");
         return false;
     }
+    svc_thread_ready.Reset();
+    svc_thread_stop.Reset();
+    svc_thread_exit.Reset();
 #ifdef __RTAI__
     	long int hst=rt_thread_create((void*)service_thread, (void*)this, 1000000);
         long ret = (hst!=0 ? 0:-1);
@@ -81,12 +97,12 @@ bool M3RtService::Startup()
         long ret=pthread_create((pthread_t *)&hlt, NULL, &service_thread, (void*)this);
 #endif
 
-    usleep(100000);
     if (ret != 0) //A.H : ie there was an error initializing the thread
     {
         m3rt::M3_ERR("Unable to start M3RtService\n");
         return false;
     }
+    svc_thread_ready.Wait(M3_THREAD_START_TIMEOUT_NS);
     return svc_thread_active;
 }
 
@@ -94,17 +110,12 @@ void M3RtService::Shutdown()
 {
     m3rt::M3_INFO("Begin shutdown of M3RtService...\n");
     svc_thread_end=true;
-    void *end;
-    float timeout_s = 4;
-    time_t start_time=time(0);
-    usleep(500000);
-    while(svc_thread_active && (float)difftime(time(0),start_time) < timeout_s)
-    {
-        m3rt::M3_INFO("Waiting for Service thread to shutdown... (%.2fs/%.2fs)\n",(float)difftime(time(0),start_time) ,timeout_s);
-        usleep(500000);
-    }
+    svc_thread_stop.Post(m3rt::M3ReadySignal::READY);
+    if(svc_thread_active && svc_thread_exit.Wait(M3_THREAD_STOP_TIMEOUT_NS) == m3rt::M3ReadySignal::PENDING)
+        m3rt::M3_WARN("M3RtService thread did not shutdown correctly\n");
     RemoveRtSystem();
     m3rt::M3_INFO("Shutdown of M3RtService complete.\n");
+    m3rt::M3LogShutdown();
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
@@ -130,6 +141,7 @@ int M3RtService::AttachRtSystem()
         num_rtsys_attach=0;
         return 0;
     }
+    m3rt::PrintThreadPlacement();
 
     return ++num_rtsys_attach;
 }
@@ -171,43 +183,105 @@ int M3RtService::RemoveRtSystem()
 //////////////////////////////////////////////////////////////////////////////////////
 bool M3RtService::AttachLogService(std::string name, std::string path, double freq,int page_size,int verbose)
 {
-    m3rt::M3_DEBUG("Attaching M3RtLogService: %s\n",name);
-    if (rt_system==NULL || IsLogServiceRunning())
+    m3rt::M3_DEBUG("Attaching M3RtLogService: %s\n",name.c_str());
+    if (rt_system==NULL || IsLogSessionRunning(name))
         return false;
-    log_service = new m3rt::M3RtLogService(rt_system,std::string(name),std::string(path),freq,page_size,verbose);
+    m3rt::M3RtLogService * log_service = new m3rt::M3RtLogService(rt_system,std::string(name),std::string(path),freq,page_size,verbose);
     for(int i=0;i<log_components.size();i++)
-        log_service->AddComponent(log_components[i]);
-    if (!log_service->Startup())
+        log_service->AddComponent(log_components[i],log_component_freq[i],log_component_fields[i]);
+    log_service->SetCapture(log_capture);
+    log_service->SetTail(log_tail_entries,log_tail_disk);
+    ClearLogComponents(); //Staged for the next session
+    if (log_manager==NULL)
+        log_manager=new m3rt::M3RtLogManager(rt_system);
+    if (!log_manager->AddSession(log_service))
     {
-        m3rt::M3_WARN("M3RtLogService %s failed to start\n",name);
-        log_service->Shutdown();
-        delete log_service;
-        log_service=NULL;
-        log_components.clear();
+        if (log_manager->GetNumSessions()>0)
+            return false; //Leave the other sessions running
+        delete log_manager;
+        log_manager=NULL;
         m3rt::M3_WARN("Shutting down RTSystem due to RtLogService startup failure\n");
         RemoveRtSystem();
         return false;
     }
-    rt_system->AttachLogService(log_service);
     return true;
 }
 
+bool M3RtService::SetLogCapture(double pre_s, double post_s, bool on_state, bool on_overrun)
+{
+    if (pre_s<0 || post_s<0)
+        return false;
+    log_capture.pre_s=pre_s;
+    log_capture.post_s=post_s;
+    log_capture.on_state=on_state;
+    log_capture.on_overrun=on_overrun;
+    log_capture.thresholds.clear();
+    return true;
+}
+
+bool M3RtService::AddLogTrigger(std::string name, std::string field, std::string op, double value)
+{
+    m3rt::M3LogThreshold t;
+    if (op.compare(">")==0)
+        t.op=1;
+    else if (op.compare("<")==0)
+        t.op=-1;
+    else
+    {
+        m3rt::M3_WARN("Log trigger on %s: unknown operator %s\n",name.c_str(),op.c_str());
+        return false;
+    }
+    t.component=name;
+    t.field=field;
+    t.value=value;
+    log_capture.thresholds.push_back(t);
+    return true;
+}
+
+bool M3RtService::TriggerLogCapture(std::string name)
+{
+    if (!IsLogServiceRunning())
+        return false;
+    return log_manager->TriggerSession(name);
+}
+
 bool M3RtService::RemoveLogService()
 {
     if (IsLogServiceRunning())
     {
-        rt_system->RemoveLogService();
-        while (rt_system->logging); // wait in case we were stepping
-        log_service->Shutdown();
-        delete log_service;
-        log_components.clear();
-        log_service=NULL;
+        delete log_manager; //Stops all the sessions
+        ClearLogComponents();
+        log_manager=NULL;
         return true;
     }
     else
         return false;
 }
 
+bool M3RtService::RemoveLogSession(std::string name)
+{
+    if (!IsLogServiceRunning() || !log_manager->RemoveSession(name))
+        return false;
+    if (log_manager->GetNumSessions()==0)
+    {
+        delete log_manager;
+        log_manager=NULL;
+    }
+    return true;
+}
+
+bool M3RtService::IsLogSessionRunning(std::string name)
+{
+    return IsLogServiceRunning() && log_manager->IsSessionRunning(name);
+}
+
+std::vector<std::string> M3RtService::GetLogSessionNames()
+{
+    if (!IsLogServiceRunning())
+        return std::vector<std::string>();
+    return log_manager->GetSessionNames();
+}
+
 bool M3RtService::IsDataServiceError()
 {
     for (int i=0; i<data_services.size(); i++)
@@ -289,6 +363,57 @@ bool M3RtService::ClientSubscribeStatus(const std::string name, int port)
     return false;
 }
 
+bool M3RtService::ClientStartStreaming(int port, int rate_divisor)
+{
+    if (IsDataServiceRunning() && !svc_thread_end)
+    {
+        for (int i=0; i<data_services.size(); i++)
+        {
+            if (data_services[i] && ports[i] == port)
+                return data_services[i]->ClientStartStreaming(rate_divisor);
+        }
+    }
+    return false;
+}
+
+bool M3RtService::ClientStopStreaming(int port)
+{
+    for (int i=0; i<data_services.size(); i++)
+    {
+        if (data_services[i] && ports[i] == port)
+        {
+            data_services[i]->ClientStopStreaming();
+            return true;
+        }
+    }
+    return false;
+}
+
+int M3RtService::SubscribeStatus(int port, const std::vector<std::string> names)
+{
+    if (!IsDataServiceRunning() || svc_thread_end)
+        return -1;
+    for (int i=0; i<data_services.size(); i++)
+    {
+        if (data_services[i] && ports[i] == port)
+        {
+            int n=0;
+            for (int j=0; j<names.size(); j++)
+            {
+                if (GetComponentIdx(names[j])<0)
+                {
+                    m3rt::M3_WARN("Unable to subscribe to %s: no such component\n",names[j].c_str());
+                    continue;
+                }
+                data_services[i]->ClientSubscribeStatus(names[j]);
+                n++;
+            }
+            return n;
+        }
+    }
+    return -1;
+}
+
 int M3RtService::GetNumComponents()
 {
     if (!rt_system)
@@ -325,6 +450,45 @@ int M3RtService::GetComponentState(const std::string name)
     return -1;
 }
 
+std::vector<std::vector<std::string> > M3RtService::GetComponentDirectory()
+{
+    std::vector<std::vector<std::string> > dir;
+    if (!rt_system)
+        return dir;
+    int n=rt_system->GetNumComponents();
+    dir.resize(n);
+    for (int i=0; i<n; i++)
+    {
+        dir[i].push_back(rt_system->GetComponentName(i));
+        dir[i].push_back(rt_system->GetComponentType(i));
+    }
+    return dir;
+}
+
+std::vector<int> M3RtService::GetComponentStates(const std::vector<std::string> names)
+{
+    std::vector<int> states(names.size(),-1);
+    for (int i=0; i<names.size(); i++)
+        states[i]=GetComponentState(names[i]);
+    return states;
+}
+
+int M3RtService::SetComponentStates(const std::vector<std::string> names, int state)
+{
+    if (state!=M3COMP_STATE_OP && state!=M3COMP_STATE_SAFEOP)
+    {
+        m3rt::M3_ERR("SetComponentStates: only OP and SAFEOP can be requested (got %d)\n",state);
+        return 0;
+    }
+    int n=0;
+    for (int i=0; i<names.size(); i++)
+    {
+        if (state==M3COMP_STATE_OP ? SetComponentStateOp(names[i]) : SetComponentStateSafeOp(names[i]))
+            n++;
+    }
+    return n;
+}
+
 bool  M3RtService::PrettyPrintComponent(const std::string name)
 {
     int idx=GetComponentIdx(name);
@@ -343,9 +507,8 @@ bool M3RtService::SetComponentStateOp(std::string name)
 
     if (idx>=0)
     {
-        rt_system->SetComponentStateOp(idx);
         //printf("M3RtService Setting Op %s\n",name);
-        return true;
+        return rt_system->SetComponentStateOp(idx);
     }
     return false;
 }
@@ -356,9 +519,8 @@ bool M3RtService::SetComponentStateSafeOp(std::string name)
 
     if (idx>=0)
     {
-        rt_system->SetComponentStateSafeOp(idx);
         //printf("M3RtService Setting SafeOp %s\n",name);
-        return true;
+        return rt_system->SetComponentStateSafeOp(idx);
     }
     return false;
 }
@@ -372,6 +534,19 @@ bool M3RtService::PrettyPrintRtSystem()
     return false;
 }
 
+bool M3RtService::PrintThreadPlacement()
+{
+    m3rt::PrintThreadPlacement();
+    return true;
+}
+
+bool M3RtService::PrintPerfCounters()
+{
+    if (rt_system!=NULL)
+        return rt_system->PrintPerfCounters();
+    return false;
+}
+
 /*bool M3RtService::AddRosComponent(const std::string name)
 {
     if (rt_system==NULL)
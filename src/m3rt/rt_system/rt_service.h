@@ -49,7 +49,7 @@ extern "C" {
  */
 class M3RtService{
 public:
-	M3RtService():rt_system(NULL),log_service(NULL),svc_task(NULL),next_port(10000),num_rtsys_attach(0){
+	M3RtService():rt_system(NULL),log_manager(NULL),log_tail_entries(0),log_tail_disk(true),svc_task(NULL),next_port(10000),num_rtsys_attach(0){
             log_components.reserve(50);
             data_services.reserve(20);
         }
@@ -98,7 +98,7 @@ public:
      * @brief
      *
      * @param name
-     * @return bool
+     * @return bool False if the component is unknown or was not set OP (see M3RtSystem::SetComponentStateOp)
      */
     bool SetComponentStateOp(std::string name);
     /**
@@ -137,7 +137,8 @@ public:
      */
     bool RemoveDataService(int port);
     /**
-     * @brief
+     * @brief Start a log session of the components added since the last one. Sessions run
+     * side by side, each with its own name.
      *
      * @param name
      * @param path
@@ -154,13 +155,78 @@ public:
      * @param name
      * @return bool
      */
-    bool AddLogComponent(std::string name){log_components.push_back(name);}
+    bool AddLogComponent(std::string name){return AddLogComponentStream(name,0,std::vector<std::string>());}
+    /**
+     * @brief Log a component at its own rate and/or only some of its status fields.
+     *
+     * @param name
+     * @param freq Hz, 0: rate of the log session
+     * @param fields Status fields to keep, dotted for nested messages (e.g. base.timestamp), empty: all
+     * @return bool
+     */
+    bool AddLogComponentStream(std::string name, double freq, const std::vector<std::string> fields){
+        log_components.push_back(name);
+        log_component_freq.push_back(freq);
+        log_component_fields.push_back(fields);
+        return true;
+    }
+    /**
+     * @brief Make the next AttachLogService a triggered capture: nothing is written until a trigger,
+     * then pre_s seconds before and post_s seconds after it. Clears the triggers added before,
+     * pre_s=post_s=0 goes back to continuous logging.
+     *
+     * @param pre_s
+     * @param post_s
+     * @param on_state Trigger when a component goes to ERR or SAFEOP
+     * @param on_overrun Trigger on an rt cycle overrun
+     * @return bool
+     */
+    bool SetLogCapture(double pre_s, double post_s, bool on_state, bool on_overrun);
+    /**
+     * @brief Trigger the next capture when a numeric status field of a logged component crosses value.
+     *
+     * @param name
+     * @param field Dotted path, name[i] for an element of a repeated field
+     * @param op ">" or "<"
+     * @param value
+     * @return bool
+     */
+    bool AddLogTrigger(std::string name, std::string field, std::string op, double value);
+    /**
+     * @brief Make the next AttachLogService keep its last entries for the data port tail
+     * subscribers (M3CONTROL_LOG_TAIL), e.g. to record on another machine.
+     *
+     * @param num_entries 0: no tail
+     * @param to_disk False: nothing written on this host
+     * @return bool
+     */
+    bool SetLogTail(int num_entries, bool to_disk){
+        if (num_entries<0)
+            return false;
+        log_tail_entries=num_entries;
+        log_tail_disk=to_disk;
+        return true;
+    }
     /**
      * @brief
      *
+     * @param name Log session, empty: all
+     * @return bool False if no capture is running or a trigger is pending
+     */
+    bool TriggerLogCapture(std::string name="");
+    /**
+     * @brief Stop all the log sessions.
+     *
      * @return bool
      */
     bool RemoveLogService();
+    /**
+     * @brief
+     *
+     * @param name
+     * @return bool
+     */
+    bool RemoveLogSession(std::string name);
     /**
      * @brief
      *
@@ -172,7 +238,20 @@ public:
      *
      * @return bool
      */
-    bool IsLogServiceRunning(){return log_service!=NULL;}
+    bool IsLogServiceRunning(){return log_manager!=NULL;}
+    /**
+     * @brief
+     *
+     * @param name
+     * @return bool
+     */
+    bool IsLogSessionRunning(std::string name);
+    /**
+     * @brief
+     *
+     * @return std::vector<std::string> Names of the running log sessions
+     */
+    std::vector<std::string> GetLogSessionNames();
     /**
      * @brief
      *
@@ -225,6 +304,27 @@ public:
      * @return int
      */
     int GetComponentIdx(const std::string name);
+    /**
+     * @brief Name and type of every component in one call, in component index order.
+     *
+     * @return std::vector<std::vector<std::string> > [[name,type],...]
+     */
+    std::vector<std::vector<std::string> > GetComponentDirectory();
+    /**
+     * @brief
+     *
+     * @param names
+     * @return std::vector<int> State of each component, -1 if not found
+     */
+    std::vector<int> GetComponentStates(const std::vector<std::string> names);
+    /**
+     * @brief Batch version of SetComponentStateOp/SetComponentStateSafeOp.
+     *
+     * @param names
+     * @param state M3COMP_STATE_OP or M3COMP_STATE_SAFEOP
+     * @return int Number of components actually set, refused OP transitions are not counted
+     */
+    int SetComponentStates(const std::vector<std::string> names, int state);
     /**
      * @brief
      *
@@ -238,6 +338,18 @@ public:
      * @return bool
      */
     bool PrettyPrintRtSystem();
+    /**
+     * @brief Per component hardware counters (perf_counters in m3_config.yml).
+     *
+     * @return bool
+     */
+    bool PrintPerfCounters();
+    /**
+     * @brief CPU set, policy and priority of the server threads (threads section of m3_config.yml).
+     *
+     * @return bool
+     */
+    bool PrintThreadPlacement();
     /**
      * @brief
      *
@@ -246,6 +358,30 @@ public:
      * @return bool
      */
     bool ClientSubscribeStatus(const std::string name, int port);
+    /**
+     * @brief Batch version of ClientSubscribeStatus.
+     *
+     * @param port
+     * @param names
+     * @return int Number of components subscribed, -1 if no data service on port
+     */
+    int SubscribeStatus(int port, const std::vector<std::string> names);
+    /**
+     * @brief Server pushes the subscribed status right after every rate_divisor rt cycles,
+     * commands can be sent at any time.
+     *
+     * @param port
+     * @param rate_divisor
+     * @return bool
+     */
+    bool ClientStartStreaming(int port, int rate_divisor);
+    /**
+     * @brief
+     *
+     * @param port
+     * @return bool
+     */
+    bool ClientStopStreaming(int port);
     /**
      * @brief
      *
@@ -253,12 +389,18 @@ public:
      */
     bool IsDataServiceError();
 private:
+    void ClearLogComponents(){log_components.clear();log_component_freq.clear();log_component_fields.clear();log_capture=m3rt::M3LogCaptureConfig();log_tail_entries=0;log_tail_disk=true;}
     int hlt; /**< The thread created at Startup()*/
     m3rt::M3RtSystem  * rt_system; 
     m3rt::M3ComponentFactory factory; //Can only create one instance of this. 
     std::vector<m3rt::M3RtDataService*> data_services; 
-    m3rt::M3RtLogService *log_service; 
+    m3rt::M3RtLogManager *log_manager; 
     std::vector<std::string> log_components; 
+    std::vector<double> log_component_freq; 
+    std::vector<std::vector<std::string> > log_component_fields; 
+    m3rt::M3LogCaptureConfig log_capture; 
+    int log_tail_entries; 
+    bool log_tail_disk; 
 #ifdef __RTAI__
     RT_TASK *svc_task; 
 #else
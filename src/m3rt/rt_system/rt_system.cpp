@@ -20,7 +20,11 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include "m3rt/rt_system/rt_system.h"
 //#include "m3rt/base/m3ec_pdo_v1_def.h"
 #include <unistd.h>
+#include <dlfcn.h>
+#include <sched.h>
 #include <string>
+#include <set>
+#include <algorithm>
 
 #if defined(__RTAI__) && defined(__cplusplus)
 extern "C" {
@@ -55,6 +59,34 @@ unsigned long long getNanoSec(void)
             1000LL * (long long) tp.tv_usec;
 }
 
+// Monotonic clock read through the vDSO, no syscall: fine from hard real-time
+static long long monotonic_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return 1000000000LL * (long long)t.tv_sec + (long long)t.tv_nsec;
+}
+
+static inline void post_state(M3ReadySignal & sig, int state)
+{
+#ifdef __RTAI__
+    sig.PostNoWake(state); //Possibly in hard real-time, Wait() polls
+#else
+    sig.Post(state);
+#endif
+}
+
+#ifdef __RTAI__
+// The rt thread returns before entering the loop
+static void *rt_system_thread_failed(M3RtSystem *m3sys)
+{
+    m3sys->ClosePerfCounters();
+    m3sys->sys_thread_active = false;
+    post_state(m3sys->sys_ready, M3ReadySignal::FAILED);
+    post_state(m3sys->sys_exit, M3ReadySignal::READY);
+    return 0;
+}
+#endif
 
 void *rt_system_thread(void *arg)
 {
@@ -83,17 +115,18 @@ void *rt_system_thread(void *arg)
         tick_period = nano2count(RT_TIMER_TICKS_NS);
     }
     M3_INFO("Beginning RTAI Initialization.\n");
-    if(!( task = rt_task_init_schmod(nam2num("M3SYS"), 2, 0, 0, SCHED_FIFO, 0xF))) {
+    if(!( task = rt_task_init_schmod(nam2num("M3SYS"), 2, 0, 0, GetThreadPolicy(M3_THREAD_RT_SYSTEM, SCHED_FIFO), GetThreadCpuMask(M3_THREAD_RT_SYSTEM, 0xF)))) {
         m3rt::M3_ERR("Failed to create RT-TASK M3SYS\n", 0);
-        m3sys->sys_thread_active = false;
-        return 0;
+        return rt_system_thread_failed(m3sys);
     }
+    ApplyThreadPlacement(M3_THREAD_RT_SYSTEM, "M3SYS", true);
     M3_INFO("RT Task Scheduled.\n");
     M3_INFO("Nonroot hrt initialized.\n");
     rt_task_use_fpu(task, 1);
     M3_INFO("Use fpu initialized.\n");
-    mlockall(MCL_CURRENT | MCL_FUTURE);
+    LockAndPrefaultMemory(RT_PREFAULT_STACK_BYTES, RT_PREFAULT_HEAP_BYTES);
     M3_INFO("Mem lock all initialized.\n");
+    m3sys->OpenPerfCounters();
     RTIME tick_period_orig = tick_period;
 
 #endif
@@ -106,19 +139,24 @@ void *rt_system_thread(void *arg)
 #ifndef ONESHOT_MODE
     RTIME now = rt_get_time();
 #ifndef __NO_KERNEL_SYNC__
-    rt_sleep(nano2count((long long)1e9));
+    //Start on a kernel cycle rather than after a fixed delay
+    if(!rt_sem_wait_timed(m3sys->sync_sem,nano2count(1e9)))
+        M3_WARN("Timeout for sync signal with kernel before starting the periodic task.\n");
 #endif
     if(rt_task_make_periodic(task, rt_get_time() + tick_period, tick_period)) {
         M3_ERR("Couldn't make rt_system task periodic.\n");
-        return 0;
+        return rt_system_thread_failed(m3sys);
     }
     M3_INFO("Periodic task initialized.\n");
 #endif
 #endif
 
 #ifndef __RTAI__
-    usleep(1e6);
     M3_INFO("Using pthreads\n");
+    ApplyThreadPlacement(M3_THREAD_RT_SYSTEM, "rt_system");
+    LockAndPrefaultMemory(RT_PREFAULT_STACK_BYTES, RT_PREFAULT_HEAP_BYTES);
+    m3sys->OpenPerfCounters();
+    m3sys->MarkStartupPhase("rt thread init");
 #endif
 
 #if defined(__RTAI__)
@@ -129,6 +167,7 @@ void *rt_system_thread(void *arg)
         M3_INFO("Hard real time initialized.\n");
         rt_make_hard_real_time();
     }
+    m3sys->MarkStartupPhase("rt thread init");
 #ifndef __NO_KERNEL_SYNC__
     M3_INFO("Dry running components...\n");
     for(int i = 0; i < m3sys->GetNumComponents(); i++){
@@ -140,10 +179,10 @@ void *rt_system_thread(void *arg)
     print_start = rt_get_time_ns();
     // RTIME print_dt = 1e9;
     int nerr = 0;
-    int ntrialsmin=500;
+    int nok = 0; //Consecutive successful steps
     while(1){
         if(m3sys->sys_thread_end)
-            return 0;
+            return rt_system_thread_failed(m3sys);
         nerr = 0;
         // Let's try to step
         dry_run_ok = m3sys->Step(false,true);
@@ -158,8 +197,9 @@ void *rt_system_thread(void *arg)
         }
         // If step wasn't ok, we give it another chance
         if(!dry_run_ok){
+            nok = 0;
             m3sys->SetComponentStateOpAll();
-        }else if(ntrialsmin<=0){
+        }else if(++nok >= RT_DRY_RUN_OK_CYCLES){
             M3_INFO("All %d components successfully started.\n",m3sys->GetNumComponents());
             break;
         }
@@ -169,17 +209,17 @@ void *rt_system_thread(void *arg)
             dry_run_ok=false;
             break;
         }
-        ntrialsmin--;
         rt_task_wait_period();
     }
     if(!dry_run_ok){
         M3_INFO("Dry run failed, server should stop now. Please restart it.\n");
-        return 0;
+        return rt_system_thread_failed(m3sys);
     }
     for(int i = 0; i < m3sys->GetNumComponents(); i++){
         m3sys->GetComponent(i)->SetVerbose(true);
 
     }
+    m3sys->MarkStartupPhase("dry run");
 #endif
     M3_INFO("Entering realtime loop.\n");
 #endif
@@ -191,8 +231,10 @@ void *rt_system_thread(void *arg)
 #endif
 
     m3sys->over_step_cnt = 0;
+    m3sys->log_overrun = false;
     m3sys->sys_thread_end = false;
     m3sys->sys_thread_active = true;
+    int warmup_cnt = 0;
 
     while(1) {
         if(m3sys->sys_thread_end) break;
@@ -203,6 +245,16 @@ void *rt_system_thread(void *arg)
 #endif
         if(!m3sys->Step(safeop_only))  //This waits on m3ec.ko semaphore for timing
             break;
+        if(warmup_cnt < RT_WARMUP_CYCLES) {
+            //Startup completes once the components have grown their buffers to steady state
+            if(++warmup_cnt == RT_WARMUP_CYCLES) {
+                m3sys->MarkStartupPhase("warm-up");
+                m3sys->ArmAllocGuard();
+                post_state(m3sys->sys_ready, M3ReadySignal::READY);
+            }
+        } else {
+            m3sys->CheckAllocGuard();
+        }
 #ifdef __RTAI__
         end = rt_get_cpu_time_ns();
         dt = end - start;
@@ -212,6 +264,7 @@ void *rt_system_thread(void *arg)
         up the CPU.*/
         if(dt > count2nano(tick_period) && step_cnt > 10) {
             m3sys->over_step_cnt++;
+            m3sys->log_overrun = true;
             dt_us = static_cast<int>(((dt) / 1000));
             tick_period_us = static_cast<int>(((count2nano(tick_period)) / 1000));
             overrun_us = dt_us - tick_period_us;
@@ -253,6 +306,8 @@ void *rt_system_thread(void *arg)
         }
         end = getNanoSec();
         dt = end - start;
+        if(dt > RT_TIMER_TICKS_NS)
+            m3sys->log_overrun = true;
         if(tmp_cnt++==1000)
         {
             tmp_cnt=0;
@@ -266,23 +321,389 @@ void *rt_system_thread(void *arg)
     rt_make_soft_real_time();
     rt_task_delete(task);
 #endif
+    m3sys->ClosePerfCounters();
     m3sys->sys_thread_active = false;
+    if(warmup_cnt < RT_WARMUP_CYCLES)
+        post_state(m3sys->sys_ready, M3ReadySignal::FAILED);
+    post_state(m3sys->sys_exit, M3ReadySignal::READY);
     return 0;
 }
 
 M3RtSystem::~M3RtSystem() {}
 
+void M3RtSystem::WaitLogIdle()
+{
+#ifdef __cplusplus11__
+    long long e = log_epoch;
+    while(logging && log_epoch == e)
+#else
+    long long e = __atomic_load_n(&log_epoch, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&logging, __ATOMIC_SEQ_CST) && __atomic_load_n(&log_epoch, __ATOMIC_SEQ_CST) == e)
+#endif
+        sched_yield();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+void M3RtSystem::ReadConfigJob(int idx, void *arg)
+{
+    M3PendingConfig & p = (*(std::vector<M3PendingConfig> *)arg)[idx];
+    long long start = monotonic_ns();
+    try {
+        p.result = p.comp->ReadConfig(p.file.c_str()) ? 1 : 0;
+    } catch(...) {
+        p.result = -1;
+    }
+    p.dt = monotonic_ns() - start;
+}
+
+int M3RtSystem::GetFactoryIdx(M3Component * c)
+{
+    for(int i = 0; i < GetNumComponents(); i++)
+        if(factory->GetComponent(i) == c)
+            return i;
+    return -1;
+}
+
+void M3RtSystem::ReadComponentConfigs(std::vector<M3PendingConfig>& pending)
+{
+    if(startup_threads > 1) {
+        RunParallel(pending.size(), startup_threads, ReadConfigJob, &pending);
+    } else {
+        for(size_t i = 0; i < pending.size(); i++)
+            ReadConfigJob(i, &pending);
+    }
+    for(size_t i = 0; i < pending.size(); i++)
+        if(pending[i].result > 0)
+            component_timing[pending[i].comp].first = pending[i].dt;
+}
+
+struct M3StartupJob
+{
+    std::vector<M3Component *> comps;
+    std::vector<long long> dt;
+};
+
+static void startup_job(int idx, void *arg)
+{
+    M3StartupJob *job = (M3StartupJob *)arg;
+    long long start = monotonic_ns();
+    job->comps[idx]->Startup();
+    job->dt[idx] = monotonic_ns() - start;
+}
+
+void M3RtSystem::StartupAllComponents()
+{
+    // Tiers follow the step priorities (ec, calibration, control, joint, chain, ...):
+    // components only depend on the tiers started before them
+    std::map<int, M3StartupJob> tiers;
+    for(int i = 0; i < GetNumComponents(); i++)
+        tiers[startup_threads > 1 ? GetComponent(i)->GetPriority() : 0].comps.push_back(GetComponent(i));
+    for(std::map<int, M3StartupJob>::iterator it = tiers.begin(); it != tiers.end(); ++it) {
+        M3StartupJob & job = it->second;
+        job.dt.resize(job.comps.size(), 0);
+        if(startup_threads > 1) {
+            RunParallel(job.comps.size(), startup_threads, startup_job, &job);
+        } else {
+            for(size_t i = 0; i < job.comps.size(); i++)
+                startup_job(i, &job);
+        }
+        for(size_t i = 0; i < job.comps.size(); i++)
+            component_timing[job.comps[i]].second = job.dt[i];
+    }
+}
+
+void M3RtSystem::ReadStartupOptions()
+{
+    startup_threads = 0;
+    alloc_guard_mode = M3_ALLOC_GUARD_OFF;
+    rusage_enabled = false;
+    perf_requested = false;
+    log_compression = M3LogCompression();
+    static const mReal summary_periods[] = {0.01, 0.1, 1.0};
+    log_summary_periods.assign(summary_periods, summary_periods + 3);
+    log_buffer_bytes = RT_LOG_BUFFER_BYTES;
+#ifndef YAMLCPP_03
+    vector<YAML::Node> docs;
+    if(!GetAllYamlDocs(M3_CONFIG_FILENAME, docs))
+        return;
+    //Last robot path wins, like for the component files
+    for(size_t i = 0; i < docs.size(); i++) {
+        const YAML::Node & doc = docs[i];
+        if(doc.IsMap() && doc["startup_threads"])
+            startup_threads = doc["startup_threads"].as<int>(0);
+        if(doc.IsMap() && doc["alloc_guard"]) {
+            const string mode = doc["alloc_guard"].as<string>("");
+            alloc_guard_mode = mode == "trap" ? M3_ALLOC_GUARD_TRAP : (mode == "count" ? M3_ALLOC_GUARD_COUNT : M3_ALLOC_GUARD_OFF);
+        }
+        if(doc.IsMap() && doc["rusage_accounting"])
+            rusage_enabled = doc["rusage_accounting"].as<bool>(false);
+        if(doc.IsMap() && doc["perf_counters"])
+            perf_requested = doc["perf_counters"].as<bool>(false);
+        if(doc.IsMap() && doc["log_compression"]) {
+            //log_compression: {codec: zstd, level: 3, threads: 2}
+            const YAML::Node & c = doc["log_compression"];
+            log_compression = M3LogCompression();
+            if(c.IsScalar())
+                ParseLogCodec(c.as<string>(""), &log_compression.codec);
+            else if(c.IsMap()) {
+                if(c["codec"])
+                    ParseLogCodec(c["codec"].as<string>(""), &log_compression.codec);
+                if(c["level"])
+                    log_compression.level = c["level"].as<int>(0);
+                if(c["threads"])
+                    log_compression.threads = std::max(0, c["threads"].as<int>(0));
+            }
+        }
+        if(doc.IsMap() && doc["log_buffer_bytes"])
+            log_buffer_bytes = (long long)doc["log_buffer_bytes"].as<double>(RT_LOG_BUFFER_BYTES);
+        if(doc.IsMap() && doc["log_summary"]) {
+            //log_summary: [0.01, 0.1, 1.0] (s), or none
+            const YAML::Node & s = doc["log_summary"];
+            log_summary_periods.clear();
+            if(s.IsSequence())
+                for(size_t j = 0; j < s.size(); j++) {
+                    mReal p = s[j].as<mReal>(0);
+                    if(p > 0)
+                        log_summary_periods.push_back(p);
+                }
+        }
+    }
+#endif
+#ifdef __RTAI__
+    //getrusage() is a linux syscall, it would drop the task out of hard real-time every cycle
+    if(rusage_enabled && IsHardRealTime()) {
+        M3_INFO("Fault and context switch accounting is disabled in hard real-time\n");
+        rusage_enabled = false;
+    }
+#endif
+    rusage_primed = false;
+    if(startup_threads > 1)
+        M3_INFO("Reading configs and starting up components on %d threads\n", startup_threads);
+    alloc_guard_found = NULL;
+    if(alloc_guard_mode != M3_ALLOC_GUARD_OFF) {
+        alloc_guard_state_t * get_state = (alloc_guard_state_t *)dlsym(RTLD_DEFAULT, M3_ALLOC_GUARD_SYMBOL);
+        if(get_state)
+            alloc_guard_found = get_state();
+        else
+            M3_WARN("alloc_guard is set but libm3allocguard.so is not preloaded, allocations in Step() are not checked\n");
+    }
+}
+
+void M3RtSystem::ArmAllocGuard()
+{
+    if(alloc_guard_found == NULL)
+        return;
+    for(int i = 0; i < M3_ALLOC_GUARD_MAX_COMPONENTS; i++)
+        alloc_guard_found->count[i] = 0;
+    alloc_guard_found->comp = -1;
+    alloc_guard_found->thread = pthread_self();
+    alloc_guard_found->mode = alloc_guard_mode;
+    alloc_guard = alloc_guard_found;
+}
+
+void M3RtSystem::CheckAllocGuard()
+{
+    if(alloc_guard == NULL)
+        return;
+    const int n = std::min((int)alloc_reported.size(), M3_ALLOC_GUARD_MAX_COMPONENTS);
+    for(int i = 0; i < n; i++) {
+        if(alloc_guard->count[i] > alloc_reported[i]) {
+            M3_WARN("%s allocated memory in Step() (%lld allocations since warm-up)\n", GetComponent(i)->GetName().c_str(), alloc_guard->count[i]);
+            alloc_reported[i] = alloc_guard->count[i];
+        }
+    }
+}
+
+void M3RtSystem::SampleRusage(M3MonitorRusage * phase, bool blocking)
+{
+    struct rusage now;
+    if(getrusage(RUSAGE_THREAD, &now) != 0)
+        return;
+    if(!rusage_primed) {
+        rusage_last = now;
+        rusage_primed = true;
+        return;
+    }
+    const long minflt = now.ru_minflt - rusage_last.ru_minflt;
+    const long majflt = now.ru_majflt - rusage_last.ru_majflt;
+    const long nvcsw = now.ru_nvcsw - rusage_last.ru_nvcsw;
+    const long nivcsw = now.ru_nivcsw - rusage_last.ru_nivcsw;
+    rusage_last = now;
+    if(minflt == 0 && majflt == 0 && nvcsw == 0 && nivcsw == 0)
+        return;
+    phase->set_minor_faults(phase->minor_faults() + minflt);
+    phase->set_major_faults(phase->major_faults() + majflt);
+    phase->set_voluntary_ctx_switches(phase->voluntary_ctx_switches() + nvcsw);
+    phase->set_involuntary_ctx_switches(phase->involuntary_ctx_switches() + nivcsw);
+    const long unexpected = nivcsw + (blocking ? 0 : nvcsw);
+    if(minflt + majflt + unexpected > 0) {
+        phase->set_spike_cycles(phase->spike_cycles() + 1);
+        phase->set_last_spike_cycle(step_cnt);
+    }
+    cycle_faults += minflt + majflt;
+    cycle_ctx_switches += unexpected;
+}
+
+void M3RtSystem::OpenPerfCounters()
+{
+    perf_enabled = false;
+    if(!perf_requested)
+        return;
+    if(!perf.Open()) {
+        M3_WARN("Hardware counters not available, perf_counters ignored\n");
+        return;
+    }
+#ifdef __RTAI__
+    //The read() fallback is a linux syscall
+    if(IsHardRealTime() && !perf.IsUserRead()) {
+        M3_WARN("Hardware counters can't be read from user space (rdpmc), perf_counters ignored in hard real-time\n");
+        perf.Close();
+        return;
+    }
+    //Nor later, when a sample can't be read with rdpmc (events descheduled): it is skipped instead
+    perf.SetUserReadOnly(IsHardRealTime());
+#endif
+    M3_INFO("Hardware counters enabled (%s)\n", perf.IsUserRead() ? "rdpmc" : "read");
+    perf_enabled = true;
+}
+
+void M3RtSystem::ClosePerfCounters()
+{
+    perf_enabled = false;
+    perf.Close();
+}
+
+void M3RtSystem::PerfEnd(int idx, int phase)
+{
+    if(!perf_enabled || !perf_start_ok || idx >= (int)perf_totals.size())
+        return; //Sample skipped
+    unsigned long long v[M3PerfCounters::NUM_COUNTERS];
+    if(!perf.Read(v))
+        return;
+    M3PerfTotals & t = perf_totals[idx];
+    for(int k = 0; k < M3PerfCounters::NUM_COUNTERS; k++)
+        t.v[phase][k] += v[k] - perf_start[k];
+    t.calls[phase]++;
+    M3MonitorComponent *c = factory->GetMonitorStatus()->mutable_components(idx);
+    const unsigned long long cycles = v[M3PerfCounters::CYCLES] - perf_start[M3PerfCounters::CYCLES];
+    if(phase == M3_PERF_STATUS)
+        c->set_perf_cycles_status(cycles);
+    else
+        c->set_perf_cycles_command(cycles);
+    const double instr = t.v[0][M3PerfCounters::INSTRUCTIONS] + t.v[1][M3PerfCounters::INSTRUCTIONS];
+    const double cyc = t.v[0][M3PerfCounters::CYCLES] + t.v[1][M3PerfCounters::CYCLES];
+    if(instr > 0 && cyc > 0) {
+        c->set_ipc(instr / cyc);
+        c->set_llc_mpki(1000.0 * (t.v[0][M3PerfCounters::LLC_MISSES] + t.v[1][M3PerfCounters::LLC_MISSES]) / instr);
+        c->set_branch_mpki(1000.0 * (t.v[0][M3PerfCounters::BRANCH_MISSES] + t.v[1][M3PerfCounters::BRANCH_MISSES]) / instr);
+    }
+}
+
+bool M3RtSystem::PrintPerfCounters()
+{
+    if(perf_totals_ext.empty() || !perf_requested) {
+        M3_INFO("Hardware counters are off (perf_counters in %s)\n", M3_CONFIG_FILENAME);
+        return false;
+    }
+    //The rt thread updates perf_totals without a lock, read its copy. Sized before the rt thread starts
+    vector<M3PerfTotals> totals(perf_totals_ext.size());
+    bool published;
+#ifdef __RTAI__
+    rt_sem_wait(ext_sem);
+#else
+    sem_wait(ext_sem);
+#endif
+    published = perf_published;
+    std::copy(perf_totals_ext.begin(), perf_totals_ext.end(), totals.begin());
+#ifdef __RTAI__
+    rt_sem_signal(ext_sem);
+#else
+    sem_post(ext_sem);
+#endif
+    if(!published) {
+        M3_WARN("Hardware counters requested but not running (not available, or the rt system is not started)\n");
+        return false;
+    }
+    BannerPrint(100, "Hardware counters per component (user space, since startup)");
+    M3_PRINTF("%-32s %12s %12s %8s %10s %10s\n", "", "cyc/status", "cyc/command", "IPC", "LLC MPKI", "br MPKI");
+    for(int i = 0; i < (int)totals.size(); i++) {
+        const M3PerfTotals & t = totals[i];
+        const double instr = t.v[0][M3PerfCounters::INSTRUCTIONS] + t.v[1][M3PerfCounters::INSTRUCTIONS];
+        const double cyc = t.v[0][M3PerfCounters::CYCLES] + t.v[1][M3PerfCounters::CYCLES];
+        if(instr <= 0 || cyc <= 0)
+            continue;
+        M3_PRINTF("%-32s %12.0f %12.0f %8.2f %10.3f %10.3f\n", GetComponentName(i).c_str(),
+                  t.calls[0] ? (double)t.v[0][M3PerfCounters::CYCLES] / t.calls[0] : 0.0,
+                  t.calls[1] ? (double)t.v[1][M3PerfCounters::CYCLES] / t.calls[1] : 0.0,
+                  instr / cyc,
+                  1000.0 * (t.v[0][M3PerfCounters::LLC_MISSES] + t.v[1][M3PerfCounters::LLC_MISSES]) / instr,
+                  1000.0 * (t.v[0][M3PerfCounters::BRANCH_MISSES] + t.v[1][M3PerfCounters::BRANCH_MISSES]) / instr);
+    }
+    BannerPrint(100, "");
+    return true;
+}
+
+void M3RtSystem::PrintAllocGuardReport()
+{
+    if(alloc_guard == NULL)
+        return;
+    alloc_guard->mode = M3_ALLOC_GUARD_OFF;
+    alloc_guard = NULL;
+    BannerPrint(60, "Allocations in Step() after warm-up");
+    const int n = std::min(GetNumComponents(), M3_ALLOC_GUARD_MAX_COMPONENTS);
+    int nalloc = 0;
+    for(int i = 0; i < n; i++) {
+        if(alloc_guard_found->count[i] > 0) {
+            M3_PRINTF("%-40s %10lld\n", GetComponentName(i).c_str(), alloc_guard_found->count[i]);
+            nalloc++;
+        }
+    }
+    if(nalloc == 0)
+        M3_PRINTF("None\n");
+    BannerPrint(60, "");
+}
+
+void M3RtSystem::MarkStartupPhase(const char * name)
+{
+    long long now = monotonic_ns();
+    if(startup_timing.size() < startup_timing.capacity())
+        startup_timing.push_back(std::make_pair(name, now - startup_mark));
+    startup_mark = now;
+}
+
+void M3RtSystem::PrintStartupTiming()
+{
+    M3_INFO("M3RtSystem startup timing:\n");
+    for(size_t i = 0; i < startup_timing.size(); i++)
+        M3_INFO("  %-22s %9.1f ms\n", startup_timing[i].first, startup_timing[i].second / 1e6);
+    M3_INFO("  %-22s %9.1f ms\n", "total", (startup_mark - startup_start) / 1e6);
+    BannerPrint(60, "Component startup time (ms)");
+    M3_PRINTF("%-40s %10s %10s\n", "", "ReadConfig", "Startup");
+    for(int i = 0; i < GetNumComponents(); i++) {
+        const std::pair<long long, long long> & t = component_timing[GetComponent(i)];
+        M3_PRINTF("%-40s %10.1f %10.1f\n", GetComponentName(i).c_str(), t.first / 1e6, t.second / 1e6);
+    }
+    BannerPrint(60, "");
+}
+
 bool M3RtSystem::Startup()
 {
     sys_thread_active = false;
     BannerPrint(60, "Startup of M3RtSystem");
+    startup_timing.clear();
+    startup_timing.reserve(16); //No allocation when the rt thread marks its phases
+    startup_start = startup_mark = monotonic_ns();
     if(!this->StartupComponents()) {
         sys_thread_active = false;
         return false;
     }
-    usleep(500000);
+    sys_ready.Reset();
+    sys_exit.Reset();
+    alloc_reported.assign(GetNumComponents(), 0); //Sized before the rt thread checks it
+    perf_totals.assign(GetNumComponents(), M3PerfTotals());
+    perf_totals_ext.assign(GetNumComponents(), M3PerfTotals());
+    perf_published = false;
     long ret=0;//return for the thread
 #ifdef __RTAI__
     hst = rt_thread_create((void *)rt_system_thread, (void *)this, 1000000);
@@ -293,18 +714,16 @@ bool M3RtSystem::Startup()
 
     if(!(ret==0)){
         m3rt::M3_INFO("Startup of M3RtSystem thread failed (error code [%ld]).\n",ret);
+        sys_exit.Post(M3ReadySignal::READY);
         return false;
     }
-    for(int i = 0; i < 10; i++) {
-        if(sys_thread_active)
-            break;
-        usleep(1e6); //Wait until enters hard real-time and components loaded. Can take some time if alot of components.max wait = 1sec
-        
-    }
-    if(!sys_thread_active) {
-        m3rt::M3_INFO("Startup of M3RtSystem thread failed, thread still not active.\n");
+    //Wait until the thread enters the loop (dry run included) or gives up
+    int state = sys_ready.Wait(RT_SYSTEM_STARTUP_TIMEOUT_NS);
+    if(state != M3ReadySignal::READY) {
+        m3rt::M3_INFO("Startup of M3RtSystem thread failed, %s.\n", state == M3ReadySignal::PENDING ? "thread still not active" : "thread exited");
         return false;
     }
+    PrintStartupTiming();
     return true;
 }
 
@@ -313,21 +732,12 @@ bool M3RtSystem::Shutdown()
     M3_INFO("Begin shutdown of M3RtSystem...\n");
     //Stop RtSystem thread
     sys_thread_end = true;
-
-    usleep(500000);
-    
-    float timeout_s = 4;
-    time_t start_time=time(0);
-    while(sys_thread_active && (float)difftime(time(0),start_time) < timeout_s)
-    {
-        m3rt::M3_INFO("Waiting for RtSystem thread to shutdown... (%.2fs/%.2fs)\n",(float)difftime(time(0),start_time) ,timeout_s);
-        usleep(500000);
-    }
-
-    if(sys_thread_active) {
+    long long start_time = monotonic_ns();
+    if(sys_exit.Wait(M3_THREAD_STOP_TIMEOUT_NS) == M3ReadySignal::PENDING) {
         m3rt::M3_WARN("M3RtSystem thread did not shutdown correctly\n");
         //return false;
     }
+    PrintAllocGuardReport();
 #ifdef __RTAI__
     if(shm_ec != NULL)
 #endif
@@ -343,6 +753,12 @@ bool M3RtSystem::Shutdown()
         }
         //usleep(2e6);
 #ifdef __RTAI__
+        if(ec_local != NULL) {
+            //The reset PDOs went to the private copy
+            rt_sem_wait(shm_sem);
+            CopyOutEcShm();
+            rt_sem_signal(shm_sem);
+        }
         rt_shm_free(nam2num(SHMNAM_M3MKMD));
 #endif
     }
@@ -369,21 +785,88 @@ bool M3RtSystem::Shutdown()
     shm_ec = NULL;
     shm_sem = NULL;
     sync_sem = NULL;
+    delete ec_local;
+    ec_local = NULL;
     factory->ReleaseAllComponents();
-    M3_INFO("Shutdown of M3RtSystem complete\n");
+    M3_INFO("Shutdown of M3RtSystem complete (%.1f ms)\n", (monotonic_ns() - start_time) / 1e6);
     return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifndef YAMLCPP_03
+void M3RtSystem::PrefetchComponentConfigs()
+{
+    vector<string> vcfg;
+    GetFileConfigPath(M3_CONFIG_FILENAME,vcfg);
+    vector<string> files;
+    const char * keys[] = {"ec_components","rt_components"};
+    for(vector<string>::iterator it = vcfg.begin(); it != vcfg.end(); ++it) {
+        try{
+            if(!m3rt::file_exists(*it)) continue;
+            const YAML::Node doc = LoadYamlFileCached(*it);
+            for(int k = 0; k < 2; k++) {
+                const YAML::Node components = doc[keys[k]];
+                if(!components) continue;
+                // Old layout {dir:{name:type}} and ordered one [{dir:[{name:type}]}]
+                for(YAML::const_iterator it_rt = components.begin(); it_rt != components.end(); ++it_rt) {
+                    const bool ordered = components.IsSequence();
+                    const string dir = ordered ? it_rt->begin()->first.as<string>() : it_rt->first.as<string>();
+                    const YAML::Node dir_comp = ordered ? it_rt->begin()->second : it_rt->second;
+                    for(YAML::const_iterator it_dir = dir_comp.begin(); it_dir != dir_comp.end(); ++it_dir) {
+                        string name = dir_comp.IsSequence() ? it_dir->begin()->first.as<string>() : it_dir->first.as<string>();
+                        files.push_back(dir + "/" + name + ".yml");
+                    }
+                }
+            }
+        }catch(std::exception &e){
+            continue; //Reported by ReadConfig
+        }
+    }
+    // Same lookup as GetYamlDoc: the last robot path holding the file wins
+    vector<string> paths;
+    set<string> seen;
+    for(size_t i = 0; i < files.size(); i++) {
+        if(!seen.insert(files[i]).second) continue;
+        vector<string> vpath;
+        if(!GetFileConfigPath(files[i].c_str(),vpath)) continue;
+        for(vector<string>::reverse_iterator it = vpath.rbegin(); it != vpath.rend(); ++it) {
+            if(m3rt::file_exists(*it)) {
+                paths.push_back(*it);
+                break;
+            }
+        }
+    }
+    PrefetchYamlFiles(paths);
+}
+#endif
+
 bool M3RtSystem::StartupComponents()
 {
-    M3_INFO("Reading components config files ...\n");
+    M3ConfigSnapshot * snapshot = GetConfigSnapshot();
+    //Warm start: loaded by the factory, it seeded the yaml cache and gives the component list.
+    //Used by this start only, a later one reads m3_config.yml again
+    use_snapshot = snapshot->IsValid();
+    snapshot->Invalidate();
+    config_record.clear();
+    ReadStartupOptions();
+    component_timing.clear();
+#ifndef YAMLCPP_03
+    if(!use_snapshot)
+        PrefetchComponentConfigs();
+    MarkStartupPhase(use_snapshot ? "load config snapshot" : "prefetch configs");
+#endif
+    M3_INFO("Reading components config files%s ...\n", use_snapshot ? " (from snapshot)" : "");
     if(!ReadConfig(M3_CONFIG_FILENAME,"ec_components",this->m3ec_list,this->idx_map_ec))
         return false;
     if(!ReadConfig(M3_CONFIG_FILENAME,"rt_components",this->m3rt_list,this->idx_map_rt))
         return false;
     M3_INFO("Done reading components config files.\n");
+    if(!use_snapshot) {
+        snapshot->components = config_record;
+        snapshot->Save();
+    }
+    MarkStartupPhase("read configs");
 #ifdef __RTAI__
     main_task = rt_task_init_schmod(nam2num("M3MAIN"),RT_TASK_PRIORITY,RT_STACK_SIZE,0,SCHED_FIFO,0xF);
     if(!main_task){
@@ -414,6 +897,10 @@ bool M3RtSystem::StartupComponents()
         M3_ERR("Unable to find the SEMNAM_M3LSHM semaphore.\n", 0);
         return false;
     }
+    ec_local = new M3EcSystemShm();
+    rt_sem_wait(shm_sem);
+    memcpy(ec_local, shm_ec, sizeof(M3EcSystemShm));
+    rt_sem_signal(shm_sem);
 
     ext_sem = rt_typed_sem_init(nam2num(SEMNAM_M3LEXT), 1, BIN_SEM);
 #else
@@ -438,7 +925,7 @@ bool M3RtSystem::StartupComponents()
     M3_INFO("Matching Kernel EC components with config file...\n");
     int rm_cnt=0;
     for(vector<M3ComponentEc *>::iterator it_ec=m3ec_list.begin();it_ec!=m3ec_list.end();/*++it_ec*/){
-        if((*it_ec)->SetSlaveEcShm(shm_ec->slave, shm_ec->slaves_responding) == false){
+        if((*it_ec)->SetSlaveEcShm(ec_local->slave, ec_local->slaves_responding) == false){
             factory->ReleaseComponent((*it_ec));
             m3ec_list.erase(it_ec);
             rm_cnt++;
@@ -493,11 +980,18 @@ bool M3RtSystem::StartupComponents()
         return false;
     }
     M3_INFO("Done linking components.\n");
+#ifdef __RTAI__
+    ec_slaves_used.clear();
+    for(size_t i = 0; i < m3ec_list.size(); i++)
+        if(m3ec_list[i]->shm != NULL)
+            ec_slaves_used.push_back(m3ec_list[i]->shm - ec_local->slave);
+#endif
+    InitExtBuffers();
+    MarkStartupPhase("kernel sync and link");
     M3_INFO("Starting up components ...\n");
-    for(int i = 0; i < GetNumComponents(); i++) {
-        GetComponent(i)->Startup();
-    }
+    StartupAllComponents();
     M3_INFO("Done starting up components.\n");
+    MarkStartupPhase("start components");
     CheckComponentStates();
     PrettyPrintComponentNames();
     //Setup Monitor
@@ -515,27 +1009,27 @@ bool M3RtSystem::StartupComponents()
 bool M3RtSystem::ParseCommandFromExt(M3CommandAll &msg)
 {
     int idx, i;
-    string s;
 
+    //Only the latest command/param per component is kept, as ParseCommand() would have done
     for(i = 0; i < msg.name_cmd_size(); i++) {
         idx = GetComponentIdx(msg.name_cmd(i));
-        if(idx >= 0) {
-            s = msg.datum_cmd(i);
-            GetComponent(idx)->ParseCommand(s);
+        if(idx >= 0 && idx < (int)ext_cmd.size()) {
+            ext_cmd[idx] = msg.datum_cmd(i);
+            ext_cmd_pending[idx] = 1;
+            ext_pending = true;
         } else {
-            //M3_WARN("Invalid Command component name %s in ParseCommandFromExt\n",s.c_str());
             M3_WARN("Invalid Command component name %s in ParseCommandFromExt\n", msg.name_cmd(i).c_str());
-
         }
     }
 
     for(i = 0; i < msg.name_param_size(); i++) {
         idx = GetComponentIdx(msg.name_param(i));
-        if(idx >= 0) {
-            s = msg.datum_param(i);
-            GetComponent(idx)->ParseParam(s);
+        if(idx >= 0 && idx < (int)ext_param.size()) {
+            ext_param[idx] = msg.datum_param(i);
+            ext_param_pending[idx] = 1;
+            ext_pending = true;
         } else {
-            M3_WARN("Invalid Param component name %s in ParseCommandFromExt\n", s.c_str());
+            M3_WARN("Invalid Param component name %s in ParseCommandFromExt\n", msg.name_param(i).c_str());
         }
     }
 
@@ -544,30 +1038,202 @@ bool M3RtSystem::ParseCommandFromExt(M3CommandAll &msg)
 
 bool M3RtSystem::SerializeStatusToExt(M3StatusAll &msg, vector<string>& names)
 {
+    int n = 0;
     for(int i = 0; i < names.size(); i++) {
-        M3Component *m = GetComponent(names[i]);
-        if(m != NULL) {
-            string datum;
-            if(!m->SerializeStatus(datum)) {
-                //Bug where SerializeToString fails for bad message size
-                //Patched protobuf/message.cc to allow but return false
-                //FixME!
-                //datum.clear();
+        int idx = GetComponentIdx(names[i]);
+        if(idx < 0 || idx >= (int)ext_status.size())
+            continue;
+        if(!ext_status_valid[idx])
+            continue;
+        if(n >= msg.datum_size()) {
+            //Grow message
+            msg.add_datum(ext_status[idx]);
+            msg.add_name(names[i]);
+        } else {
+            msg.set_datum(n, ext_status[idx]);
+            msg.set_name(n, names[i]);
+        }
+        n++;
+    }
+    while(msg.datum_size() > n) {
+        msg.mutable_datum()->RemoveLast();
+        msg.mutable_name()->RemoveLast();
+    }
+    return true;
+}
+
+void M3RtSystem::AddExtStatusSubscriber(int idx)
+{
+    if(idx >= 0 && idx < (int)ext_status_wanted.size())
+        ext_status_wanted[idx]++;
+}
+
+void M3RtSystem::RemoveExtStatusSubscriber(int idx)
+{
+    if(idx < 0 || idx >= (int)ext_status_wanted.size() || ext_status_wanted[idx] == 0)
+        return;
+    if(--ext_status_wanted[idx] == 0)
+        ext_status_valid[idx] = 0; //Not refreshed anymore, a later subscriber waits for a new one
+}
+
+void M3RtSystem::InitExtBuffers()
+{
+    int n = GetNumComponents();
+    ext_pending = false;
+    ext_cmd.assign(n, string());
+    ext_param.assign(n, string());
+    ext_cmd_pending.assign(n, 0);
+    ext_param_pending.assign(n, 0);
+    ext_status_wanted.assign(n, 0);
+    ext_status_valid.assign(n, 0);
+    ext_status.assign(n, string());
+    rt_cmd.assign(n, string());
+    rt_param.assign(n, string());
+    rt_cmd_pending.assign(n, 0);
+    rt_param_pending.assign(n, 0);
+    rt_status_wanted.assign(n, 0);
+    rt_status.assign(n, string());
+}
+
+void M3RtSystem::CopyInExt()
+{
+    //Swapping keeps the capacity on both sides, no allocation in steady state
+    if(ext_pending) {
+        for(size_t i = 0; i < ext_cmd.size(); i++) {
+            if(ext_cmd_pending[i]) {
+                rt_cmd[i].swap(ext_cmd[i]);
+                rt_cmd_pending[i] = 1;
+                ext_cmd_pending[i] = 0;
             }
-            if(i >= msg.datum_size()) {
-                //Grow message
-                msg.add_datum(datum);
-                msg.add_name(names[i]);
-            } else {
-                msg.set_datum(i, datum);
-                msg.set_name(i, names[i]);
+            if(ext_param_pending[i]) {
+                rt_param[i].swap(ext_param[i]);
+                rt_param_pending[i] = 1;
+                ext_param_pending[i] = 0;
             }
         }
+        ext_pending = false;
+    }
+    for(size_t i = 0; i < ext_status_wanted.size(); i++)
+        rt_status_wanted[i] = ext_status_wanted[i] > 0;
+}
+
+void M3RtSystem::ApplyExtCommands()
+{
+    for(size_t i = 0; i < rt_cmd.size(); i++) {
+        if(rt_cmd_pending[i]) {
+            GetComponent(i)->ParseCommand(rt_cmd[i]);
+            rt_cmd_pending[i] = 0;
+        }
+        if(rt_param_pending[i]) {
+            GetComponent(i)->ParseParam(rt_param[i]);
+            rt_param_pending[i] = 0;
+        }
+    }
+}
+
+void M3RtSystem::SerializeExtStatus()
+{
+    for(size_t i = 0; i < rt_status.size(); i++)
+        if(rt_status_wanted[i])
+            GetComponent(i)->SerializeStatus(rt_status[i]);
+}
+
+void M3RtSystem::CopyOutExt()
+{
+    for(size_t i = 0; i < rt_status.size(); i++)
+        if(rt_status_wanted[i]) {
+            ext_status[i].swap(rt_status[i]);
+            ext_status_valid[i] = 1;
+        }
+}
+
+#ifdef __RTAI__
+void M3RtSystem::CopyInEcShm()
+{
+    ec_local->timestamp_ns = shm_ec->timestamp_ns;
+    ec_local->slaves_responding = shm_ec->slaves_responding;
+    ec_local->slaves_active = shm_ec->slaves_active;
+    ec_local->slaves_dropped = shm_ec->slaves_dropped;
+    ec_local->link_up = shm_ec->link_up;
+    ec_local->watchdog = shm_ec->watchdog;
+    ec_local->counter = shm_ec->counter;
+    memcpy(ec_local->monitor, shm_ec->monitor, sizeof(ec_local->monitor));
+    for(size_t i = 0; i < ec_slaves_used.size(); i++) {
+        M3EcSlaveShm *src = &shm_ec->slave[ec_slaves_used[i]];
+        M3EcSlaveShm *dst = &ec_local->slave[ec_slaves_used[i]];
+        dst->active = src->active;
+        dst->online = src->online;
+        dst->operational = src->operational;
+        dst->al_state = src->al_state;
+        int n = src->n_byte_status;
+        memcpy(dst->status, src->status, (n > 0 && n <= MAX_PDO_SIZE_BYTES) ? n : MAX_PDO_SIZE_BYTES);
     }
-    return true;
 }
 
+void M3RtSystem::CopyOutEcShm()
+{
+    for(size_t i = 0; i < ec_slaves_used.size(); i++) {
+        M3EcSlaveShm *src = &ec_local->slave[ec_slaves_used[i]];
+        M3EcSlaveShm *dst = &shm_ec->slave[ec_slaves_used[i]];
+        int n = dst->n_byte_cmd;
+        memcpy(dst->cmd, src->cmd, (n > 0 && n <= MAX_PDO_SIZE_BYTES) ? n : MAX_PDO_SIZE_BYTES);
+    }
+}
+#endif
+
+// Listeners are only touched with ext_sem held, so the rt loop never sees a half updated list
+#ifdef __RTAI__
+void M3RtSystem::AddCycleListener(SEM *sem)
+#else
+void M3RtSystem::AddCycleListener(sem_t *sem)
+#endif
+{
+#ifdef __RTAI__
+    rt_sem_wait(ext_sem);
+#else
+    sem_wait(ext_sem);
+#endif
+    if(std::find(cycle_listeners.begin(), cycle_listeners.end(), sem) == cycle_listeners.end())
+        cycle_listeners.push_back(sem);
+#ifdef __RTAI__
+    rt_sem_signal(ext_sem);
+#else
+    sem_post(ext_sem);
+#endif
+}
+
+#ifdef __RTAI__
+void M3RtSystem::RemoveCycleListener(SEM *sem)
+#else
+void M3RtSystem::RemoveCycleListener(sem_t *sem)
+#endif
+{
+#ifdef __RTAI__
+    rt_sem_wait(ext_sem);
+#else
+    sem_wait(ext_sem);
+#endif
+    cycle_listeners.erase(std::remove(cycle_listeners.begin(), cycle_listeners.end(), sem), cycle_listeners.end());
+#ifdef __RTAI__
+    rt_sem_signal(ext_sem);
+#else
+    sem_post(ext_sem);
+#endif
+}
 
+void M3RtSystem::NotifyCycleListeners()
+{
+    for(size_t i = 0; i < cycle_listeners.size(); i++) {
+#ifdef __RTAI__
+        rt_sem_signal(cycle_listeners[i]); // BIN_SEM, a slow listener only sees the latest cycle
+#else
+        int val = 0;
+        sem_getvalue(cycle_listeners[i], &val);
+        if(val <= 0)
+            sem_post(cycle_listeners[i]);
+#endif
+    }
+}
 
 void M3RtSystem::CheckComponentStates()
 {
@@ -684,9 +1350,9 @@ void M3RtSystem::PrettyPrintComponent(int idx)
 bool M3RtSystem::Step(bool safeop_only,bool dry_run)
 {
 #ifdef __RTAI__
-    RTIME start, end, dt, start_c, end_c, start_p, end_p;
+    RTIME start, end, dt, start_c, end_c, start_p, end_p, start_l;
 #else
-    long long start, end, dt, start_c, end_c, start_p, end_p;
+    long long start, end, dt, start_c, end_c, start_p, end_p, start_l;
 #endif
     bool ret_step=true;
     vector<M3ComponentEc *>::iterator j;
@@ -696,11 +1362,10 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
         1: Block External Data Service from chaging state
         2: Wait until EtherCAT mod signals finished a cycle (synchronize)
         3: Acquire lock on EtherCAT shared mem
-        4: Get data from EtherCAT shared mem
-        5: Step all components
-        6: Transmit newly computed commands to EtherCAT shared mem
-        7: Upload status to logger
-        8: Release locks, allow External Data Service to update components if new data is available.
+        4: Copy in: EtherCAT status PDOs and the commands queued by the External Data Services
+        5: Release locks, the kernel module and the data services run while we compute
+        6: Step all components on the private copies, upload status to logger
+        7: Copy out: commands to EtherCAT shared mem (shm_sem), status snapshot for the data services (ext_sem)
     */
 
     /*
@@ -715,7 +1380,10 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
     
     //Do some bookkeeping
     M3MonitorStatus *s = factory->GetMonitorStatus();
-    
+    if(rusage_enabled) {
+        cycle_faults = cycle_ctx_switches = 0;
+        SampleRusage(s->mutable_rusage_idle(), true);
+    }
     
 #ifdef __RTAI__
     start_c = rt_get_cpu_time_ns();
@@ -734,10 +1402,24 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
     s->set_t_shm_sem_wait(end_c - start_c);
     
     start = rt_get_cpu_time_ns();
+    CopyInEcShm();
+    start_l = rt_get_cpu_time_ns();
+    rt_sem_signal(shm_sem);
+    CopyInExt();
+    rt_sem_signal(ext_sem);
+    end_c = rt_get_cpu_time_ns();
+    s->set_t_shm_sem_hold(start_l - start);
+    s->set_t_ext_sem_hold(end_c - start);
 #else
     sem_wait(ext_sem);
     start = getNanoSec();
+    CopyInExt();
+    sem_post(ext_sem);
+    s->set_t_ext_sem_hold(getNanoSec() - start);
 #endif
+    if(rusage_enabled)
+        SampleRusage(s->mutable_rusage_sem_wait(), true);
+    ApplyExtCommands();
     if(safeop_only) { // in case we are too slow
         for(int i = 0; i < GetNumComponents(); i++)
             if(GetComponent(i)->IsStateError()) {
@@ -761,12 +1443,12 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
 
     if(m3ec_list.size() != 0) {
         for(int i = 0; i < NUM_EC_DOMAIN; i++) {
-            s->mutable_ec_domains(i)->set_t_ecat_wait_rx(shm_ec->monitor[i].t_ecat_wait_rx);
-            s->mutable_ec_domains(i)->set_t_ecat_rx(shm_ec->monitor[i].t_ecat_rx);
-            s->mutable_ec_domains(i)->set_t_ecat_wait_shm(shm_ec->monitor[i].t_ecat_wait_shm);
-            s->mutable_ec_domains(i)->set_t_ecat_shm(shm_ec->monitor[i].t_ecat_shm);
-            s->mutable_ec_domains(i)->set_t_ecat_wait_tx(shm_ec->monitor[i].t_ecat_wait_tx);
-            s->mutable_ec_domains(i)->set_t_ecat_tx(shm_ec->monitor[i].t_ecat_tx);
+            s->mutable_ec_domains(i)->set_t_ecat_wait_rx(ec_local->monitor[i].t_ecat_wait_rx);
+            s->mutable_ec_domains(i)->set_t_ecat_rx(ec_local->monitor[i].t_ecat_rx);
+            s->mutable_ec_domains(i)->set_t_ecat_wait_shm(ec_local->monitor[i].t_ecat_wait_shm);
+            s->mutable_ec_domains(i)->set_t_ecat_shm(ec_local->monitor[i].t_ecat_shm);
+            s->mutable_ec_domains(i)->set_t_ecat_wait_tx(ec_local->monitor[i].t_ecat_wait_tx);
+            s->mutable_ec_domains(i)->set_t_ecat_tx(ec_local->monitor[i].t_ecat_tx);
         }
     }
     s->set_num_components_safeop(nsop);
@@ -780,7 +1462,7 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
     s->set_num_ethercat_cycles(GetEcCounter());
 #ifdef __RTAI__
     //Set timestamp for all
-    int64_t ts = shm_ec->timestamp_ns / 1000;
+    int64_t ts = ec_local->timestamp_ns / 1000;
 #else
     int64_t ts = getNanoSec() / 1000;
 #endif
@@ -800,7 +1482,11 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
         for(int i = 0; i < m3ec_list.size(); i++) { //=m3ec_list.begin(); j!=m3ec_list.end(); ++j)
             if(m3ec_list[i]->GetPriority() == j) {
                 start_c = rt_get_cpu_time_ns();
+                AllocGuardEnter(idx_map_ec[i]);
+                PerfBegin();
                 m3ec_list[i]->StepStatus();
+                PerfEnd(idx_map_ec[i], M3_PERF_STATUS);
+                AllocGuardLeave();
                 end_c = rt_get_cpu_time_ns();
                 M3MonitorComponent *c = s->mutable_components(idx_map_ec[i]);
                 c->set_cycle_time_status_us((mReal)(end_c - start_c) / 1000);
@@ -819,7 +1505,11 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
 #else
                 start_c = getNanoSec();
 #endif
+                AllocGuardEnter(idx_map_rt[i]);
+                PerfBegin();
                 m3rt_list[i]->StepStatus();
+                PerfEnd(idx_map_rt[i], M3_PERF_STATUS);
+                AllocGuardLeave();
 #ifdef __RTAI__
                 end_c = rt_get_cpu_time_ns();
 #else
@@ -836,6 +1526,8 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
     end_p = getNanoSec();
 #endif
     s->set_cycle_time_status_us((mReal)(end_p - start_p) / 1000);
+    if(rusage_enabled)
+        SampleRusage(s->mutable_rusage_status(), false);
     //Set Command on non-EC components
     //Step components in reverse order
 #ifdef __RTAI__
@@ -853,7 +1545,11 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
 #else
                 start_c = getNanoSec();
 #endif
+                AllocGuardEnter(idx_map_rt[i]);
+                PerfBegin();
                 m3rt_list[i]->StepCommand();
+                PerfEnd(idx_map_rt[i], M3_PERF_COMMAND);
+                AllocGuardLeave();
 #ifdef __RTAI__
                 end_c = rt_get_cpu_time_ns();
 #else
@@ -870,7 +1566,11 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
         for(int i = 0; i < m3ec_list.size(); i++) {
             if(m3ec_list[i]->GetPriority() == j) {
                 start_c = rt_get_cpu_time_ns();
+                AllocGuardEnter(idx_map_ec[i]);
+                PerfBegin();
                 m3ec_list[i]->StepCommand();
+                PerfEnd(idx_map_ec[i], M3_PERF_COMMAND);
+                AllocGuardLeave();
                 end_c = rt_get_cpu_time_ns();
                 M3MonitorComponent *c = s->mutable_components(idx_map_ec[i]);
                 c->set_cycle_time_command_us((mReal)(end_c - start_c) / 1000);
@@ -883,6 +1583,8 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
     end_p = getNanoSec();
 #endif
     s->set_cycle_time_command_us((mReal)(end_p - start_p) / 1000);
+    if(rusage_enabled)
+        SampleRusage(s->mutable_rusage_command(), false);
     //Now see if any errors raised
     CheckComponentStates();
     if(dry_run&&safeop_required){// Let's give it another chance!
@@ -892,12 +1594,44 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
         ret_step=true;
     }
 
-    if(log_service) {
-        logging = true;
-        if(!log_service->Step())
+    //logging is raised before the manager is loaded (both seq_cst): a RemoveLogService either
+    //happens before the load, or WaitLogIdle sees logging and waits for the epoch to move
+#ifdef __cplusplus11__
+    logging = true;
+    M3RtLogManager * log = log_service;
+#else
+    __atomic_store_n(&logging, true, __ATOMIC_SEQ_CST);
+    M3RtLogManager * log = __atomic_load_n(&log_service, __ATOMIC_SEQ_CST);
+#endif
+    if(log) {
+        if(log_overrun)
+            log->Trigger(M3_LOG_TRIGGER_OVERRUN);
+        if(!log->Step())
             M3_DEBUG("Step() of log service failed.\n");
-        logging = false;
     }
+#ifdef __cplusplus11__
+    log_epoch++;
+    logging = false;
+#else
+    __atomic_add_fetch(&log_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&logging, false, __ATOMIC_SEQ_CST);
+#endif
+    log_overrun = false;
+    if(rusage_enabled) {
+        SampleRusage(s->mutable_rusage_log(), false);
+        s->set_cycle_faults(cycle_faults);
+        s->set_cycle_ctx_switches(cycle_ctx_switches);
+    }
+    s->set_num_cycles(step_cnt);
+    SerializeExtStatus();
+#ifdef __RTAI__
+    start_l = rt_get_cpu_time_ns();
+    rt_sem_wait(shm_sem);
+    CopyOutEcShm();
+    rt_sem_signal(shm_sem);
+    end_c = rt_get_cpu_time_ns();
+    s->set_t_shm_sem_hold(s->t_shm_sem_hold() + end_c - start_l);
+#endif
 #ifdef __RTAI__
     end = rt_get_cpu_time_ns();
 #else
@@ -912,11 +1646,27 @@ bool M3RtSystem::Step(bool safeop_only,bool dry_run)
     s->set_cycle_frequency_hz((mReal)(rate * 1000000000.0));
     last_cycle_time = end;
 #ifdef __RTAI__
-    rt_sem_signal(shm_sem);
+    rt_sem_wait(ext_sem);
+    start_l = rt_get_cpu_time_ns();
+#else
+    sem_wait(ext_sem);
+    start_l = getNanoSec();
+#endif
+    CopyOutExt();
+    if(perf_enabled) {
+        std::copy(perf_totals.begin(), perf_totals.end(), perf_totals_ext.begin());
+        perf_published = true;
+    }
+    //Wake up the streaming data services, status is fresh
+    NotifyCycleListeners();
+#ifdef __RTAI__
+    end_c = rt_get_cpu_time_ns();
     rt_sem_signal(ext_sem);
 #else
+    end_c = getNanoSec();
     sem_post(ext_sem);
 #endif
+    s->set_t_ext_sem_hold(s->t_ext_sem_hold() + end_c - start_l);
     return ret_step;
 }
 
@@ -26,11 +26,16 @@ along with M3.  If not, see <http://www.gnu.org/licenses/>.
 #include "m3rt/base/component.h"
 #include "m3rt/base/component_ec.h"
 #include "m3rt/base/component_factory.h"
+#include "m3rt/base/config_snapshot.h"
+#include "m3rt/base/alloc_guard.h"
+#include "m3rt/base/perf_counters.h"
+#include "m3rt/base/thread_placement.h"
 #include "m3rt/base/component_base.pb.h" 
 #include "m3rt/rt_system/rt_log_service.h"
 //#include "m3rt/rt_system/rt_ros_service.h"
 #include <string>
 #include <vector>
+#include <map>
 
 #ifdef __RTAI__
 #ifdef __cplusplus
@@ -45,6 +50,8 @@ extern "C" {
 #include <semaphore.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <string.h>
 #include <algorithm>
 
 #ifdef __cplusplus11__
@@ -53,6 +60,20 @@ extern "C" {
 
 namespace m3rt
 {
+#define M3_PERF_STATUS 0
+#define M3_PERF_COMMAND 1
+
+/**
+ * @brief Hardware counter totals of one component, for StepStatus and StepCommand
+ *
+ */
+struct M3PerfTotals
+{
+    M3PerfTotals(){memset(v, 0, sizeof(v)); calls[0] = calls[1] = 0;}
+    unsigned long long v[2][M3PerfCounters::NUM_COUNTERS];
+    long long calls[2];
+};
+
 /**
  * @brief
  *
@@ -65,9 +86,12 @@ public:
      *
      * @param f
      */
-    M3RtSystem(M3ComponentFactory * f):log_service(NULL),
-        shm_ec(0),shm_sem(0),ext_sem(NULL),sync_sem(0),factory(f),logging(false),hard_realtime(true),ready_sem(NULL),
-        safeop_required(false){GOOGLE_PROTOBUF_VERIFY_VERSION;}
+    M3RtSystem(M3ComponentFactory * f):shm_sem(0),sync_sem(0),ext_sem(NULL),ready_sem(NULL),
+        log_overrun(false),logging(false),log_epoch(0),factory(f),shm_ec(0),safeop_required(false),hard_realtime(true),log_service(NULL),
+        startup_start(0),startup_mark(0),startup_threads(0),use_snapshot(false),
+        alloc_guard(NULL),alloc_guard_found(NULL),alloc_guard_mode(M3_ALLOC_GUARD_OFF),
+        rusage_enabled(false),rusage_primed(false),cycle_faults(0),cycle_ctx_switches(0),
+        perf_requested(false),perf_enabled(false),perf_start_ok(false),perf_published(false),ec_local(NULL),ext_pending(false){GOOGLE_PROTOBUF_VERIFY_VERSION;sys_exit.PostNoWake(M3ReadySignal::READY);}
     friend class M3RtDataService;
     /**
      * @brief
@@ -86,6 +110,14 @@ public:
      * @return bool
      */
     bool StartupComponents();
+#ifndef YAMLCPP_03
+    /**
+     * @brief Parse all the component config files listed in m3_config.yml in parallel,
+     * so that the component ReadConfig() calls hit the yaml cache.
+     *
+     */
+    void PrefetchComponentConfigs();
+#endif
     /**
      * @brief
      *
@@ -121,6 +153,45 @@ public:
      *
      */
     void PrettyPrintComponentNames();
+    /**
+     * @brief Record the time spent since the previous mark under name (for the startup report).
+     * Does not allocate, can be called from the rt thread.
+     *
+     * @param name Must be a string literal
+     */
+    void MarkStartupPhase(const char * name);
+    /**
+     * @brief
+     *
+     */
+    void PrintStartupTiming();
+    /**
+     * @brief Start counting the allocations made by components in Step() (rt thread, after the warm-up).
+     * No-op unless alloc_guard is set in m3_config.yml and the guard library is preloaded.
+     *
+     */
+    void ArmAllocGuard();
+    /**
+     * @brief Warn about the components that allocated since the last check (rt thread).
+     *
+     */
+    void CheckAllocGuard();
+    /**
+     * @brief Open the hardware counters on the calling (rt) thread if perf_counters is set in m3_config.yml.
+     *
+     */
+    void OpenPerfCounters();
+    /**
+     * @brief
+     *
+     */
+    void ClosePerfCounters();
+    /**
+     * @brief Cycles per step, IPC and miss rates of every component.
+     *
+     * @return bool False if the counters are off or could not be opened
+     */
+    bool PrintPerfCounters();
     /**
      * @brief
      *
@@ -225,11 +296,11 @@ public:
      *
      * @return int
      */
-    int GetEcCounter(){return shm_ec->counter;}
-    SEM * ready_sem; 
-    SEM * sync_sem; 
+    int GetEcCounter(){return ec_local ? ec_local->counter : shm_ec->counter;}
     SEM * shm_sem; 
+    SEM * sync_sem; 
     SEM * ext_sem; 
+    SEM * ready_sem; 
 #else
     sem_t * shm_sem;
     sem_t * sync_sem;
@@ -248,20 +319,49 @@ public:
      *
      * @param l
      */
-    void AttachLogService(M3RtLogService * l){log_service=l;}
+    void AttachLogService(M3RtLogManager * l){
+#ifdef __cplusplus11__
+        log_service=l;
+#else
+        __atomic_store_n(&log_service,l,__ATOMIC_SEQ_CST);
+#endif
+    }
 
     /**
-     * @brief
+     * @brief The rt thread may still be in the Step of the removed manager, see WaitLogIdle.
+     *
+     */
+    void RemoveLogService(){AttachLogService(NULL);M3_DEBUG("Log service stopped\n");}
+    /**
+     * @brief Wait for the rt thread to leave the log step it may have begun before RemoveLogService.
+     *
+     */
+    void WaitLogIdle();
+    /**
+     * @brief log_compression in m3_config.yml, used by the log services
      *
+     * @return const M3LogCompression &
      */
-    void RemoveLogService(){log_service=NULL;M3_DEBUG("Log service stopped at %d\n",log_service);}
+    const M3LogCompression & GetLogCompression(){return log_compression;}
+    /**
+     * @brief log_summary in m3_config.yml
+     *
+     * @return const std::vector<mReal> & Period of each summary level (s), empty: no summary
+     */
+    const std::vector<mReal> & GetLogSummaryPeriods(){return log_summary_periods;}
+    /**
+     * @brief log_buffer_bytes in m3_config.yml
+     *
+     * @return long long Memory for the log buffers, all sessions together
+     */
+    long long GetLogBufferBytes(){return log_buffer_bytes;}
     /**
      * @brief
      *
      * @param msg
      * @return bool
      */
-    bool ParseCommandFromExt(M3CommandAll & msg);  //Must be thread safe
+    bool ParseCommandFromExt(M3CommandAll & msg);  //Must be thread safe. Queued, applied at the start of the next cycle
     /**
      * @brief
      *
@@ -269,23 +369,147 @@ public:
      * @param names
      * @return bool
      */
-    bool SerializeStatusToExt(M3StatusAll & msg, std::vector<std::string>& names); //Must be thread safe
+    bool SerializeStatusToExt(M3StatusAll & msg, std::vector<std::string>& names); //Must be thread safe. Status as of the end of the last cycle
+    /**
+     * @brief One more data service wants the status of idx, serialized by the rt thread from the
+     * next cycle on. Called with ext_sem held.
+     *
+     * @param idx
+     */
+    void AddExtStatusSubscriber(int idx);
+    /**
+     * @brief Undo AddExtStatusSubscriber, the rt thread stops serializing the status once no
+     * data service wants it. Called with ext_sem held.
+     *
+     * @param idx
+     */
+    void RemoveExtStatusSubscriber(int idx);
+#ifdef __RTAI__
+    /**
+     * @brief Signal sem at the end of every rt cycle (used by streaming data services)
+     *
+     * @param sem
+     */
+    void AddCycleListener(SEM * sem);
+    /**
+     * @brief
+     *
+     * @param sem
+     */
+    void RemoveCycleListener(SEM * sem);
+#else
+    void AddCycleListener(sem_t * sem);
+    void RemoveCycleListener(sem_t * sem);
+#endif
     int over_step_cnt;
+    bool log_overrun; /**< Set by the rt loop, turned into a log capture trigger by the next Step */
 #ifdef __cplusplus11__
     std::atomic<bool> logging; 
+    std::atomic<long long> log_epoch; /**< Log steps the rt thread went through */
     std::atomic<bool> sys_thread_end;
     std::atomic<bool> sys_thread_active;
 #else
     bool logging; 
+    long long log_epoch; 
     bool sys_thread_end;
     bool sys_thread_active;
 #endif
+    M3ReadySignal sys_ready; /**< Posted by the rt thread when it enters the loop (or fails) */
+    M3ReadySignal sys_exit; /**< Posted by the rt thread when it returns */
 private:
     /**
      * @brief
      *
      */
     void CheckComponentStates();
+    /**
+     * @brief Read startup_threads from m3_config.yml
+     *
+     */
+    void ReadStartupOptions();
+    /**
+     * @brief Call Startup() on all components. With startup_threads set, components sharing
+     * a priority are started concurrently, one priority level after the other.
+     *
+     */
+    void StartupAllComponents();
+    /**
+     * @brief
+     *
+     * @param idx Component index
+     */
+    inline void AllocGuardEnter(int idx){if(alloc_guard && idx < M3_ALLOC_GUARD_MAX_COMPONENTS) alloc_guard->comp = idx;}
+    /**
+     * @brief
+     *
+     */
+    inline void AllocGuardLeave(){if(alloc_guard) alloc_guard->comp = -1;}
+    /**
+     * @brief Allocations counted per component since ArmAllocGuard(), at shutdown.
+     *
+     */
+    void PrintAllocGuardReport();
+    /**
+     * @brief Add the faults and context switches of the rt thread since the previous sample to phase.
+     *
+     * @param phase
+     * @param blocking The phase waits by design: voluntary switches are expected
+     */
+    void SampleRusage(M3MonitorRusage * phase, bool blocking);
+    /**
+     * @brief
+     *
+     */
+    inline void PerfBegin(){perf_start_ok = perf_enabled && perf.Read(perf_start);}
+    /**
+     * @brief Add the counts since PerfBegin() to component idx and update its monitor entry.
+     *
+     * @param idx Component index
+     * @param phase M3_PERF_STATUS or M3_PERF_COMMAND
+     */
+    void PerfEnd(int idx, int phase);
+    /**
+     * @brief
+     *
+     */
+    void NotifyCycleListeners();
+    /**
+     * @brief Size the external command and status buffers, once the component list is final.
+     *
+     */
+    void InitExtBuffers();
+    /**
+     * @brief Take the commands queued by the data services. Called with ext_sem held.
+     *
+     */
+    void CopyInExt();
+    /**
+     * @brief Parse the commands taken by CopyInExt() into the components, no lock held.
+     *
+     */
+    void ApplyExtCommands();
+    /**
+     * @brief Serialize the status wanted by the data services, no lock held.
+     *
+     */
+    void SerializeExtStatus();
+    /**
+     * @brief Publish what SerializeExtStatus() wrote. Called with ext_sem held.
+     *
+     */
+    void CopyOutExt();
+#ifdef __RTAI__
+    /**
+     * @brief Kernel shm -> ec_local: status PDOs, slave flags and domain monitors. Called with shm_sem held.
+     *
+     */
+    void CopyInEcShm();
+    /**
+     * @brief ec_local -> kernel shm: command PDOs of the slaves used by a component. Called with shm_sem held.
+     *
+     */
+    void CopyOutEcShm();
+#endif
     M3ComponentFactory * factory; 
     M3EcSystemShm *  shm_ec; 
 #ifdef __cplusplus11__
@@ -301,12 +525,66 @@ private:
 #else
     long long last_cycle_time;
 #endif
-    M3RtLogService * log_service; 
+#ifdef __cplusplus11__
+    std::atomic<M3RtLogManager *> log_service; 
+#else
+    M3RtLogManager * log_service; 
+#endif
 
     std::vector<int> idx_map_ec; 
     std::vector<int> idx_map_rt; 
+#ifdef __RTAI__
+    std::vector<SEM *> cycle_listeners;
+#else
+    std::vector<sem_t *> cycle_listeners;
+#endif
     long hst; 
     double test; 
+    std::vector<std::pair<const char *, long long> > startup_timing;
+    long long startup_start;
+    long long startup_mark;
+    int startup_threads; /**< startup_threads in m3_config.yml, 0: sequential ReadConfig/Startup */
+    std::map<M3Component *, std::pair<long long, long long> > component_timing; /**< ReadConfig and Startup time (ns) */
+    bool use_snapshot; /**< Components come from the config snapshot */
+    std::vector<M3ConfigSnapshot::Component> config_record; /**< Components created, for the next snapshot */
+    M3AllocGuardState * alloc_guard; /**< Set once armed */
+    M3AllocGuardState * alloc_guard_found; /**< Guard library state, NULL if not preloaded */
+    int alloc_guard_mode; /**< alloc_guard in m3_config.yml */
+    std::vector<long long> alloc_reported; /**< Count at the last warning, per component */
+    bool rusage_enabled; /**< rusage_accounting in m3_config.yml (default off), off in hard real-time */
+    bool rusage_primed;
+    struct rusage rusage_last;
+    int cycle_faults;
+    int cycle_ctx_switches;
+    M3PerfCounters perf; /**< Owned by the rt thread */
+    bool perf_requested; /**< perf_counters in m3_config.yml */
+    bool perf_enabled;
+    unsigned long long perf_start[M3PerfCounters::NUM_COUNTERS];
+    bool perf_start_ok; /**< perf_start read by the last PerfBegin */
+    std::vector<M3PerfTotals> perf_totals; /**< Per component index */
+    std::vector<M3PerfTotals> perf_totals_ext; /**< Copy of perf_totals for PrintPerfCounters, ext_sem */
+    bool perf_published; /**< perf_totals_ext set at least once, ext_sem */
+    M3LogCompression log_compression;
+    std::vector<mReal> log_summary_periods;
+    long long log_buffer_bytes;
+    M3EcSystemShm * ec_local; /**< Private copy of shm_ec the EtherCAT components work on */
+    std::vector<int> ec_slaves_used; /**< Slaves of ec_local bound to a component */
+    //Step() only holds ext_sem to exchange these, the components are stepped without lock.
+    //Per component index; ext_* are shared with the data services, rt_* private to the rt thread.
+    bool ext_pending; /**< Any ext_cmd/ext_param pending */
+    std::vector<std::string> ext_cmd;
+    std::vector<std::string> ext_param;
+    std::vector<char> ext_cmd_pending;
+    std::vector<char> ext_param_pending;
+    std::vector<int> ext_status_wanted; /**< Number of data services subscribed to the status */
+    std::vector<char> ext_status_valid;
+    std::vector<std::string> ext_status;
+    std::vector<std::string> rt_cmd;
+    std::vector<std::string> rt_param;
+    std::vector<char> rt_cmd_pending;
+    std::vector<char> rt_param_pending;
+    std::vector<char> rt_status_wanted;
+    std::vector<std::string> rt_status;
 	
 protected:
     template <class T>
@@ -334,6 +612,118 @@ protected:
 #else
     sem_t * GetExtSem(){return ext_sem;}
 #endif
+    /**
+     * @brief A component created from m3_config.yml whose own config file is not read yet
+     *
+     */
+    struct M3PendingConfig
+    {
+        M3PendingConfig(M3Component * c, const std::string& f, const std::string& n, const std::string& t):comp(c),file(f),name(n),type(t),result(0),dt(0){}
+        M3Component * comp;
+        std::string file;
+        std::string name;
+        std::string type;
+        int result; /**< 1: ok, 0: ReadConfig failed, -1: exception */
+        long long dt; /**< ReadConfig time (ns) */
+    };
+    /**
+     * @brief
+     *
+     * @param name
+     * @param pending
+     * @return bool
+     */
+    bool IsComponentPending(const std::string& name,const std::vector<M3PendingConfig>& pending){
+	for(size_t i=0;i<pending.size();++i){
+	      if(pending[i].name == name)
+		return true;
+	}
+	return false;
+    }
+    /**
+     * @brief Call ReadConfig() on every pending component, on startup_threads threads if set.
+     *
+     * @param pending
+     */
+    void ReadComponentConfigs(std::vector<M3PendingConfig>& pending);
+    /**
+     * @brief
+     *
+     * @param idx
+     * @param arg std::vector<M3PendingConfig> *
+     */
+    static void ReadConfigJob(int idx, void * arg);
+    /**
+     * @brief Index of c in the factory (and the monitor status), -1 if released.
+     *
+     * @param c
+     * @return int
+     */
+    int GetFactoryIdx(M3Component * c);
+    template <class T>
+    /**
+     * @brief Read the pending configs, then add the components in m3_config.yml order
+     * (the order does not depend on which ReadConfig finished first).
+     *
+     * @param component_type
+     * @param pending
+     * @param comp_list
+     * @param idx_map
+     */
+    void ReadPendingConfigs(const char * component_type,std::vector<M3PendingConfig>& pending,std::vector<T>& comp_list,std::vector<int>& idx_map)
+	{
+		ReadComponentConfigs(pending);
+		for(size_t i=0;i<pending.size();i++){
+			M3ConfigSnapshot::Component c;
+			c.component_type = component_type;
+			c.name = pending[i].name;
+			c.type = pending[i].type;
+			c.file = pending[i].file;
+			config_record.push_back(c);
+			T m = reinterpret_cast<T>(pending[i].comp);
+			if(pending[i].result == 0) {
+				factory->ReleaseComponent(m);
+				M3_ERR("Error reading config for %s\n", pending[i].name.c_str());
+			} else if(pending[i].result < 0) {
+				M3_WARN("Error while parsing config files for %s %s \n",component_type, pending[i].name.c_str());
+				factory->ReleaseComponent(m);
+			}
+		}
+		//All of them were created before any release: factory indices are only known now
+		for(size_t i=0;i<pending.size();i++){
+			if(pending[i].result > 0) { //A.H: this should look first in local and to back to original if it exists
+				comp_list.push_back(reinterpret_cast<T>(pending[i].comp));
+				idx_map.push_back(GetFactoryIdx(pending[i].comp));
+			}
+		}
+		pending.clear();
+	}
+	template <class T>
+    /**
+     * @brief Create the components listed in the config snapshot, in the same order as the
+     * start that wrote it (no m3_config.yml resolution).
+     *
+     * @param component_type
+     * @param comp_list
+     * @param idx_map
+     * @return bool
+     */
+    bool ReadConfigFromSnapshot(const char* component_type, std::vector<T*>& comp_list, std::vector< int >& idx_map)
+	{
+		std::vector<M3PendingConfig> pending;
+		const std::vector<M3ConfigSnapshot::Component>& comps = GetConfigSnapshot()->components;
+		for(size_t i=0;i<comps.size();i++){
+			if(comps[i].component_type != component_type)
+				continue;
+			T * m = reinterpret_cast<T*>(factory->CreateComponent(comps[i].type));
+			if(m != NULL) {
+				m->SetFactory(factory);
+				pending.push_back(M3PendingConfig(m, comps[i].file, comps[i].name, comps[i].type));
+			}
+		}
+		ReadPendingConfigs(component_type,pending,comp_list,idx_map);
+		return true;
+	}
 	// Here we read the config files in robot_config1:robot_config_add:robot_config_overlap
 	template <class T>
     /**
@@ -347,6 +737,8 @@ protected:
      */
     bool ReadConfig(const char* filename, const char* component_type, std::vector<T*>& comp_list, std::vector< int >& idx_map)
 	{
+		if(use_snapshot)
+			return ReadConfigFromSnapshot(component_type,comp_list,idx_map);
 		std::vector<std::string> vpath;
 		GetFileConfigPath(filename,vpath);
 		bool ret=false;
@@ -382,14 +774,15 @@ protected:
      */
     bool ReadConfigUnordered(const std::string& filename,const char * component_type,std::vector<T>& comp_list,std::vector<int>& idx_map)
 	{
+		std::vector<M3PendingConfig> pending;
 		try{
-		YAML::Node doc;
 #ifdef YAMLCPP_03
+		YAML::Node doc;
 		std::ifstream fin(filename.c_str());
 		YAML::Parser parser(fin);
 		while(parser.GetNextDocument(doc)) {
 #else
-		doc = YAML::LoadFile(filename);
+		const YAML::Node doc = LoadYamlFileCached(filename);
 		if(doc.IsNull()){M3_ERR("%s not found, please update the robot's config files.\n",filename.c_str()); return false;}
 #endif
 
@@ -408,7 +801,7 @@ protected:
 				std::string dir;
 				it.first() >> dir;
 #else
-			YAML::Node components = doc[component_type];
+			const YAML::Node components = doc[component_type];
 			for(YAML::const_iterator it_rt = components.begin();it_rt != components.end(); ++it_rt) {
 				std::string dir = it_rt->first.as<std::string>();
 #endif
@@ -421,7 +814,7 @@ protected:
 					it_dir.first() >> name;
 					it_dir.second() >> type;
 #else
-				YAML::Node dir_comp = components[dir.c_str()];
+				const YAML::Node dir_comp = components[dir.c_str()];
 				for(YAML::const_iterator it_dir = dir_comp.begin();it_dir != dir_comp.end(); ++it_dir) {
 					std::string name=it_dir->first.as<std::string>();
 					std::string type=it_dir->second.as<std::string>();
@@ -431,34 +824,28 @@ protected:
 					  M3_WARN("Component %s (of type %s) already loaded, please make sure your component's name is unique.\n",name.c_str(),type.c_str());
 					  continue;
 					}
+					if(IsComponentPending(name,pending))
+					{
+					  M3_WARN("Component %s (of type %s) already loaded, please make sure your component's name is unique.\n",name.c_str(),type.c_str());
+					  continue;
+					}
 					T m = reinterpret_cast<T>(factory->CreateComponent(type));
 					if(m != NULL) {
 						m->SetFactory(factory);
-						std::string f = dir + "/" + name + ".yml";
-						try {
-							std::cout <<"------------------------------------------"<<std::endl;
-							std::cout <<"Component " << name<<" of type "<<type<<std::endl;
-							if(m->ReadConfig(f.c_str())) { //A.H: this should look first in local and to back to original if it exists
-								comp_list.push_back(m);
-								idx_map.push_back(GetNumComponents() - 1);
-							} else {
-								factory->ReleaseComponent(m);
-								M3_ERR("Error reading config for %s\n", name.c_str());
-							}
-						} catch(...) {
-							M3_WARN("Error while parsing config files for %s %s \n",component_type, name.c_str());
-							factory->ReleaseComponent(m);
-						}
-
+						std::cout <<"------------------------------------------"<<std::endl;
+						std::cout <<"Component " << name<<" of type "<<type<<std::endl;
+						pending.push_back(M3PendingConfig(m, dir + "/" + name + ".yml", name, type));
 					}
 				}
 			}
+		ReadPendingConfigs(component_type,pending,comp_list,idx_map);
 		return true;
 #ifdef YAMLCPP_03
 		}
 #endif
 		}catch(std::exception &e){
 			//M3_ERR("(Unordered) Error while reading %s config (old config): %s\n",component_type,e.what());
+			ReadPendingConfigs(component_type,pending,comp_list,idx_map);
 			return false;
 		}
 		std::cout<<std::endl;
@@ -477,7 +864,7 @@ protected:
     bool ReadConfigOrdered(const std::string& filename,const char * component_type,std::vector<T>& comp_list,std::vector<int>& idx_map)
 	{
 		// New version with -ma17: -actuator1:type1 etc
-		YAML::Node doc = YAML::LoadFile(filename);
+		const YAML::Node doc = LoadYamlFileCached(filename);
 		if(doc.IsNull()){M3_ERR("%s not found, please update the robot's config files.\n",filename.c_str()); return false;}
 		//for(std::vector<YAML::Node>::const_iterator it_doc=all_docs.begin(); it_doc!=all_docs.end();++it_doc){
 			//doc = *it_doc;
@@ -486,6 +873,8 @@ protected:
 				return true;
 			}
 			const YAML::Node& components = doc[component_type];
+			std::vector<M3PendingConfig> pending;
+			try{
 			for(YAML::const_iterator it_rt = components.begin();it_rt != components.end(); ++it_rt) {
 				const std::string dir =it_rt->begin()->first.as<std::string>();
 				const YAML::Node& dir_comp = it_rt->begin()->second;
@@ -497,29 +886,26 @@ protected:
 					  M3_WARN("Component %s (of type %s) already loaded, please make sure your component's name is unique.\n",name.c_str(),type.c_str());
 					  continue;
 					}
+					if(IsComponentPending(name,pending))
+					{
+					  M3_WARN("Component %s (of type %s) already loaded, please make sure your component's name is unique.\n",name.c_str(),type.c_str());
+					  continue;
+					}
 					T m = reinterpret_cast<T>(factory->CreateComponent(type));
 					if(m != NULL) {
 						m->SetFactory(factory);
-						std::string f = dir + "/" + name + ".yml";
-						try {
-							std::cout <<"------------------------------------------"<<std::endl;
-							std::cout <<"Component " << name<<" of type "<<type<<std::endl;
-							if(m->ReadConfig(f.c_str())) { //A.H: this should look first in local and to back to original if it exists
-								comp_list.push_back(m);
-								idx_map.push_back(GetNumComponents() - 1);
-							} else {
-								factory->ReleaseComponent(m);
-								M3_ERR("Error reading config for %s\n", name.c_str());
-							}
-						} catch(...) {
-							M3_WARN("Error while parsing config files for %s %s \n",component_type, name.c_str());
-							factory->ReleaseComponent(m);
-						}
-
+						std::cout <<"------------------------------------------"<<std::endl;
+						std::cout <<"Component " << name<<" of type "<<type<<std::endl;
+						pending.push_back(M3PendingConfig(m, dir + "/" + name + ".yml", name, type));
 					}
 				}
 				//std::cout <<"------------------------------------------"<<std::endl;
 			}
+			}catch(...){
+				ReadPendingConfigs(component_type,pending,comp_list,idx_map);
+				throw;
+			}
+			ReadPendingConfigs(component_type,pending,comp_list,idx_map);
 		std::cout<<std::endl;
 		return true;
 	}